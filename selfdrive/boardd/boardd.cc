@@ -10,26 +10,65 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <assert.h>
 #include <pthread.h>
 
 #include <zmq.h>
-#include <libusb.h>
 
 #include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
 #include "cereal/gen/cpp/car.capnp.h"
 
+#include "common/msgq.h"
 #include "common/params.h"
 #include "common/swaglog.h"
 #include "common/timing.h"
 
-#include <algorithm>
+#include "panda.h"
 
-// double the FIFO size
-#define RECV_SIZE (0x1000)
-#define TIMEOUT 0
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// bulk reads kept in flight on 0x81, the next one is already queued while one is published
+#define RECV_TRANSFERS 4
+// reads that fail with the device still there are queued again after a backoff, doubled for
+// every failure in a row
+#define RECV_BACKOFF_MIN_US 1000
+#define RECV_BACKOFF_MAX_US (100*1000)
+
+// can recv latency histogram, 8us buckets over the 16 bit bus time range
+#define LATENCY_BUCKET_US 8
+#define LATENCY_BUCKETS (0x10000 / LATENCY_BUCKET_US)
+#define LATENCY_REPORT_NS (10ULL*1000*1000*1000)
+
+// usb queueing delay histograms, bucket i counts delays under 2^i us
+#define DELAY_BUCKETS 24
+
+// scheduler periods. the pigeon is read every PIGEON_MS while it sends, idle reads back off to
+// PIGEON_IDLE_MS, well inside what its 0x1000 byte buffer on the panda holds at 460800 baud
+#define HEALTH_MS 1000
+#define PIGEON_MS 10
+#define PIGEON_IDLE_MS 40
+#define REPORT_MS 10000
+
+// a full recv of frames as a can event: 3 words per frame (the CanData struct and its 8 byte dat)
+// plus the event and list headers. events are serialized into one of CAN_EVENT_BUFFERS buffers,
+// which zmq hands back once the event has gone out
+#define CAN_EVENT_FRAMES (RECV_SIZE/0x10)
+#define CAN_EVENT_WORDS (CAN_EVENT_FRAMES*3 + 16)
+#define CAN_EVENT_BUFFERS 8
+
+// ring for can events when MSGQ_SERVICES has can, a few seconds of full recvs
+#define CAN_MSGQ_SIZE (4 << 20)
+
+// sendcan frames waiting for the board. when a burst doesn't fit the oldest frames are dropped,
+// they're stale by then. the queue goes out on 0x03 in transfers of up to TX_TRANSFER_FRAMES
+#define TX_QUEUE_FRAMES 1024
+#define TX_TRANSFER_FRAMES 256
 
 #define SAFETY_NOOUTPUT  0
 #define SAFETY_HONDA 1
@@ -50,22 +89,88 @@ namespace {
 
 volatile int do_exit = 0;
 
-libusb_context *ctx = NULL;
-libusb_device_handle *dev_handle;
-pthread_mutex_t usb_lock;
+// libusb, the simulated panda with BOARDD_SIM or SocketCAN with BOARDD_SOCKETCAN
+const PandaTransport *panda = &panda_libusb;
+// counts connects, so a thread that lost the panda can tell whether another one reconnected
+uint32_t connection = 0;
+
+// the transports are thread safe, so transfers from different threads and on different endpoints
+// go out in parallel. usb_lock only keeps the panda from being reconnected under a transfer:
+// transfers hold it shared, reconnecting holds it exclusively
+pthread_rwlock_t usb_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// how long usb work waited before it started, to see what holds up the others
+struct DelayHistogram {
+  const char *name;
+  std::atomic<uint32_t> buckets[DELAY_BUCKETS];
+
+  void add(uint64_t nanos) {
+    const uint64_t us = nanos / 1000;
+    int i = 0;
+    while (i < DELAY_BUCKETS-1 && us >= (1ULL << i)) i++;
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // upper bound of the bucket the quantile falls in
+  static unsigned long long quantile_us(const uint32_t *counts, uint64_t total, double q) {
+    uint64_t seen = 0;
+    for (int i = 0; i < DELAY_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen > 0 && seen >= total * q) return 1ULL << i;
+    }
+    return 0;
+  }
+
+  void report() {
+    uint32_t counts[DELAY_BUCKETS];
+    unsigned long long total = 0;
+    char hist[DELAY_BUCKETS * 12] = {0};
+    int len = 0;
+    for (int i = 0; i < DELAY_BUCKETS; i++) {
+      counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+      total += counts[i];
+      len += snprintf(hist + len, sizeof(hist) - len, "%s%u", i ? "," : "", counts[i]);
+    }
+    LOG("usb delay %s: %llu, p50 < %llu us, p99 < %llu us, max < %llu us, log2 us buckets [%s]", name, total,
+        quantile_us(counts, total, 0.5), quantile_us(counts, total, 0.99), quantile_us(counts, total, 1.0), hist);
+  }
+};
+
+// sendcan queue is from receiving a sendcan to its transfer starting, the others are usb_lock waits
+DelayHistogram sendcan_queue_delay = {"sendcan queue"};
+DelayHistogram sendcan_transfer_time = {"sendcan transfer"};
+DelayHistogram control_delay = {"control"};
+DelayHistogram pigeon_delay = {"pigeon"};
+DelayHistogram recv_delay = {"can recv"};
+
+// time this thread held usb_lock through usb_lock_shared, which is time in transfers
+__thread uint64_t usb_locked_at = 0;
+__thread uint64_t usb_busy_nanos = 0;
+
+void usb_lock_shared(DelayHistogram *delay) {
+  const uint64_t t = nanos_since_boot();
+  pthread_rwlock_rdlock(&usb_lock);
+  usb_locked_at = nanos_since_boot();
+  delay->add(usb_locked_at - t);
+}
+
+void usb_unlock() {
+  if (usb_locked_at != 0) {
+    usb_busy_nanos += nanos_since_boot() - usb_locked_at;
+    usb_locked_at = 0;
+  }
+  pthread_rwlock_unlock(&usb_lock);
+}
 
 bool spoofing_started = false;
 bool fake_send = false;
 bool loopback_can = false;
 bool is_grey_panda = false;
+bool sync_recv = false;
 
 pthread_t safety_setter_thread_handle = -1;
-pthread_t pigeon_thread_handle = -1;
 bool pigeon_needs_init;
 
-void pigeon_init();
-void *pigeon_thread(void *crap);
-
 void *safety_setter_thread(void *s) {
   char *value;
   size_t value_sz = 0;
@@ -124,51 +229,45 @@ void *safety_setter_thread(void *s) {
     LOGE("unknown safety model: %d", safety_model);
   }
 
-  pthread_mutex_lock(&usb_lock);
+  usb_lock_shared(&control_delay);
 
-  // set in the mutex to avoid race
+  // set in the lock to avoid racing usb_connect, which holds it exclusively
   safety_setter_thread_handle = -1;
 
-  libusb_control_transfer(dev_handle, 0x40, 0xdc, safety_setting, safety_param, NULL, 0, TIMEOUT);
+  panda->control(0x40, 0xdc, safety_setting, safety_param, NULL, 0);
 
-  pthread_mutex_unlock(&usb_lock);
+  usb_unlock();
 
   return NULL;
 }
 
-// must be called before threads or with mutex
+// must be called before threads or with usb_lock held exclusively
 bool usb_connect() {
   int err;
   unsigned char is_pigeon[1] = {0};
 
-  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
-  if (dev_handle == NULL) { goto fail; }
-
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
-
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
+  if (!panda->connect()) { goto fail; }
+  connection++;
 
   if (loopback_can) {
-    libusb_control_transfer(dev_handle, 0xc0, 0xe5, 1, 0, NULL, 0, TIMEOUT);
+    panda->control(0xc0, 0xe5, 1, 0, NULL, 0);
   }
 
   // power off ESP
-  libusb_control_transfer(dev_handle, 0xc0, 0xd9, 0, 0, NULL, 0, TIMEOUT);
+  panda->control(0xc0, 0xd9, 0, 0, NULL, 0);
 
   // power on charging (may trigger a reconnection, should be okay)
   #ifndef __x86_64__
-    libusb_control_transfer(dev_handle, 0xc0, 0xe6, 1, 0, NULL, 0, TIMEOUT);
+    panda->control(0xc0, 0xe6, 1, 0, NULL, 0);
   #else
     LOGW("not enabling charging on x86_64");
   #endif
 
   // no output is the default
   if (getenv("RECVMOCK")) {
-    libusb_control_transfer(dev_handle, 0x40, 0xdc, SAFETY_ELM327, 0, NULL, 0, TIMEOUT);
+    panda->control(0x40, 0xdc, SAFETY_ELM327, 0, NULL, 0);
   } else {
-    libusb_control_transfer(dev_handle, 0x40, 0xdc, SAFETY_NOOUTPUT, 0, NULL, 0, TIMEOUT);
+    panda->control(0x40, 0xdc, SAFETY_NOOUTPUT, 0, NULL, 0);
   }
 
   if (safety_setter_thread_handle == -1) {
@@ -176,16 +275,12 @@ bool usb_connect() {
     assert(err == 0);
   }
 
-  libusb_control_transfer(dev_handle, 0xc0, 0xc1, 0, 0, is_pigeon, 1, TIMEOUT);
+  panda->control(0xc0, 0xc1, 0, 0, is_pigeon, 1);
 
   if (is_pigeon[0]) {
     LOGW("grey panda detected");
     is_grey_panda = true;
     pigeon_needs_init = true;
-    if (pigeon_thread_handle == -1) {
-      err = pthread_create(&pigeon_thread_handle, NULL, pigeon_thread, NULL);
-      assert(err == 0);
-    }
   }
 
   return true;
@@ -199,42 +294,108 @@ void usb_retry_connect() {
   LOGW("connected to board");
 }
 
+// called with usb_lock shared, which is traded for exclusive to reconnect
 void handle_usb_issue(int err, const char func[]) {
   LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
   if (err == -4) {
-    LOGE("lost connection");
-    usb_retry_connect();
+    const uint32_t lost = connection;
+    pthread_rwlock_unlock(&usb_lock);
+    pthread_rwlock_wrlock(&usb_lock);
+    // another thread may have reconnected in between
+    if (connection == lost) {
+      LOGE("lost connection");
+      usb_retry_connect();
+    }
+    pthread_rwlock_unlock(&usb_lock);
+    pthread_rwlock_rdlock(&usb_lock);
   }
   // TODO: check other errors, is simply retrying okay?
 }
 
-void can_recv(void *s) {
-  int err;
-  uint32_t data[RECV_SIZE/4];
-  int recv;
-  uint32_t f1, f2;
+// time from the panda receiving a frame to boardd publishing it. bus time is the low 16 bits of
+// the panda's microsecond timer with an unknown offset to our clock, so what is measured is the
+// latency above the lowest one seen in a report window: the panda's queue, usb and boardd.
+// the offset drifts a few tens of us per window, which is below what this is for
+struct RecvLatency {
+  uint32_t buckets[LATENCY_BUCKETS];
+  uint16_t base;
+  uint64_t frames;
+  uint64_t window_start;
+
+  void add(uint16_t bus_time, uint64_t publish_nanos) {
+    const uint16_t offset = (uint16_t)(publish_nanos / 1000) - bus_time;
+    if (frames == 0) {
+      // centered, so the window can move either way without wrapping
+      base = offset - 0x8000;
+    }
+    buckets[(uint16_t)(offset - base) / LATENCY_BUCKET_US]++;
+    frames++;
+  }
 
-  // do recv
-  pthread_mutex_lock(&usb_lock);
+  void maybe_report(uint64_t now) {
+    if (window_start == 0) window_start = now;
+    if (now - window_start < LATENCY_REPORT_NS || frames == 0) return;
+
+    int lowest = 0;
+    while (buckets[lowest] == 0) lowest++;
+
+    int p50 = -1, p99 = -1, highest = lowest;
+    uint64_t seen = 0;
+    for (int i = lowest; i < LATENCY_BUCKETS; i++) {
+      if (buckets[i] == 0) continue;
+      seen += buckets[i];
+      if (p50 < 0 && seen * 2 >= frames) p50 = i;
+      if (p99 < 0 && seen * 100 >= frames * 99) p99 = i;
+      highest = i;
+    }
+    LOG("can recv latency over %llu frames (%s): p50 %d us, p99 %d us, max %d us", frames,
+        sync_recv ? "sync" : "async", (p50 - lowest) * LATENCY_BUCKET_US,
+        (p99 - lowest) * LATENCY_BUCKET_US, (highest - lowest) * LATENCY_BUCKET_US);
 
-  do {
-    err = libusb_bulk_transfer(dev_handle, 0x81, (uint8_t*)data, RECV_SIZE, &recv, TIMEOUT);
-    if (err != 0) { handle_usb_issue(err, __func__); }
-    if (err == -8) { LOGE_100("overflow got 0x%x", recv); };
+    memset(buckets, 0, sizeof(buckets));
+    frames = 0;
+    window_start = now;
+  }
+};
 
-    // timeout is okay to exit, recv still happened
-    if (err == -7) { break; }
-  } while(err != 0);
+RecvLatency recv_latency;
 
-  pthread_mutex_unlock(&usb_lock);
+// the first segment every can event is built in. capnp needs it zeroed, MallocMessageBuilder
+// clears the words a build used when it's destroyed. only the recv thread builds can events
+capnp::word can_event_segment[CAN_EVENT_WORDS];
 
-  // return if length is 0
-  if (recv <= 0) {
-    return;
+struct CanEventBuffer {
+  std::atomic<bool> in_use;
+  // the segment table and the segment
+  capnp::word words[CAN_EVENT_WORDS + 1];
+};
+
+CanEventBuffer can_event_buffers[CAN_EVENT_BUFFERS];
+
+// local readers of can when it's on msgq. zmq still has everyone else, loggerd and python
+MsgqPub can_msgq;
+bool can_msgq_ready = false;
+
+// runs on a zmq io thread once the event is sent
+void can_event_buffer_free(void *data, void *hint) {
+  ((CanEventBuffer*)hint)->in_use.store(false, std::memory_order_release);
+}
+
+CanEventBuffer *can_event_buffer_get() {
+  for (int i = 0; i < CAN_EVENT_BUFFERS; i++) {
+    if (!can_event_buffers[i].in_use.load(std::memory_order_acquire)) {
+      can_event_buffers[i].in_use.store(true, std::memory_order_relaxed);
+      return &can_event_buffers[i];
+    }
   }
+  return NULL;
+}
 
+// builds the event in can_event_segment and sends it from a pooled buffer, so nothing is allocated
+// unless all the buffers are still queued in zmq or the event outgrew the segment
+void can_publish(void *s, const uint32_t *data, int recv) {
   // create message
-  capnp::MallocMessageBuilder msg;
+  capnp::MallocMessageBuilder msg(kj::arrayPtr(can_event_segment, CAN_EVENT_WORDS));
   cereal::Event::Builder event = msg.initRoot<cereal::Event>();
   event.setLogMonoTime(nanos_since_boot());
 
@@ -257,9 +418,246 @@ void can_recv(void *s) {
   }
 
   // send to can
-  auto words = capnp::messageToFlatArray(msg);
-  auto bytes = words.asBytes();
-  zmq_send(s, bytes.begin(), bytes.size(), 0);
+  auto segments = msg.getSegmentsForOutput();
+  const size_t size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+  CanEventBuffer *buf = NULL;
+  if (segments.size() == 1 && size <= sizeof(buf->words)) {
+    buf = can_event_buffer_get();
+  }
+  if (buf) {
+    kj::ArrayOutputStream stream(kj::arrayPtr((uint8_t*)buf->words, sizeof(buf->words)));
+    capnp::writeMessage(stream, msg);
+
+    zmq_msg_t zmsg;
+    zmq_msg_init_data(&zmsg, buf->words, size, can_event_buffer_free, buf);
+    if (zmq_msg_send(&zmsg, s, 0) < 0) {
+      zmq_msg_close(&zmsg);
+    }
+  } else {
+    auto words = capnp::messageToFlatArray(msg);
+    auto bytes = words.asBytes();
+    zmq_send(s, bytes.begin(), bytes.size(), 0);
+  }
+  if (can_msgq_ready) {
+    // serialized straight into the ring
+    kj::ArrayOutputStream stream(kj::arrayPtr((uint8_t*)msgq_pub_alloc(&can_msgq, size), size));
+    capnp::writeMessage(stream, msg);
+    msgq_pub_commit(&can_msgq, size);
+  }
+
+  const uint64_t published = nanos_since_boot();
+  for (int i = 0; i<(recv/0x10); i++) {
+    recv_latency.add(data[i*4+1] >> 16, published);
+  }
+  recv_latency.maybe_report(published);
+}
+
+// blocking read of whatever the panda has queued, polled by the recv thread
+void can_recv(void *s) {
+  int err;
+  uint32_t data[RECV_SIZE/4];
+  int recv;
+
+  // do recv
+  usb_lock_shared(&recv_delay);
+
+  do {
+    err = panda->bulk(0x81, (uint8_t*)data, RECV_SIZE, &recv);
+    if (err != 0) { handle_usb_issue(err, __func__); }
+    if (err == -8) { LOGE_100("overflow got 0x%x", recv); };
+
+    // timeout is okay to exit, recv still happened
+    if (err == -7) { break; }
+  } while(err != 0);
+
+  usb_unlock();
+
+  // return if length is 0
+  if (recv <= 0) {
+    return;
+  }
+
+  can_publish(s, data, recv);
+}
+
+// **** async can recv ****
+
+// RECV_TRANSFERS reads stay queued on 0x81, so the panda's queue is read again as soon as one
+// completes and frames go out as soon as the panda hands them over.
+// completions are only queued for the recv thread to publish, see RecvBuf
+RecvBuf recv_bufs[RECV_TRANSFERS];
+int recv_in_flight = 0;
+// the connection each read was queued on
+uint32_t recv_connections[RECV_TRANSFERS];
+
+// set when a read finds the device gone, it's reconnected once every read is back
+bool recv_device_gone = false;
+uint32_t recv_gone_connection = 0;
+// no reads are queued before recv_retry_at after an error
+int recv_backoff_us = 0;
+uint64_t recv_retry_at = 0;
+
+pthread_mutex_t recv_done_lock = PTHREAD_MUTEX_INITIALIZER;
+RecvBuf *recv_done[RECV_TRANSFERS];  // in completion order
+int recv_num_done = 0;
+
+void can_recv_done(RecvBuf *buf) {
+  pthread_mutex_lock(&recv_done_lock);
+  recv_done[recv_num_done++] = buf;
+  pthread_mutex_unlock(&recv_done_lock);
+}
+
+void can_recv_lost(uint32_t lost) {
+  if (!recv_device_gone) {
+    recv_device_gone = true;
+    recv_gone_connection = lost;
+  }
+}
+
+void can_recv_backoff() {
+  recv_backoff_us = std::min(std::max(recv_backoff_us * 2, RECV_BACKOFF_MIN_US), RECV_BACKOFF_MAX_US);
+  recv_retry_at = nanos_since_boot() + recv_backoff_us * 1000ULL;
+}
+
+// with usb_lock held
+bool can_recv_submit(RecvBuf *buf) {
+  buf->done = can_recv_done;
+  int err = panda->recv_submit(buf);
+  if (err != 0) {
+    LOGE_100("usb error %d \"%s\" submitting can recv", err, libusb_strerror((enum libusb_error)err));
+    if (err == LIBUSB_ERROR_NO_DEVICE) {
+      can_recv_lost(connection);
+    } else {
+      can_recv_backoff();
+    }
+    return false;
+  }
+  buf->in_flight = true;
+  recv_in_flight++;
+  recv_connections[buf - recv_bufs] = connection;
+  return true;
+}
+
+// publishes the completed reads, can_recv_resubmit queues them again
+void can_recv_handle_done(void *publisher) {
+  RecvBuf *done[RECV_TRANSFERS];
+  pthread_mutex_lock(&recv_done_lock);
+  const int num_done = recv_num_done;
+  memcpy(done, recv_done, num_done * sizeof(done[0]));
+  recv_num_done = 0;
+  pthread_mutex_unlock(&recv_done_lock);
+
+  for (int i = 0; i < num_done; i++) {
+    RecvBuf *buf = done[i];
+    buf->in_flight = false;
+    recv_in_flight--;
+
+    switch (buf->status) {
+    case RECV_COMPLETED:
+      recv_backoff_us = 0;
+      // the panda answers an empty queue with a zero length packet, nothing to publish
+      if (buf->length > 0) {
+        can_publish(publisher, buf->data, buf->length);
+      }
+      break;
+    case RECV_OVERFLOW:
+      LOGE_100("overflow got 0x%x", buf->length);
+      break;
+    case RECV_NO_DEVICE:
+      // a read queued before another thread reconnected says nothing about the new handle
+      pthread_rwlock_rdlock(&usb_lock);
+      if (recv_connections[buf - recv_bufs] == connection) {
+        can_recv_lost(connection);
+      }
+      pthread_rwlock_unlock(&usb_lock);
+      break;
+    case RECV_CANCELLED:
+      break;
+    case RECV_ERROR:
+      can_recv_backoff();
+      break;
+    }
+  }
+}
+
+// every read has to be back before the handle they were queued on is replaced: reconnect unless
+// another thread already did
+void can_recv_reconnect() {
+  pthread_rwlock_wrlock(&usb_lock);
+  if (recv_gone_connection == connection) {
+    LOGE("lost connection");
+    usb_retry_connect();
+  }
+  recv_device_gone = false;
+  recv_backoff_us = 0;
+  recv_retry_at = 0;
+  for (int i = 0; i < RECV_TRANSFERS; i++) {
+    if (!recv_bufs[i].in_flight && !can_recv_submit(&recv_bufs[i])) break;
+  }
+  usb_unlock();
+}
+
+// queues the reads that aren't in flight, unless the device is gone or an error is backed off from
+void can_recv_resubmit() {
+  if (recv_device_gone) {
+    if (recv_in_flight == 0) {
+      can_recv_reconnect();
+    }
+    return;
+  }
+  if (recv_in_flight == RECV_TRANSFERS || nanos_since_boot() < recv_retry_at) {
+    return;
+  }
+
+  // shared, so a reconnect can't happen while they're being queued
+  pthread_rwlock_rdlock(&usb_lock);
+  for (int i = 0; i < RECV_TRANSFERS; i++) {
+    if (!recv_bufs[i].in_flight && !can_recv_submit(&recv_bufs[i])) break;
+  }
+  usb_unlock();
+}
+
+// **** sendcan queue ****
+
+// a frame in the 0x10 byte format the board takes
+struct TxFrame {
+  uint32_t data[4];
+  uint64_t received;
+};
+
+// only the send thread touches the queue
+TxFrame tx_queue[TX_QUEUE_FRAMES];
+int tx_head = 0;
+int tx_count = 0;
+uint32_t tx_transfer[TX_TRANSFER_FRAMES*4];
+std::vector<capnp::word> tx_event;
+
+// published in health, which resets all but dropped
+struct TxStats {
+  std::atomic<uint32_t> depth_max;
+  std::atomic<uint32_t> dropped;
+  std::atomic<uint32_t> latency_max;
+  std::atomic<uint64_t> latency_sum;
+  std::atomic<uint32_t> latency_frames;
+};
+
+TxStats tx_stats;
+
+void atomic_max(std::atomic<uint32_t> *a, uint32_t v) {
+  uint32_t cur = a->load(std::memory_order_relaxed);
+  while (v > cur && !a->compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+}
+
+void tx_push(const uint32_t *data, uint64_t received) {
+  if (tx_count == TX_QUEUE_FRAMES) {
+    tx_head = (tx_head + 1) % TX_QUEUE_FRAMES;
+    tx_count--;
+    tx_stats.dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  TxFrame *f = &tx_queue[(tx_head + tx_count) % TX_QUEUE_FRAMES];
+  memcpy(f->data, data, sizeof(f->data));
+  f->received = received;
+  tx_count++;
 }
 
 void can_health(void *s) {
@@ -277,14 +675,14 @@ void can_health(void *s) {
   } health;
 
   // recv from board
-  pthread_mutex_lock(&usb_lock);
+  usb_lock_shared(&control_delay);
 
   do {
-    cnt = libusb_control_transfer(dev_handle, 0xc0, 0xd2, 0, 0, (unsigned char*)&health, sizeof(health), TIMEOUT);
+    cnt = panda->control(0xc0, 0xd2, 0, 0, (unsigned char*)&health, sizeof(health));
     if (cnt != sizeof(health)) { handle_usb_issue(cnt, __func__); }
   } while(cnt != sizeof(health));
 
-  pthread_mutex_unlock(&usb_lock);
+  usb_unlock();
 
   // create message
   capnp::MallocMessageBuilder msg;
@@ -305,6 +703,13 @@ void can_health(void *s) {
   healthData.setStartedSignalDetected(health.started_signal_detected);
   healthData.setIsGreyPanda(is_grey_panda);
 
+  const uint32_t latency_frames = tx_stats.latency_frames.exchange(0, std::memory_order_relaxed);
+  const uint64_t latency_sum = tx_stats.latency_sum.exchange(0, std::memory_order_relaxed);
+  healthData.setTxQueueDepth(tx_stats.depth_max.exchange(0, std::memory_order_relaxed));
+  healthData.setTxDropped(tx_stats.dropped.load(std::memory_order_relaxed));
+  healthData.setTxLatencyAvg(latency_frames ? latency_sum / latency_frames : 0);
+  healthData.setTxLatencyMax(tx_stats.latency_max.exchange(0, std::memory_order_relaxed));
+
   // send to health
   auto words = capnp::messageToFlatArray(msg);
   auto bytes = words.asBytes();
@@ -312,103 +717,132 @@ void can_health(void *s) {
 }
 
 
-void can_send(void *s) {
-  int err;
-
-  // recv from sendcan
-  zmq_msg_t msg;
-  zmq_msg_init(&msg);
-  err = zmq_msg_recv(&msg, s, 0);
-  assert(err >= 0);
-
-  // format for board, make copy due to alignment issues, will be freed on out of scope
-  auto amsg = kj::heapArray<capnp::word>((zmq_msg_size(&msg) / sizeof(capnp::word)) + 1);
-  memcpy(amsg.begin(), zmq_msg_data(&msg), zmq_msg_size(&msg));
+// queues the frames of a sendcan event
+void can_send_queue(zmq_msg_t *msg, uint64_t received) {
+  // format for board, copy due to alignment issues
+  const size_t words = (zmq_msg_size(msg) / sizeof(capnp::word)) + 1;
+  if (tx_event.size() < words) tx_event.resize(words);
+  memcpy(tx_event.data(), zmq_msg_data(msg), zmq_msg_size(msg));
 
-  capnp::FlatArrayMessageReader cmsg(amsg);
+  capnp::FlatArrayMessageReader cmsg(kj::arrayPtr(tx_event.data(), words));
   cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-  int msg_count = event.getCan().size();
+  auto sendcan = event.getSendcan();
 
-  uint32_t *send = (uint32_t*)malloc(msg_count*0x10);
-  memset(send, 0, msg_count*0x10);
-
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = event.getSendcan()[i];
+  for (int i = 0; i < sendcan.size(); i++) {
+    auto cmsg = sendcan[i];
+    uint32_t send[4] = {0};
     if (cmsg.getAddress() >= 0x800) {
       // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
+      send[0] = (cmsg.getAddress() << 3) | 5;
     } else {
       // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+      send[0] = (cmsg.getAddress() << 21) | 1;
     }
     assert(cmsg.getDat().size() <= 8);
-    send[i*4+1] = cmsg.getDat().size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], cmsg.getDat().begin(), cmsg.getDat().size());
+    send[1] = cmsg.getDat().size() | (cmsg.getSrc() << 4);
+    memcpy(&send[2], cmsg.getDat().begin(), cmsg.getDat().size());
+    tx_push(send, received);
   }
+}
 
-  // release msg
-  zmq_msg_close(&msg);
+// sends the queue in as few transfers as fit
+void can_send_flush() {
+  while (tx_count > 0) {
+    const int n = std::min(tx_count, TX_TRANSFER_FRAMES);
+    for (int i = 0; i < n; i++) {
+      memcpy(&tx_transfer[i*4], tx_queue[(tx_head + i) % TX_QUEUE_FRAMES].data, 0x10);
+    }
 
-  // send to board
-  int sent;
-  pthread_mutex_lock(&usb_lock);
+    int err, sent;
+    pthread_rwlock_rdlock(&usb_lock);
+    const uint64_t start = nanos_since_boot();
+    for (int i = 0; i < n; i++) {
+      sendcan_queue_delay.add(start - tx_queue[(tx_head + i) % TX_QUEUE_FRAMES].received);
+    }
+
+    if (!fake_send) {
+      do {
+        err = panda->bulk(3, (uint8_t*)tx_transfer, n*0x10, &sent);
+        if (err != 0 || n*0x10 != sent) { handle_usb_issue(err, __func__); }
+      } while(err != 0);
+    }
+    const uint64_t done = nanos_since_boot();
+    sendcan_transfer_time.add(done - start);
 
-  if (!fake_send) {
-    do {
-      err = libusb_bulk_transfer(dev_handle, 3, (uint8_t*)send, msg_count*0x10, &sent, TIMEOUT);
-      if (err != 0 || msg_count*0x10 != sent) { handle_usb_issue(err, __func__); }
-    } while(err != 0);
+    usb_unlock();
+
+    for (int i = 0; i < n; i++) {
+      const uint32_t latency = (done - tx_queue[(tx_head + i) % TX_QUEUE_FRAMES].received) / 1000;
+      tx_stats.latency_sum.fetch_add(latency, std::memory_order_relaxed);
+      atomic_max(&tx_stats.latency_max, latency);
+    }
+    tx_stats.latency_frames.fetch_add(n, std::memory_order_relaxed);
+
+    tx_head = (tx_head + n) % TX_QUEUE_FRAMES;
+    tx_count -= n;
   }
+}
 
-  pthread_mutex_unlock(&usb_lock);
+void can_send(void *s) {
+  int err;
 
-  // done
-  free(send);
+  // wait for sendcan, then take every other one that's already waiting
+  zmq_msg_t msg;
+  zmq_msg_init(&msg);
+  err = zmq_msg_recv(&msg, s, 0);
+  assert(err >= 0);
+  do {
+    can_send_queue(&msg, nanos_since_boot());
+    zmq_msg_close(&msg);
+    zmq_msg_init(&msg);
+  } while (zmq_msg_recv(&msg, s, ZMQ_DONTWAIT) >= 0);
+
+  // release msg
+  zmq_msg_close(&msg);
+
+  atomic_max(&tx_stats.depth_max, tx_count);
+  can_send_flush();
 }
 
 
 // **** threads ****
 
-void *thermal_thread(void *crap) {
-  int err;
-  LOGD("start thermal thread");
-
-  // thermal = 8005
-  void *context = zmq_ctx_new();
-  void *subscriber = zmq_socket(context, ZMQ_SUB);
-  zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, "", 0);
-  zmq_connect(subscriber, "tcp://127.0.0.1:8005");
+// the fan speed thermald last asked for, sent when it changes or the panda was reconnected
+uint16_t fan_speed = 0;
+uint16_t fan_speed_sent = 0;
+uint32_t fan_connection = 0;
 
-  // run as fast as messages come in
-  while (!do_exit) {
-    // recv from thermal
+void thermal_recv(void *subscriber) {
+  // the zmq fd is edge triggered, so every waiting message is taken
+  bool got = false;
+  while (true) {
     zmq_msg_t msg;
     zmq_msg_init(&msg);
-    err = zmq_msg_recv(&msg, subscriber, 0);
-    assert(err >= 0);
+    if (zmq_msg_recv(&msg, subscriber, ZMQ_DONTWAIT) < 0) {
+      zmq_msg_close(&msg);
+      break;
+    }
 
     // format for board, make copy due to alignment issues, will be freed on out of scope
-    // copied from send thread...
     auto amsg = kj::heapArray<capnp::word>((zmq_msg_size(&msg) / sizeof(capnp::word)) + 1);
     memcpy(amsg.begin(), zmq_msg_data(&msg), zmq_msg_size(&msg));
 
     capnp::FlatArrayMessageReader cmsg(amsg);
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-
-    uint16_t target_fan_speed = event.getThermal().getFanSpeed();
-    //LOGW("setting fan speed %d", target_fan_speed);
-
-    pthread_mutex_lock(&usb_lock);
-    libusb_control_transfer(dev_handle, 0xc0, 0xd3, target_fan_speed, 0, NULL, 0, TIMEOUT);
-    pthread_mutex_unlock(&usb_lock);
+    fan_speed = event.getThermal().getFanSpeed();
+    got = true;
 
     zmq_msg_close(&msg);
   }
 
-  // turn the fan off when we exit
-  libusb_control_transfer(dev_handle, 0xc0, 0xd3, 0, 0, NULL, 0, TIMEOUT);
-
-  return NULL;
+  if (got && (fan_speed != fan_speed_sent || fan_connection != connection)) {
+    //LOGW("setting fan speed %d", fan_speed);
+    usb_lock_shared(&control_delay);
+    panda->control(0xc0, 0xd3, fan_speed, 0, NULL, 0);
+    fan_speed_sent = fan_speed;
+    fan_connection = connection;
+    usb_unlock();
+  }
 }
 
 void *can_send_thread(void *crap) {
@@ -435,31 +869,51 @@ void *can_recv_thread(void *crap) {
   void *publisher = zmq_socket(context, ZMQ_PUB);
   zmq_bind(publisher, "tcp://*:8006");
 
-  // run at ~200hz
-  while (!do_exit) {
-    can_recv(publisher);
-    // 5ms
-    usleep(5*1000);
+  if (msgq_enabled("can")) {
+    can_msgq_ready = msgq_pub_init(&can_msgq, "can", CAN_MSGQ_SIZE) == 0;
+    if (!can_msgq_ready) {
+      LOGE("can msgq init failed, zmq only");
+    }
   }
-  return NULL;
-}
 
-void *can_health_thread(void *crap) {
-  LOGD("start health thread");
+  if (sync_recv) {
+    // run at ~200hz
+    while (!do_exit) {
+      can_recv(publisher);
+      // 5ms
+      usleep(5*1000);
+    }
+    return NULL;
+  }
 
-  // health = 8011
-  void *context = zmq_ctx_new();
-  void *publisher = zmq_socket(context, ZMQ_PUB);
-  zmq_bind(publisher, "tcp://*:8011");
+  can_recv_resubmit();
 
-  // run at 1hz
+  // no sleeps, wakes up when a read completes. shorter while reads wait out a backoff
   while (!do_exit) {
-    can_health(publisher);
-    usleep(1000*1000);
+    panda->recv_poll(recv_in_flight == RECV_TRANSFERS ? 100*1000 : RECV_BACKOFF_MIN_US);
+    can_recv_handle_done(publisher);
+
+    if (!do_exit) {
+      can_recv_resubmit();
+    }
+  }
+
+  for (int i = 0; i < RECV_TRANSFERS; i++) {
+    if (recv_bufs[i].in_flight) {
+      panda->recv_cancel(&recv_bufs[i]);
+    }
+  }
+  while (recv_in_flight > 0) {
+    panda->recv_poll(100*1000);
+    can_recv_handle_done(publisher);
+  }
+  for (int i = 0; i < RECV_TRANSFERS; i++) {
+    panda->recv_free(&recv_bufs[i]);
   }
   return NULL;
 }
 
+
 #define pigeon_send(x) _pigeon_send(x, sizeof(x)-1)
 
 void hexdump(unsigned char *d, int l) {
@@ -478,77 +932,84 @@ void _pigeon_send(const char *dat, int len) {
   for (int i=0; i<len; i+=0x20) {
     int ll = std::min(0x20, len-i);
     memcpy(&a[1], &dat[i], ll);
-    pthread_mutex_lock(&usb_lock);
-    err = libusb_bulk_transfer(dev_handle, 2, a, ll+1, &sent, TIMEOUT);
+    usb_lock_shared(&pigeon_delay);
+    err = panda->bulk(2, a, ll+1, &sent);
     if (err < 0) { handle_usb_issue(err, __func__); }
     /*assert(err == 0);
     assert(sent == ll+1);*/
     //hexdump(a, ll+1);
-    pthread_mutex_unlock(&usb_lock);
+    usb_unlock();
   }
 }
 
 void pigeon_set_power(int power) {
-  pthread_mutex_lock(&usb_lock);
-  int err = libusb_control_transfer(dev_handle, 0xc0, 0xd9, power, 0, NULL, 0, TIMEOUT);
+  usb_lock_shared(&pigeon_delay);
+  int err = panda->control(0xc0, 0xd9, power, 0, NULL, 0);
   if (err < 0) { handle_usb_issue(err, __func__); }
-  pthread_mutex_unlock(&usb_lock);
+  usb_unlock();
 }
 
 void pigeon_set_baud(int baud) {
   int err;
-  pthread_mutex_lock(&usb_lock);
-  err = libusb_control_transfer(dev_handle, 0xc0, 0xe2, 1, 0, NULL, 0, TIMEOUT);
+  usb_lock_shared(&pigeon_delay);
+  err = panda->control(0xc0, 0xe2, 1, 0, NULL, 0);
   if (err < 0) { handle_usb_issue(err, __func__); }
-  err = libusb_control_transfer(dev_handle, 0xc0, 0xe4, 1, baud/300, NULL, 0, TIMEOUT);
+  err = panda->control(0xc0, 0xe4, 1, baud/300, NULL, 0);
   if (err < 0) { handle_usb_issue(err, __func__); }
-  pthread_mutex_unlock(&usb_lock);
-}
-
-void pigeon_init() {
-  usleep(1000*1000);
-  LOGW("grey panda start");
-
-  // power off pigeon
-  pigeon_set_power(0);
-  usleep(100*1000);
-
-  // 9600 baud at init
-  pigeon_set_baud(9600);
-
-  // power on pigeon
-  pigeon_set_power(1);
-  usleep(500*1000);
-
-  // baud rate upping
-  pigeon_send("\x24\x50\x55\x42\x58\x2C\x34\x31\x2C\x31\x2C\x30\x30\x30\x37\x2C\x30\x30\x30\x33\x2C\x34\x36\x30\x38\x30\x30\x2C\x30\x2A\x31\x35\x0D\x0A");
-  usleep(100*1000);
-
-  // set baud rate to 460800
-  pigeon_set_baud(460800);
-  usleep(100*1000);
-
-  // init from ubloxd
-  pigeon_send("\xB5\x62\x06\x00\x14\x00\x03\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x01\x00\x00\x00\x00\x00\x1E\x7F");
-  pigeon_send("\xB5\x62\x06\x3E\x00\x00\x44\xD2");
-  pigeon_send("\xB5\x62\x06\x00\x14\x00\x00\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x19\x35");
-  pigeon_send("\xB5\x62\x06\x00\x14\x00\x01\x00\x00\x00\xC0\x08\x00\x00\x00\x08\x07\x00\x01\x00\x01\x00\x00\x00\x00\x00\xF4\x80");
-  pigeon_send("\xB5\x62\x06\x00\x14\x00\x04\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x1D\x85");
-  pigeon_send("\xB5\x62\x06\x00\x00\x00\x06\x18");
-  pigeon_send("\xB5\x62\x06\x00\x01\x00\x01\x08\x22");
-  pigeon_send("\xB5\x62\x06\x00\x01\x00\x02\x09\x23");
-  pigeon_send("\xB5\x62\x06\x00\x01\x00\x03\x0A\x24");
-  pigeon_send("\xB5\x62\x06\x08\x06\x00\x64\x00\x01\x00\x00\x00\x79\x10");
-  pigeon_send("\xB5\x62\x06\x24\x24\x00\x05\x00\x04\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x5A\x63");
-  pigeon_send("\xB5\x62\x06\x1E\x14\x00\x00\x00\x00\x00\x01\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x3C\x37");
-  pigeon_send("\xB5\x62\x06\x24\x00\x00\x2A\x84");
-  pigeon_send("\xB5\x62\x06\x23\x00\x00\x29\x81");
-  pigeon_send("\xB5\x62\x06\x1E\x00\x00\x24\x72");
-  pigeon_send("\xB5\x62\x06\x01\x03\x00\x01\x07\x01\x13\x51");
-  pigeon_send("\xB5\x62\x06\x01\x03\x00\x02\x15\x01\x22\x70");
-  pigeon_send("\xB5\x62\x06\x01\x03\x00\x02\x13\x01\x20\x6C");
-
-  LOGW("grey panda is ready to fly");
+  usb_unlock();
+}
+
+// pigeon_init in steps, run by the scheduler with the waits in between so the other tasks
+// aren't held up. returns the ms until the next step, -1 once the pigeon is ready
+int pigeon_init_step(int step) {
+  switch (step) {
+  case 0:
+    return 1000;
+  case 1:
+    LOGW("grey panda start");
+
+    // power off pigeon
+    pigeon_set_power(0);
+    return 100;
+  case 2:
+    // 9600 baud at init
+    pigeon_set_baud(9600);
+
+    // power on pigeon
+    pigeon_set_power(1);
+    return 500;
+  case 3:
+    // baud rate upping
+    pigeon_send("\x24\x50\x55\x42\x58\x2C\x34\x31\x2C\x31\x2C\x30\x30\x30\x37\x2C\x30\x30\x30\x33\x2C\x34\x36\x30\x38\x30\x30\x2C\x30\x2A\x31\x35\x0D\x0A");
+    return 100;
+  case 4:
+    // set baud rate to 460800
+    pigeon_set_baud(460800);
+    return 100;
+  default:
+    // init from ubloxd
+    pigeon_send("\xB5\x62\x06\x00\x14\x00\x03\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x01\x00\x00\x00\x00\x00\x1E\x7F");
+    pigeon_send("\xB5\x62\x06\x3E\x00\x00\x44\xD2");
+    pigeon_send("\xB5\x62\x06\x00\x14\x00\x00\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x19\x35");
+    pigeon_send("\xB5\x62\x06\x00\x14\x00\x01\x00\x00\x00\xC0\x08\x00\x00\x00\x08\x07\x00\x01\x00\x01\x00\x00\x00\x00\x00\xF4\x80");
+    pigeon_send("\xB5\x62\x06\x00\x14\x00\x04\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x1D\x85");
+    pigeon_send("\xB5\x62\x06\x00\x00\x00\x06\x18");
+    pigeon_send("\xB5\x62\x06\x00\x01\x00\x01\x08\x22");
+    pigeon_send("\xB5\x62\x06\x00\x01\x00\x02\x09\x23");
+    pigeon_send("\xB5\x62\x06\x00\x01\x00\x03\x0A\x24");
+    pigeon_send("\xB5\x62\x06\x08\x06\x00\x64\x00\x01\x00\x00\x00\x79\x10");
+    pigeon_send("\xB5\x62\x06\x24\x24\x00\x05\x00\x04\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x5A\x63");
+    pigeon_send("\xB5\x62\x06\x1E\x14\x00\x00\x00\x00\x00\x01\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x3C\x37");
+    pigeon_send("\xB5\x62\x06\x24\x00\x00\x2A\x84");
+    pigeon_send("\xB5\x62\x06\x23\x00\x00\x29\x81");
+    pigeon_send("\xB5\x62\x06\x1E\x00\x00\x24\x72");
+    pigeon_send("\xB5\x62\x06\x01\x03\x00\x01\x07\x01\x13\x51");
+    pigeon_send("\xB5\x62\x06\x01\x03\x00\x02\x15\x01\x22\x70");
+    pigeon_send("\xB5\x62\x06\x01\x03\x00\x02\x13\x01\x20\x6C");
+
+    LOGW("grey panda is ready to fly");
+    return -1;
+  }
 }
 
 static void pigeon_publish_raw(void *publisher, unsigned char *dat, int alen) {
@@ -566,45 +1027,200 @@ static void pigeon_publish_raw(void *publisher, unsigned char *dat, int alen) {
 }
 
 
-void *pigeon_thread(void *crap) {
-  // ubloxRaw = 8042
-  void *context = zmq_ctx_new();
-  void *publisher = zmq_socket(context, ZMQ_PUB);
-  zmq_bind(publisher, "tcp://*:8042");
+// the next pigeon_init_step, -1 while the pigeon is running
+int pigeon_step = -1;
+int pigeon_interval = PIGEON_MS;
 
-  // run at ~100hz
+// one pigeon init step or a read of everything the pigeon has sent, returns the ms until the next
+int pigeon_run(void *publisher) {
+  if (!is_grey_panda) {
+    // white panda, check again in case a grey one is plugged in
+    return HEALTH_MS;
+  }
+  if (pigeon_needs_init) {
+    pigeon_needs_init = false;
+    pigeon_step = 0;
+  }
+  if (pigeon_step >= 0) {
+    const int next = pigeon_init_step(pigeon_step++);
+    if (next >= 0) return next;
+    pigeon_step = -1;
+    return PIGEON_MS;
+  }
+
+  // as many 0x40 byte reads as it takes to empty the panda's buffer, published as one
   unsigned char dat[0x1000];
-  uint64_t cnt = 0;
-  while (!do_exit) {
-    if (pigeon_needs_init) {
-      pigeon_needs_init = false;
-      pigeon_init();
-    }
-    int alen = 0;
-    while (alen < 0xfc0) {
-      pthread_mutex_lock(&usb_lock);
-      int len = libusb_control_transfer(dev_handle, 0xc0, 0xe0, 1, 0, dat+alen, 0x40, TIMEOUT);
-      if (len < 0) { handle_usb_issue(len, __func__); }
-      pthread_mutex_unlock(&usb_lock);
-      if (len <= 0) break;
-
-      //printf("got %d\n", len);
-      alen += len;
-    }
-    if (alen > 0) {
-      if (dat[0] == (char)0x00){
-        LOGW("received invalid ublox message, resetting pigeon");
-        pigeon_init();
-      } else {
-        pigeon_publish_raw(publisher, dat, alen);
-      }
+  int alen = 0;
+  usb_lock_shared(&pigeon_delay);
+  while (alen < 0xfc0) {
+    int len = panda->control(0xc0, 0xe0, 1, 0, dat+alen, 0x40);
+    if (len < 0) { handle_usb_issue(len, __func__); }
+    if (len <= 0) break;
+
+    //printf("got %d\n", len);
+    alen += len;
+    if (len < 0x40) break;
+  }
+  usb_unlock();
+
+  if (alen > 0) {
+    if (dat[0] == (char)0x00){
+      LOGW("received invalid ublox message, resetting pigeon");
+      pigeon_step = 0;
+    } else {
+      pigeon_publish_raw(publisher, dat, alen);
     }
+    pigeon_interval = PIGEON_MS;
+  } else {
+    pigeon_interval = std::min(pigeon_interval * 2, PIGEON_IDLE_MS);
+  }
+  return pigeon_interval;
+}
+
+// **** scheduler ****
+
+// health, thermal and the pigeon share one thread. each task has a timerfd, or thermal's zmq fd,
+// in one epoll and runs when it's ready. runs, cpu time and usb time are kept per task and
+// logged every REPORT_MS with the usb delays
+struct SchedTask {
+  const char *name;
+  int fd;
+  void *sock;
+  void (*run)(SchedTask *task);
+
+  uint64_t runs;
+  uint64_t cpu_nanos;
+  uint64_t usb_nanos;
+};
+
+uint64_t thread_cpu_nanos() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
 
-    // 10ms
-    usleep(10*1000);
-    cnt++;
+int timer_init(int ms) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  assert(fd >= 0);
+  struct itimerspec spec = {
+    .it_interval = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L},
+    .it_value = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L},
+  };
+  timerfd_settime(fd, 0, &spec, NULL);
+  return fd;
+}
+
+// for one shot timers
+void timer_set(int fd, int ms) {
+  struct itimerspec spec = {
+    .it_interval = {0},
+    .it_value = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L},
+  };
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+void timer_clear(int fd) {
+  uint64_t expirations;
+  read(fd, &expirations, sizeof(expirations));
+}
+
+void health_task(SchedTask *task) {
+  timer_clear(task->fd);
+  can_health(task->sock);
+}
+
+void thermal_task(SchedTask *task) {
+  thermal_recv(task->sock);
+}
+
+void pigeon_task(SchedTask *task) {
+  timer_clear(task->fd);
+  timer_set(task->fd, pigeon_run(task->sock));
+}
+
+SchedTask sched_tasks[4];
+uint64_t sched_wakeups = 0;
+
+void report_task(SchedTask *task) {
+  timer_clear(task->fd);
+
+  const double window = REPORT_MS * 1e6;
+  for (auto &t : sched_tasks) {
+    if (t.run == report_task) continue;
+    LOG("task %s: %llu runs, cpu %.2f ms (%.3f%%), usb %.2f ms (%.3f%%)", t.name, (unsigned long long)t.runs,
+        t.cpu_nanos / 1e6, 100.0 * t.cpu_nanos / window, t.usb_nanos / 1e6, 100.0 * t.usb_nanos / window);
+    t.runs = t.cpu_nanos = t.usb_nanos = 0;
+  }
+  LOG("scheduler: %llu wakeups", (unsigned long long)sched_wakeups);
+  sched_wakeups = 0;
+
+  for (auto h : {&sendcan_queue_delay, &sendcan_transfer_time, &control_delay, &pigeon_delay, &recv_delay}) {
+    h->report();
   }
+}
 
+void *scheduler_thread(void *crap) {
+  LOGD("start scheduler thread");
+
+  void *context = zmq_ctx_new();
+
+  // health = 8011
+  void *health_publisher = zmq_socket(context, ZMQ_PUB);
+  zmq_bind(health_publisher, "tcp://*:8011");
+
+  // thermal = 8005
+  void *thermal_subscriber = zmq_socket(context, ZMQ_SUB);
+  zmq_setsockopt(thermal_subscriber, ZMQ_SUBSCRIBE, "", 0);
+  zmq_connect(thermal_subscriber, "tcp://127.0.0.1:8005");
+  int thermal_fd;
+  size_t thermal_fd_size = sizeof(thermal_fd);
+  zmq_getsockopt(thermal_subscriber, ZMQ_FD, &thermal_fd, &thermal_fd_size);
+
+  // ubloxRaw = 8042
+  void *pigeon_publisher = zmq_socket(context, ZMQ_PUB);
+  zmq_bind(pigeon_publisher, "tcp://*:8042");
+
+  sched_tasks[0] = {.name = "health", .fd = timer_init(HEALTH_MS), .sock = health_publisher, .run = health_task};
+  sched_tasks[1] = {.name = "thermal", .fd = thermal_fd, .sock = thermal_subscriber, .run = thermal_task};
+  sched_tasks[2] = {.name = "pigeon", .fd = timer_init(PIGEON_MS), .sock = pigeon_publisher, .run = pigeon_task};
+  sched_tasks[3] = {.name = "report", .fd = timer_init(REPORT_MS), .sock = NULL, .run = report_task};
+  // the pigeon's timer is set again after every run
+  timer_set(sched_tasks[2].fd, PIGEON_MS);
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  assert(epfd >= 0);
+  for (auto &t : sched_tasks) {
+    struct epoll_event ev = {.events = EPOLLIN, .data = {.ptr = &t}};
+    int err = epoll_ctl(epfd, EPOLL_CTL_ADD, t.fd, &ev);
+    assert(err == 0);
+  }
+
+  // health goes out right away, and thermal may have queued before its fd was watched
+  health_task(&sched_tasks[0]);
+  thermal_task(&sched_tasks[1]);
+
+  while (!do_exit) {
+    struct epoll_event events[4];
+    const int n = epoll_wait(epfd, events, 4, 100);
+    if (n > 0) sched_wakeups++;
+
+    for (int i = 0; i < n; i++) {
+      SchedTask *task = (SchedTask*)events[i].data.ptr;
+      const uint64_t cpu = thread_cpu_nanos();
+      const uint64_t usb = usb_busy_nanos;
+
+      task->run(task);
+
+      task->runs++;
+      task->cpu_nanos += thread_cpu_nanos() - cpu;
+      task->usb_nanos += usb_busy_nanos - usb;
+    }
+  }
+
+  // turn the fan off when we exit
+  panda->control(0xc0, 0xd3, 0, 0, NULL, 0);
+
+  close(epfd);
   return NULL;
 }
 
@@ -639,19 +1255,33 @@ int main() {
     loopback_can = true;
   }
 
-  // init libusb
-  err = libusb_init(&ctx);
-  assert(err == 0);
-  libusb_set_debug(ctx, 3);
+  // the old 5ms polling recv, to compare the recv latency against
+  if (getenv("BOARDD_SYNC_RECV")) {
+    sync_recv = true;
+  }
+
+  // a panda emulated in process, see panda_sim.cc
+  if (getenv("BOARDD_SIM")) {
+    panda = &panda_sim;
+  }
+
+  // SocketCAN interfaces, see panda_socketcan.cc
+  if (getenv("BOARDD_SOCKETCAN")) {
+    panda = &panda_socketcan;
+  }
+
+  // init the transport
+  bool ok = panda->init();
+  assert(ok);
 
   // connect to the board
   usb_retry_connect();
 
 
   // create threads
-  pthread_t can_health_thread_handle;
-  err = pthread_create(&can_health_thread_handle, NULL,
-                       can_health_thread, NULL);
+  pthread_t scheduler_thread_handle;
+  err = pthread_create(&scheduler_thread_handle, NULL,
+                       scheduler_thread, NULL);
   assert(err == 0);
 
   pthread_t can_send_thread_handle;
@@ -664,29 +1294,20 @@ int main() {
                        can_recv_thread, NULL);
   assert(err == 0);
 
-  pthread_t thermal_thread_handle;
-  err = pthread_create(&thermal_thread_handle, NULL,
-                       thermal_thread, NULL);
-  assert(err == 0);
-
   // join threads
 
-  err = pthread_join(thermal_thread_handle, NULL);
-  assert(err == 0);
-
   err = pthread_join(can_recv_thread_handle, NULL);
   assert(err == 0);
 
   err = pthread_join(can_send_thread_handle, NULL);
   assert(err == 0);
 
-  err = pthread_join(can_health_thread_handle, NULL);
+  err = pthread_join(scheduler_thread_handle, NULL);
   assert(err == 0);
 
   //while (!do_exit) usleep(1000);
 
-  // destruct libusb
+  // destruct the transport
 
-  libusb_close(dev_handle);
-  libusb_exit(ctx);
+  panda->close();
 }
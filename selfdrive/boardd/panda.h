@@ -0,0 +1,64 @@
+#ifndef BOARDD_PANDA_H
+#define BOARDD_PANDA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libusb.h>
+
+// double the FIFO size
+#define RECV_SIZE (0x1000)
+
+// how boardd reaches the panda. the calls mirror libusb's and return its error codes whatever the
+// backend, so boardd handles a real and a simulated panda the same way.
+// panda_libusb talks to a real panda, panda_sim emulates one in process and panda_socketcan
+// stands in for one with SocketCAN interfaces
+
+enum RecvStatus {
+  RECV_COMPLETED,
+  RECV_OVERFLOW,
+  RECV_NO_DEVICE,
+  RECV_CANCELLED,
+  RECV_ERROR,
+};
+
+// a queued read of the can endpoint
+typedef struct RecvBuf {
+  uint32_t data[RECV_SIZE/4];
+  int length;
+  enum RecvStatus status;
+  bool in_flight;
+
+  // called when the read finishes. with libusb that's on whichever thread is handling events,
+  // which includes threads doing synchronous transfers, so it should only queue the buffer
+  void (*done)(struct RecvBuf *buf);
+  // owned by the backend
+  void *impl;
+} RecvBuf;
+
+typedef struct PandaTransport {
+  const char *name;
+
+  bool (*init)(void);
+  // opens the panda and claims it, false if it isn't there. replaces the last connection, reads
+  // still queued on it finish as cancelled or no device first
+  bool (*connect)(void);
+  void (*close)(void);
+
+  // libusb_control_transfer and libusb_bulk_transfer without the handle and timeout
+  int (*control)(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                 unsigned char *data, uint16_t length);
+  int (*bulk)(unsigned char endpoint, unsigned char *data, int length, int *transferred);
+
+  // queued reads of 0x81 for the async recv. recv_poll waits up to timeout_us for reads to finish
+  int (*recv_submit)(RecvBuf *buf);
+  void (*recv_cancel)(RecvBuf *buf);
+  void (*recv_poll)(int timeout_us);
+  void (*recv_free)(RecvBuf *buf);
+} PandaTransport;
+
+extern const PandaTransport panda_libusb;
+extern const PandaTransport panda_sim;
+extern const PandaTransport panda_socketcan;
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <assert.h>
+
+#include <libusb.h>
+
+#include <atomic>
+
+#include "common/swaglog.h"
+
+#include "panda.h"
+
+#define TIMEOUT 0
+
+namespace {
+
+libusb_context *ctx = NULL;
+libusb_device_handle *dev_handle = NULL;
+
+// every transfer usb_recv_submit allocated, so a reconnect can cancel the ones still queued on
+// the old handle
+libusb_transfer *transfers[16];
+int num_transfers = 0;
+std::atomic<int> transfers_in_flight(0);
+
+bool usb_init() {
+  int err = libusb_init(&ctx);
+  if (err != 0) return false;
+  libusb_set_debug(ctx, 3);
+  return true;
+}
+
+// libusb drops the callbacks of transfers still queued when their handle is closed, so they're
+// cancelled and run first. up to a second, the callbacks only queue the buffers
+void usb_close_handle() {
+  if (dev_handle == NULL) return;
+
+  for (int i = 0; i < num_transfers; i++) {
+    libusb_cancel_transfer(transfers[i]);
+  }
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 10*1000};
+  for (int i = 0; i < 100 && transfers_in_flight > 0; i++) {
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+  if (transfers_in_flight > 0) {
+    LOGE("closing usb handle with %d can recv transfers queued", transfers_in_flight.load());
+  }
+
+  libusb_close(dev_handle);
+  dev_handle = NULL;
+}
+
+bool usb_connect() {
+  int err;
+
+  usb_close_handle();
+
+  dev_handle = libusb_open_device_with_vid_pid(ctx, 0xbbaa, 0xddcc);
+  if (dev_handle == NULL) { goto fail; }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  return true;
+fail:
+  usb_close_handle();
+  return false;
+}
+
+void usb_close() {
+  usb_close_handle();
+  libusb_exit(ctx);
+}
+
+int usb_control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                unsigned char *data, uint16_t length) {
+  return libusb_control_transfer(dev_handle, request_type, request, value, index, data, length, TIMEOUT);
+}
+
+int usb_bulk(unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+  return libusb_bulk_transfer(dev_handle, endpoint, data, length, transferred, TIMEOUT);
+}
+
+void usb_recv_done(libusb_transfer *transfer) {
+  RecvBuf *buf = (RecvBuf*)transfer->user_data;
+  transfers_in_flight--;
+  buf->length = transfer->actual_length;
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    buf->status = RECV_COMPLETED;
+    break;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    buf->status = RECV_OVERFLOW;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    buf->status = RECV_NO_DEVICE;
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+    buf->status = RECV_CANCELLED;
+    break;
+  default:
+    LOGE_100("can recv transfer status %d", transfer->status);
+    buf->status = RECV_ERROR;
+    break;
+  }
+  buf->done(buf);
+}
+
+int usb_recv_submit(RecvBuf *buf) {
+  if (buf->impl == NULL) {
+    buf->impl = libusb_alloc_transfer(0);
+    assert(buf->impl);
+    assert(num_transfers < (int)(sizeof(transfers) / sizeof(transfers[0])));
+    transfers[num_transfers++] = (libusb_transfer*)buf->impl;
+  }
+  libusb_transfer *transfer = (libusb_transfer*)buf->impl;
+  libusb_fill_bulk_transfer(transfer, dev_handle, 0x81, (uint8_t*)buf->data, RECV_SIZE,
+                            usb_recv_done, buf, TIMEOUT);
+  // counted first, the callback can run on another thread before submit returns
+  transfers_in_flight++;
+  int err = libusb_submit_transfer(transfer);
+  if (err != 0) {
+    transfers_in_flight--;
+  }
+  return err;
+}
+
+void usb_recv_cancel(RecvBuf *buf) {
+  libusb_cancel_transfer((libusb_transfer*)buf->impl);
+}
+
+void usb_recv_poll(int timeout_us) {
+  struct timeval tv = {.tv_sec = timeout_us / 1000000, .tv_usec = timeout_us % 1000000};
+  libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+void usb_recv_free(RecvBuf *buf) {
+  for (int i = 0; i < num_transfers; i++) {
+    if (transfers[i] == buf->impl) {
+      transfers[i] = transfers[--num_transfers];
+      break;
+    }
+  }
+  libusb_free_transfer((libusb_transfer*)buf->impl);
+  buf->impl = NULL;
+}
+
+}
+
+const PandaTransport panda_libusb = {
+  .name = "libusb",
+  .init = usb_init,
+  .connect = usb_connect,
+  .close = usb_close,
+  .control = usb_control,
+  .bulk = usb_bulk,
+  .recv_submit = usb_recv_submit,
+  .recv_cancel = usb_recv_cancel,
+  .recv_poll = usb_recv_poll,
+  .recv_free = usb_recv_free,
+};
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#include <algorithm>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+
+#include "panda.h"
+
+// a panda emulated in process, so boardd's threads, batching and latency can be run and measured
+// without hardware. it keeps the panda's formats: 0x10 byte can frames with the bus time in the
+// low 16 bits of a microsecond clock, the health struct and a ublox stream on 0xe0. can frames
+// arrive at BOARDD_SIM_CAN_HZ spread over BOARDD_SIM_BUSES buses and ublox NAV-PVTs at
+// BOARDD_SIM_UBLOX_HZ, 0 makes it a white panda. frames and ublox bytes are generated when read,
+// at the times they were due, so nothing runs between reads
+
+// usb full speed: reads of an empty queue come back at the next 1ms frame, and bulk data moves at
+// 19 packets of 64 bytes per frame
+#define SIM_USB_FRAME_US 1000
+#define SIM_BULK_BYTES_PER_MS (19*64)
+
+// like the panda's can_rx_q, frames that arrive while it's full are lost
+#define SIM_RX_QUEUE_FRAMES 0x1000
+#define SIM_ADDRESSES 32
+
+#define SIM_UBLOX_QUEUE 0x1000
+#define SIM_UBLOX_PAYLOAD 92
+
+#define SIM_MAX_PENDING 16
+
+namespace {
+
+// copied from board/main.c
+struct __attribute__((packed)) health {
+  uint32_t voltage;
+  uint32_t current;
+  uint8_t started;
+  uint8_t controls_allowed;
+  uint8_t gas_interceptor_detected;
+  uint8_t started_signal_detected;
+  uint8_t started_alt;
+};
+
+struct SimPanda {
+  pthread_mutex_t lock;
+
+  double can_hz;
+  int buses;
+  double ublox_hz;
+  bool started;
+
+  uint64_t start_nanos;
+  bool connected;
+  bool loopback;
+  bool pigeon_power;
+  uint16_t safety_model;
+
+  // can_rx_q
+  uint32_t rx_queue[SIM_RX_QUEUE_FRAMES][4];
+  int rx_head, rx_count;
+  uint64_t rx_generated, rx_lost, rx_read;
+  uint64_t tx_frames;
+
+  // pigeon uart
+  unsigned char ublox_queue[SIM_UBLOX_QUEUE];
+  int ublox_head, ublox_count;
+  uint64_t ublox_generated, ublox_lost;
+
+  // queued reads of 0x81 in submit order
+  RecvBuf *pending[SIM_MAX_PENDING];
+  int num_pending;
+};
+
+SimPanda sim = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+double env_double(const char *name, double def) {
+  const char *s = getenv(name);
+  return s ? atof(s) : def;
+}
+
+uint16_t bus_time(uint64_t nanos) {
+  return (nanos / 1000) & 0xFFFF;
+}
+
+// time the nth thing arrives at rate hz
+uint64_t arrival(uint64_t n, double hz) {
+  return sim.start_nanos + (uint64_t)(n * 1e9 / hz);
+}
+
+// with the lock
+void rx_push(const uint32_t *frame) {
+  if (sim.rx_count == SIM_RX_QUEUE_FRAMES) {
+    sim.rx_lost++;
+    return;
+  }
+  memcpy(sim.rx_queue[(sim.rx_head + sim.rx_count) % SIM_RX_QUEUE_FRAMES], frame, 0x10);
+  sim.rx_count++;
+}
+
+// every frame that's due by now, with the lock
+void rx_generate(uint64_t now) {
+  if (sim.can_hz <= 0) return;
+  while (arrival(sim.rx_generated, sim.can_hz) <= now) {
+    const uint64_t n = sim.rx_generated++;
+    const int bus = n % sim.buses;
+    const int i = (n / sim.buses) % SIM_ADDRESSES;
+
+    uint32_t frame[4];
+    if (i % 8 == 7) {
+      // extended
+      frame[0] = ((0x18DAF100 + i) << 3) | 4;
+    } else {
+      frame[0] = (0x100 + i) << 21;
+    }
+    frame[1] = 8 | (bus << 4) | (bus_time(arrival(n, sim.can_hz)) << 16);
+    frame[2] = n;
+    frame[3] = n >> 32;
+    rx_push(frame);
+  }
+}
+
+// up to max frames from the queue into out, with the lock
+int rx_pop(uint32_t *out, int max) {
+  const int n = std::min(sim.rx_count, max);
+  for (int i = 0; i < n; i++) {
+    memcpy(&out[i*4], sim.rx_queue[(sim.rx_head + i) % SIM_RX_QUEUE_FRAMES], 0x10);
+  }
+  sim.rx_head = (sim.rx_head + n) % SIM_RX_QUEUE_FRAMES;
+  sim.rx_count -= n;
+  sim.rx_read += n;
+  return n;
+}
+
+// every NAV-PVT that's due by now, with the lock. the pigeon is silent while it's off
+void ublox_generate(uint64_t now) {
+  if (sim.ublox_hz <= 0) return;
+  while (arrival(sim.ublox_generated, sim.ublox_hz) <= now) {
+    const uint64_t n = sim.ublox_generated++;
+    if (!sim.pigeon_power) continue;
+
+    unsigned char msg[8 + SIM_UBLOX_PAYLOAD] = {0xB5, 0x62, 0x01, 0x07, SIM_UBLOX_PAYLOAD, 0x00};
+    const uint32_t itow = arrival(n, sim.ublox_hz) / 1000000;
+    memcpy(&msg[6], &itow, sizeof(itow));
+    unsigned char ck_a = 0, ck_b = 0;
+    for (int i = 2; i < 6 + SIM_UBLOX_PAYLOAD; i++) {
+      ck_a += msg[i];
+      ck_b += ck_a;
+    }
+    msg[6 + SIM_UBLOX_PAYLOAD] = ck_a;
+    msg[7 + SIM_UBLOX_PAYLOAD] = ck_b;
+
+    if (sim.ublox_count + (int)sizeof(msg) > SIM_UBLOX_QUEUE) {
+      sim.ublox_lost++;
+      continue;
+    }
+    for (int i = 0; i < (int)sizeof(msg); i++) {
+      sim.ublox_queue[(sim.ublox_head + sim.ublox_count + i) % SIM_UBLOX_QUEUE] = msg[i];
+    }
+    sim.ublox_count += sizeof(msg);
+  }
+}
+
+// how long a bulk transfer of length bytes keeps the bus
+void transfer_delay(int length) {
+  usleep(length * 1000 / SIM_BULK_BYTES_PER_MS);
+}
+
+bool sim_init() {
+  sim.can_hz = env_double("BOARDD_SIM_CAN_HZ", 3000);
+  sim.buses = std::max(1, (int)env_double("BOARDD_SIM_BUSES", 3));
+  sim.ublox_hz = env_double("BOARDD_SIM_UBLOX_HZ", 10);
+  sim.started = getenv("BOARDD_SIM_STARTED") != NULL;
+  sim.start_nanos = nanos_since_boot();
+  LOGW("simulated panda: %.0f can frames/s on %d buses, %.0f ublox msgs/s", sim.can_hz, sim.buses, sim.ublox_hz);
+  return true;
+}
+
+bool sim_connect() {
+  pthread_mutex_lock(&sim.lock);
+  sim.connected = true;
+  pthread_mutex_unlock(&sim.lock);
+  return true;
+}
+
+void sim_close() {
+  pthread_mutex_lock(&sim.lock);
+  sim.connected = false;
+  LOG("simulated panda: %llu can frames, %llu read, %llu lost, %llu sent, %llu ublox msgs, %llu lost",
+      (unsigned long long)sim.rx_generated, (unsigned long long)sim.rx_read, (unsigned long long)sim.rx_lost,
+      (unsigned long long)sim.tx_frames, (unsigned long long)sim.ublox_generated, (unsigned long long)sim.ublox_lost);
+  pthread_mutex_unlock(&sim.lock);
+}
+
+int sim_control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                unsigned char *data, uint16_t length) {
+  int ret = 0;
+  pthread_mutex_lock(&sim.lock);
+  switch (request) {
+  // get is grey
+  case 0xc1:
+    if (length >= 1) {
+      data[0] = sim.ublox_hz > 0;
+      ret = 1;
+    }
+    break;
+  // get health
+  case 0xd2: {
+    struct health h = {
+      .voltage = 12000,
+      .current = 500,
+      .started = sim.started,
+      .controls_allowed = sim.safety_model != 0,
+    };
+    ret = std::min((int)length, (int)sizeof(h));
+    memcpy(data, &h, ret);
+    break;
+  }
+  // set esp and pigeon power
+  case 0xd9:
+    sim.pigeon_power = value;
+    break;
+  // set safety model
+  case 0xdc:
+    sim.safety_model = value;
+    break;
+  // read pigeon
+  case 0xe0:
+    ublox_generate(nanos_since_boot());
+    ret = std::min((int)length, sim.ublox_count);
+    for (int i = 0; i < ret; i++) {
+      data[i] = sim.ublox_queue[(sim.ublox_head + i) % SIM_UBLOX_QUEUE];
+    }
+    sim.ublox_head = (sim.ublox_head + ret) % SIM_UBLOX_QUEUE;
+    sim.ublox_count -= ret;
+    break;
+  // set can loopback
+  case 0xe5:
+    sim.loopback = value;
+    break;
+  // fan speed, charging and uart setup have nothing to emulate
+  default:
+    break;
+  }
+  if (!sim.connected) ret = LIBUSB_ERROR_NO_DEVICE;
+  pthread_mutex_unlock(&sim.lock);
+  return ret;
+}
+
+int sim_bulk(unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+  pthread_mutex_lock(&sim.lock);
+  if (!sim.connected) {
+    pthread_mutex_unlock(&sim.lock);
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  const uint64_t now = nanos_since_boot();
+  if (endpoint == 0x81) {
+    rx_generate(now);
+    *transferred = rx_pop((uint32_t*)data, length / 0x10) * 0x10;
+  } else if (endpoint == 3) {
+    assert(length % 0x10 == 0);
+    const uint32_t *frames = (const uint32_t*)data;
+    for (int i = 0; i < length / 0x10; i++) {
+      if (sim.loopback) {
+        rx_generate(now);
+        // sent frames come back with the tx bit (1) cleared and the bus time of now
+        const uint32_t frame[4] = {frames[i*4] & ~1U, (frames[i*4+1] & 0xFFFF) | (bus_time(now) << 16),
+                                   frames[i*4+2], frames[i*4+3]};
+        rx_push(frame);
+      }
+    }
+    sim.tx_frames += length / 0x10;
+    *transferred = length;
+  } else {
+    // pigeon uart
+    *transferred = length;
+  }
+  pthread_mutex_unlock(&sim.lock);
+
+  transfer_delay(*transferred);
+  return 0;
+}
+
+int sim_recv_submit(RecvBuf *buf) {
+  pthread_mutex_lock(&sim.lock);
+  int ret = 0;
+  if (!sim.connected) {
+    ret = LIBUSB_ERROR_NO_DEVICE;
+  } else {
+    assert(sim.num_pending < SIM_MAX_PENDING);
+    sim.pending[sim.num_pending++] = buf;
+  }
+  pthread_mutex_unlock(&sim.lock);
+  return ret;
+}
+
+void sim_recv_cancel(RecvBuf *buf) {
+  pthread_mutex_lock(&sim.lock);
+  bool found = false;
+  for (int i = 0; i < sim.num_pending; i++) {
+    if (sim.pending[i] == buf) {
+      memmove(&sim.pending[i], &sim.pending[i+1], (sim.num_pending - i - 1) * sizeof(sim.pending[0]));
+      sim.num_pending--;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sim.lock);
+
+  if (found) {
+    buf->length = 0;
+    buf->status = RECV_CANCELLED;
+    buf->done(buf);
+  }
+}
+
+// the oldest queued read is answered at the next usb frame with whatever has arrived by then
+void sim_recv_poll(int timeout_us) {
+  const uint64_t now = nanos_since_boot();
+  const uint64_t frame_nanos = SIM_USB_FRAME_US * 1000ULL;
+  const uint64_t next_frame = (now / frame_nanos + 1) * frame_nanos;
+  const uint64_t deadline = now + timeout_us * 1000ULL;
+
+  pthread_mutex_lock(&sim.lock);
+  const bool pending = sim.num_pending > 0;
+  pthread_mutex_unlock(&sim.lock);
+
+  if (!pending || next_frame > deadline) {
+    usleep(timeout_us);
+    return;
+  }
+  usleep((next_frame - now) / 1000);
+
+  pthread_mutex_lock(&sim.lock);
+  if (sim.num_pending == 0) {
+    // cancelled in the meantime
+    pthread_mutex_unlock(&sim.lock);
+    return;
+  }
+  RecvBuf *buf = sim.pending[0];
+  memmove(&sim.pending[0], &sim.pending[1], (sim.num_pending - 1) * sizeof(sim.pending[0]));
+  sim.num_pending--;
+
+  if (sim.connected) {
+    rx_generate(nanos_since_boot());
+    buf->length = rx_pop(buf->data, RECV_SIZE / 0x10) * 0x10;
+    buf->status = RECV_COMPLETED;
+  } else {
+    buf->length = 0;
+    buf->status = RECV_NO_DEVICE;
+  }
+  pthread_mutex_unlock(&sim.lock);
+
+  transfer_delay(buf->length);
+  buf->done(buf);
+}
+
+void sim_recv_free(RecvBuf *buf) {
+}
+
+}
+
+const PandaTransport panda_sim = {
+  .name = "sim",
+  .init = sim_init,
+  .connect = sim_connect,
+  .close = sim_close,
+  .control = sim_control,
+  .bulk = sim_bulk,
+  .recv_submit = sim_recv_submit,
+  .recv_cancel = sim_recv_cancel,
+  .recv_poll = sim_recv_poll,
+  .recv_free = sim_recv_free,
+};
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "common/swaglog.h"
+
+#include "panda.h"
+
+// SocketCAN interfaces in place of a panda, for bench rigs, test stations and vcan.
+// BOARDD_SOCKETCAN lists the interfaces, the nth one is bus n: "can0,can1,vcan0".
+// frames are read and written in batches with recvmmsg and sendmmsg and converted to and from
+// the panda's 0x10 byte format, with the bus time taken from the hardware rx timestamp when the
+// driver has one and the kernel's otherwise. frames of different buses are ordered by the kernel's.
+// there is no panda firmware in between, so the no output safety model is enforced here by
+// dropping sendcan, and there's no pigeon
+
+#define SOCKETCAN_MAX_BUSES 8
+#define SOCKETCAN_BATCH (RECV_SIZE/0x10)
+#define SOCKETCAN_MAX_PENDING 16
+// retries of a send the interface's tx queue has no room for, 100us apart
+#define SOCKETCAN_SEND_RETRIES 50
+
+#define SAFETY_NOOUTPUT 0
+
+namespace {
+
+// copied from board/main.c
+struct __attribute__((packed)) health {
+  uint32_t voltage;
+  uint32_t current;
+  uint8_t started;
+  uint8_t controls_allowed;
+  uint8_t gas_interceptor_detected;
+  uint8_t started_signal_detected;
+  uint8_t started_alt;
+};
+
+struct RxFrame {
+  // kernel rx time, the order across buses
+  uint64_t nanos;
+  uint32_t data[4];
+};
+
+struct SocketCan {
+  char names[SOCKETCAN_MAX_BUSES][IFNAMSIZ];
+  int num_buses;
+  int fds[SOCKETCAN_MAX_BUSES];
+  bool loopback;
+  // set by the safety setter while the send thread checks it, both with usb_lock only shared
+  std::atomic<uint16_t> safety_model;
+
+  // rx, with rx_lock
+  pthread_mutex_t rx_lock;
+  struct mmsghdr rx_msgs[SOCKETCAN_BATCH];
+  struct iovec rx_iovs[SOCKETCAN_BATCH];
+  struct can_frame rx_frames[SOCKETCAN_BATCH];
+  char rx_control[SOCKETCAN_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct timespec))];
+  RxFrame rx_batch[SOCKETCAN_BATCH];
+  RecvBuf *pending[SOCKETCAN_MAX_PENDING];
+  int num_pending;
+
+  // tx, only the send thread writes
+  struct mmsghdr tx_msgs[SOCKETCAN_BATCH];
+  struct iovec tx_iovs[SOCKETCAN_BATCH];
+  struct can_frame tx_frames[SOCKETCAN_BATCH];
+};
+
+SocketCan scan = {.rx_lock = PTHREAD_MUTEX_INITIALIZER};
+
+bool device_gone(int err) {
+  return err == ENETDOWN || err == ENODEV || err == ENXIO;
+}
+
+void close_sockets() {
+  for (int i = 0; i < scan.num_buses; i++) {
+    if (scan.fds[i] >= 0) {
+      close(scan.fds[i]);
+      scan.fds[i] = -1;
+    }
+  }
+}
+
+int open_socket(const char *name) {
+  const unsigned int ifindex = if_nametoindex(name);
+  if (ifindex == 0) return -1;
+
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) return -1;
+
+  struct sockaddr_can addr = {0};
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  // hardware timestamps when the driver has them, both are asked for and the rx side picks
+  int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+              SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  }
+
+  // like the panda's loopback mode, frames boardd sends come back on can
+  int own = scan.loopback;
+  setsockopt(fd, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &own, sizeof(own));
+  return fd;
+}
+
+uint64_t timespec_nanos(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// the kernel's rx time orders frames across buses, the hardware timestamp is on the NIC's clock,
+// which isn't shared between interfaces, so it's only used for the bus time
+void rx_timestamps(struct msghdr *msg, uint64_t *order_nanos, uint64_t *bus_nanos) {
+  *order_nanos = *bus_nanos = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET) continue;
+    if (c->cmsg_type == SCM_TIMESTAMPING) {
+      const struct scm_timestamping *ts = (const struct scm_timestamping*)CMSG_DATA(c);
+      *order_nanos = timespec_nanos(&ts->ts[0]);
+      *bus_nanos = timespec_nanos(&ts->ts[2]);
+    } else if (c->cmsg_type == SCM_TIMESTAMPNS) {
+      *order_nanos = timespec_nanos((const struct timespec*)CMSG_DATA(c));
+    }
+  }
+  if (*bus_nanos == 0) *bus_nanos = *order_nanos;
+}
+
+// reads up to max frames of one bus into out. returns the number of frames or a libusb error
+int rx_read_bus(int bus, RxFrame *out, int max) {
+  for (int i = 0; i < max; i++) {
+    scan.rx_iovs[i] = {.iov_base = &scan.rx_frames[i], .iov_len = sizeof(struct can_frame)};
+    memset(&scan.rx_msgs[i], 0, sizeof(scan.rx_msgs[i]));
+    scan.rx_msgs[i].msg_hdr.msg_iov = &scan.rx_iovs[i];
+    scan.rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    scan.rx_msgs[i].msg_hdr.msg_control = scan.rx_control[i];
+    scan.rx_msgs[i].msg_hdr.msg_controllen = sizeof(scan.rx_control[i]);
+  }
+
+  const int got = recvmmsg(scan.fds[bus], scan.rx_msgs, max, MSG_DONTWAIT, NULL);
+  if (got < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    LOGE_100("socketcan recv on %s: %s", scan.names[bus], strerror(errno));
+    return device_gone(errno) ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+  }
+
+  for (int i = 0; i < got; i++) {
+    const struct can_frame &f = scan.rx_frames[i];
+    RxFrame *r = &out[i];
+    uint64_t bus_nanos;
+    rx_timestamps(&scan.rx_msgs[i].msg_hdr, &r->nanos, &bus_nanos);
+
+    const uint8_t len = std::min(f.can_dlc, (uint8_t)8);
+    if (f.can_id & CAN_EFF_FLAG) {
+      r->data[0] = ((f.can_id & CAN_EFF_MASK) << 3) | 4;
+    } else {
+      r->data[0] = (f.can_id & CAN_SFF_MASK) << 21;
+    }
+    if (f.can_id & CAN_RTR_FLAG) r->data[0] |= 2;
+    r->data[1] = len | (bus << 4) | (((bus_nanos / 1000) & 0xFFFF) << 16);
+    r->data[2] = r->data[3] = 0;
+    memcpy(&r->data[2], f.data, len);
+  }
+  return got;
+}
+
+// reads up to max frames from every bus into out in the panda's format, in arrival order.
+// every bus gets an even share of max, what a quiet bus leaves goes to the busy ones.
+// returns the number of frames or a libusb error, with rx_lock
+int rx_read(uint32_t *out, int max) {
+  bool more[SOCKETCAN_MAX_BUSES];
+  int active = scan.num_buses;
+  for (int bus = 0; bus < scan.num_buses; bus++) {
+    more[bus] = true;
+  }
+
+  int n = 0;
+  while (n < max && active > 0) {
+    const int share = std::max((max - n) / active, 1);
+    for (int bus = 0; bus < scan.num_buses && n < max; bus++) {
+      if (!more[bus]) continue;
+      const int batch = std::min(share, max - n);
+      const int got = rx_read_bus(bus, &scan.rx_batch[n], batch);
+      if (got < 0) return got;
+      n += got;
+      // a short read emptied the socket
+      if (got < batch) {
+        more[bus] = false;
+        active--;
+      }
+    }
+  }
+
+  // the buses were read one after the other, interleave them again
+  std::stable_sort(scan.rx_batch, scan.rx_batch + n, [](const RxFrame &a, const RxFrame &b) {
+    return a.nanos < b.nanos;
+  });
+  for (int i = 0; i < n; i++) {
+    memcpy(&out[i*4], scan.rx_batch[i].data, 0x10);
+  }
+  return n;
+}
+
+// sends the frames of one bus, dropping what the interface has no room for
+int tx_send(int bus, int count) {
+  int sent = 0, retries = 0;
+  while (sent < count) {
+    const int ret = sendmmsg(scan.fds[bus], &scan.tx_msgs[sent], count - sent, 0);
+    if (ret > 0) {
+      sent += ret;
+      continue;
+    }
+    if (device_gone(errno)) {
+      LOGE_100("socketcan send on %s: %s", scan.names[bus], strerror(errno));
+      return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if ((errno == ENOBUFS || errno == EAGAIN || errno == EINTR) && retries++ < SOCKETCAN_SEND_RETRIES) {
+      usleep(100);
+      continue;
+    }
+    LOGE_100("socketcan send on %s: %s, dropped %d frames", scan.names[bus], strerror(errno), count - sent);
+    break;
+  }
+  return 0;
+}
+
+int tx_write(const uint32_t *data, int frames) {
+  if (scan.safety_model == SAFETY_NOOUTPUT) {
+    return 0;
+  }
+
+  for (int bus = 0; bus < scan.num_buses; bus++) {
+    int count = 0;
+    for (int i = 0; i < frames; i++) {
+      const uint32_t *d = &data[i*4];
+      if ((int)((d[1] >> 4) & 0xFF) != bus) continue;
+
+      struct can_frame *f = &scan.tx_frames[count];
+      memset(f, 0, sizeof(*f));
+      if (d[0] & 4) {
+        f->can_id = ((d[0] >> 3) & CAN_EFF_MASK) | CAN_EFF_FLAG;
+      } else {
+        f->can_id = (d[0] >> 21) & CAN_SFF_MASK;
+      }
+      if (d[0] & 2) f->can_id |= CAN_RTR_FLAG;
+      f->can_dlc = std::min(d[1] & 0xF, 8U);
+      memcpy(f->data, &d[2], f->can_dlc);
+
+      scan.tx_iovs[count] = {.iov_base = f, .iov_len = sizeof(struct can_frame)};
+      memset(&scan.tx_msgs[count], 0, sizeof(scan.tx_msgs[count]));
+      scan.tx_msgs[count].msg_hdr.msg_iov = &scan.tx_iovs[count];
+      scan.tx_msgs[count].msg_hdr.msg_iovlen = 1;
+      count++;
+    }
+    if (count > 0) {
+      int err = tx_send(bus, count);
+      if (err != 0) return err;
+    }
+  }
+  return 0;
+}
+
+bool socketcan_init() {
+  const char *list = getenv("BOARDD_SOCKETCAN");
+  if (list == NULL) return false;
+
+  char buf[SOCKETCAN_MAX_BUSES * IFNAMSIZ];
+  strncpy(buf, list, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  char *save = NULL;
+  for (char *name = strtok_r(buf, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    if (scan.num_buses == SOCKETCAN_MAX_BUSES) break;
+    strncpy(scan.names[scan.num_buses], name, IFNAMSIZ - 1);
+    scan.fds[scan.num_buses] = -1;
+    scan.num_buses++;
+  }
+  LOGW("socketcan: %d buses from %s", scan.num_buses, list);
+  return scan.num_buses > 0;
+}
+
+// with usb_lock exclusive, so nothing is using the sockets
+bool socketcan_connect() {
+  close_sockets();
+  for (int i = 0; i < scan.num_buses; i++) {
+    scan.fds[i] = open_socket(scan.names[i]);
+    if (scan.fds[i] < 0) {
+      close_sockets();
+      return false;
+    }
+  }
+  return true;
+}
+
+void socketcan_close() {
+  close_sockets();
+}
+
+int socketcan_control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+                      unsigned char *data, uint16_t length) {
+  switch (request) {
+  // get is grey, no pigeon
+  case 0xc1:
+    if (length >= 1) {
+      data[0] = 0;
+      return 1;
+    }
+    return 0;
+  // get health
+  case 0xd2: {
+    // no battery reading over socketcan, a nominal 12V keeps thermald charging
+    struct health h = {
+      .voltage = 12000,
+      .controls_allowed = scan.safety_model != SAFETY_NOOUTPUT,
+    };
+    const int ret = std::min((int)length, (int)sizeof(h));
+    memcpy(data, &h, ret);
+    return ret;
+  }
+  // set safety model
+  case 0xdc:
+    scan.safety_model = value;
+    return 0;
+  // set can loopback, on the open sockets and the ones opened later
+  case 0xe5: {
+    scan.loopback = value;
+    int own = scan.loopback;
+    for (int i = 0; i < scan.num_buses; i++) {
+      if (scan.fds[i] >= 0) {
+        setsockopt(scan.fds[i], SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &own, sizeof(own));
+      }
+    }
+    return 0;
+  }
+  // pigeon reads find nothing, fan speed and charging have no equivalent
+  default:
+    return 0;
+  }
+}
+
+int socketcan_bulk(unsigned char endpoint, unsigned char *data, int length, int *transferred) {
+  *transferred = 0;
+  if (endpoint == 0x81) {
+    pthread_mutex_lock(&scan.rx_lock);
+    const int n = rx_read((uint32_t*)data, std::min(length / 0x10, SOCKETCAN_BATCH));
+    pthread_mutex_unlock(&scan.rx_lock);
+    if (n < 0) return n;
+    *transferred = n * 0x10;
+  } else if (endpoint == 3) {
+    assert(length % 0x10 == 0);
+    const int err = tx_write((const uint32_t*)data, length / 0x10);
+    if (err != 0) return err;
+    *transferred = length;
+  } else {
+    // pigeon uart
+    *transferred = length;
+  }
+  return 0;
+}
+
+int socketcan_recv_submit(RecvBuf *buf) {
+  pthread_mutex_lock(&scan.rx_lock);
+  assert(scan.num_pending < SOCKETCAN_MAX_PENDING);
+  scan.pending[scan.num_pending++] = buf;
+  pthread_mutex_unlock(&scan.rx_lock);
+  return 0;
+}
+
+void socketcan_recv_cancel(RecvBuf *buf) {
+  pthread_mutex_lock(&scan.rx_lock);
+  bool found = false;
+  for (int i = 0; i < scan.num_pending; i++) {
+    if (scan.pending[i] == buf) {
+      memmove(&scan.pending[i], &scan.pending[i+1], (scan.num_pending - i - 1) * sizeof(scan.pending[0]));
+      scan.num_pending--;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&scan.rx_lock);
+
+  if (found) {
+    buf->length = 0;
+    buf->status = RECV_CANCELLED;
+    buf->done(buf);
+  }
+}
+
+// waits for frames on any bus and hands them to the oldest queued read
+void socketcan_recv_poll(int timeout_us) {
+  struct pollfd fds[SOCKETCAN_MAX_BUSES];
+  for (int i = 0; i < scan.num_buses; i++) {
+    fds[i] = {.fd = scan.fds[i], .events = POLLIN};
+  }
+  const int ret = poll(fds, scan.num_buses, timeout_us / 1000);
+  if (ret <= 0) return;
+
+  pthread_mutex_lock(&scan.rx_lock);
+  if (scan.num_pending == 0) {
+    pthread_mutex_unlock(&scan.rx_lock);
+    return;
+  }
+  RecvBuf *buf = scan.pending[0];
+  memmove(&scan.pending[0], &scan.pending[1], (scan.num_pending - 1) * sizeof(scan.pending[0]));
+  scan.num_pending--;
+
+  const int n = rx_read(buf->data, SOCKETCAN_BATCH);
+  bool gone = n < 0;
+  for (int i = 0; i < scan.num_buses; i++) {
+    gone |= (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+  }
+  buf->length = std::max(n, 0) * 0x10;
+  buf->status = gone ? RECV_NO_DEVICE : RECV_COMPLETED;
+  if (gone) {
+    // the other reads go with the device, like libusb's
+    while (scan.num_pending > 0) {
+      RecvBuf *other = scan.pending[--scan.num_pending];
+      other->length = 0;
+      other->status = RECV_NO_DEVICE;
+      other->done(other);
+    }
+  }
+  pthread_mutex_unlock(&scan.rx_lock);
+
+  buf->done(buf);
+}
+
+void socketcan_recv_free(RecvBuf *buf) {
+}
+
+}
+
+const PandaTransport panda_socketcan = {
+  .name = "socketcan",
+  .init = socketcan_init,
+  .connect = socketcan_connect,
+  .close = socketcan_close,
+  .control = socketcan_control,
+  .bulk = socketcan_bulk,
+  .recv_submit = socketcan_recv_submit,
+  .recv_cancel = socketcan_recv_cancel,
+  .recv_poll = socketcan_recv_poll,
+  .recv_free = socketcan_recv_free,
+};
@@ -0,0 +1,828 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <new>
+#include <atomic>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zmq.h>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common/timing.h"
+
+#include "common.h"
+
+// throughput of the can hot paths for a honda, toyota and gm powertrain bus: parsing events
+// with can_update_event, reading back with can_query_changed and can_query, and packing
+// every message with canpack_pack, canpack_pack_prepared and as one canpack_pack_sendcan event
+// per cycle. one json line per bus.
+//
+// with no arguments the buses are synthesized from the dbcs: every message in every 10ms cycle,
+// random in range values with valid counters and checksums. ./bench <dbc> <log> replays the
+// can events of a raw log (concatenated serialized events, like dats.bin) instead.
+//
+// the generated decoders are timed against the signal table interpreter with the signals and
+// checks carstate asks for on a civic and a rav4. the decoders always decode every signal of a
+// message, so tracking everything would flatter them.
+//
+// every checksum gets a json line, the honda and toyota ones also batched.
+//
+// the synthesized events are then also published on the can port and read back with can_update,
+// the path carstate takes, and a three bus toyota is read with a parser per bus and with one
+// multi bus parser. that needs 8006 to be free, so not with boardd running
+
+extern "C" {
+  void* can_init(int bus, const char* dbc_name,
+                 size_t num_message_options, const MessageParseOptions* message_options,
+                 size_t num_signal_options, const SignalParseOptions* signal_options,
+                 bool sendcan, const char* tcp_addr);
+  void can_update(void* can, uint64_t sec, bool wait);
+  void can_update_event(void* can, uint64_t sec, const void* data, size_t size);
+  size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+  size_t can_query_changed(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+  void can_disable_decoders(void* can);
+  void can_stats_enable(void* can, bool enable);
+  size_t can_stats(void* can, bool reset, size_t out_size, CANStats* out);
+  void* can_init_multi(size_t num_buses, const CANBusOptions* buses, bool sendcan, const char* tcp_addr);
+  void can_update_multi(void* can, uint64_t sec, bool wait);
+  void* can_multi_get_bus(void* can, size_t bus_idx);
+
+  void* canpack_init(const char* dbc_name);
+  uint64_t canpack_pack(void* inst, uint32_t address, size_t num_vals, const SignalPackValue *vals, int counter, bool checksum);
+  void* canpack_prepare(void* inst, uint32_t address, size_t num_names, const char** names);
+  uint64_t canpack_pack_prepared(void* plan, const double* values, int counter);
+  size_t canpack_pack_sendcan(void* inst, size_t num_msgs, const CANPackMessage* msgs,
+                              uint8_t* out, size_t out_size);
+}
+
+// every allocation in the process is counted, the timed loops read the difference.
+// zmq's io thread allocates too, so it's atomic
+static std::atomic<size_t> allocs(0);
+
+void* operator new(size_t size) {
+  allocs++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+#define CYCLES 100
+#define ITERS 20
+#define CYCLE_NS 10000000ULL
+
+// published events are given this long to reach the subscriber before it's timed
+#define ZMQ_DELIVER_US 20000
+
+namespace {
+
+// one serialized can event, word aligned so it's parsed in place
+struct Event {
+  uint64_t mono_time;
+  kj::Array<capnp::word> words;
+};
+
+struct Bus {
+  const char* car;
+  const char* dbc_name;
+};
+
+const Bus buses[] = {
+  {"honda", "honda_civic_touring_2016_can_generated"},
+  {"toyota", "toyota_rav4_2017_pt_generated"},
+  {"gm", "gm_global_a_powertrain"},
+};
+
+// what selfdrive/car/*/carstate.py get_can_parser asks for, by message name
+struct CarstateSignal {
+  const char* msg;
+  const char* name;
+  double default_value;
+};
+
+struct CarstateCheck {
+  const char* msg;
+  int frequency;
+};
+
+struct Carstate {
+  const char* car;
+  const char* dbc_name;
+  std::vector<CarstateSignal> signals;
+  std::vector<CarstateCheck> checks;
+};
+
+// a nidec civic without an interceptor
+const Carstate civic_carstate = {
+  "honda", "honda_civic_touring_2016_can_generated",
+  {
+    {"ENGINE_DATA", "XMISSION_SPEED", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_FL", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_FR", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_RL", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_RR", 0},
+    {"STEERING_SENSORS", "STEER_ANGLE", 0},
+    {"STEERING_SENSORS", "STEER_ANGLE_RATE", 0},
+    {"STEER_STATUS", "STEER_TORQUE_SENSOR", 0},
+    {"SCM_FEEDBACK", "LEFT_BLINKER", 0},
+    {"SCM_FEEDBACK", "RIGHT_BLINKER", 0},
+    {"GEARBOX", "GEAR", 0},
+    {"SEATBELT_STATUS", "SEATBELT_DRIVER_LAMP", 1},
+    {"SEATBELT_STATUS", "SEATBELT_DRIVER_LATCHED", 0},
+    {"POWERTRAIN_DATA", "BRAKE_PRESSED", 0},
+    {"POWERTRAIN_DATA", "BRAKE_SWITCH", 0},
+    {"SCM_BUTTONS", "CRUISE_BUTTONS", 0},
+    {"VSA_STATUS", "ESP_DISABLED", 1},
+    {"ACC_HUD", "HUD_LEAD", 0},
+    {"VSA_STATUS", "USER_BRAKE", 0},
+    {"STEER_STATUS", "STEER_STATUS", 5},
+    {"GEARBOX", "GEAR_SHIFTER", 0},
+    {"POWERTRAIN_DATA", "PEDAL_GAS", 0},
+    {"SCM_BUTTONS", "CRUISE_SETTING", 0},
+    {"POWERTRAIN_DATA", "ACC_STATUS", 0},
+    {"STANDSTILL", "BRAKE_ERROR_1", 1},
+    {"STANDSTILL", "BRAKE_ERROR_2", 1},
+    {"CRUISE", "CRUISE_SPEED_PCM", 0},
+    {"CRUISE_PARAMS", "CRUISE_SPEED_OFFSET", 0},
+    {"DOORS_STATUS", "DOOR_OPEN_FL", 1},
+    {"DOORS_STATUS", "DOOR_OPEN_FR", 1},
+    {"DOORS_STATUS", "DOOR_OPEN_RL", 1},
+    {"DOORS_STATUS", "DOOR_OPEN_RR", 1},
+    {"STANDSTILL", "WHEELS_MOVING", 1},
+    {"GAS_PEDAL_2", "CAR_GAS", 0},
+    {"SCM_FEEDBACK", "MAIN_ON", 0},
+    {"EPB_STATUS", "EPB_STATE", 0},
+    {"VSA_STATUS", "BRAKE_HOLD_ACTIVE", 0},
+  },
+  {
+    {"ENGINE_DATA", 100},
+    {"WHEEL_SPEEDS", 50},
+    {"STEERING_SENSORS", 100},
+    {"SCM_FEEDBACK", 10},
+    {"GEARBOX", 100},
+    {"SEATBELT_STATUS", 10},
+    {"CRUISE", 10},
+    {"POWERTRAIN_DATA", 100},
+    {"VSA_STATUS", 50},
+    {"SCM_BUTTONS", 25},
+    {"CRUISE_PARAMS", 50},
+    {"STANDSTILL", 50},
+    {"DOORS_STATUS", 3},
+  },
+};
+
+const Carstate rav4_carstate = {
+  "toyota", "toyota_rav4_2017_pt_generated",
+  {
+    {"GEAR_PACKET", "GEAR", 0},
+    {"BRAKE_MODULE", "BRAKE_PRESSED", 0},
+    {"GAS_PEDAL", "GAS_PEDAL", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_FL", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_FR", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_RL", 0},
+    {"WHEEL_SPEEDS", "WHEEL_SPEED_RR", 0},
+    {"SEATS_DOORS", "DOOR_OPEN_FL", 1},
+    {"SEATS_DOORS", "DOOR_OPEN_FR", 1},
+    {"SEATS_DOORS", "DOOR_OPEN_RL", 1},
+    {"SEATS_DOORS", "DOOR_OPEN_RR", 1},
+    {"SEATS_DOORS", "SEATBELT_DRIVER_UNLATCHED", 1},
+    {"ESP_CONTROL", "TC_DISABLED", 1},
+    {"STEER_ANGLE_SENSOR", "STEER_ANGLE", 0},
+    {"STEER_ANGLE_SENSOR", "STEER_FRACTION", 0},
+    {"STEER_ANGLE_SENSOR", "STEER_RATE", 0},
+    {"PCM_CRUISE", "GAS_RELEASED", 0},
+    {"PCM_CRUISE", "CRUISE_ACTIVE", 0},
+    {"PCM_CRUISE", "CRUISE_STATE", 0},
+    {"PCM_CRUISE_2", "MAIN_ON", 0},
+    {"PCM_CRUISE_2", "SET_SPEED", 0},
+    {"PCM_CRUISE_2", "LOW_SPEED_LOCKOUT", 0},
+    {"STEER_TORQUE_SENSOR", "STEER_TORQUE_DRIVER", 0},
+    {"STEER_TORQUE_SENSOR", "STEER_TORQUE_EPS", 0},
+    {"STEERING_LEVERS", "TURN_SIGNALS", 3},
+    {"EPS_STATUS", "LKA_STATE", 0},
+    {"EPS_STATUS", "IPAS_STATE", 1},
+    {"ESP_CONTROL", "BRAKE_LIGHTS_ACC", 0},
+    {"LIGHT_STALK", "AUTO_HIGH_BEAM", 0},
+  },
+  {
+    {"BRAKE_MODULE", 40},
+    {"GAS_PEDAL", 33},
+    {"WHEEL_SPEEDS", 80},
+    {"STEER_ANGLE_SENSOR", 80},
+    {"PCM_CRUISE", 33},
+    {"PCM_CRUISE_2", 33},
+    {"STEER_TORQUE_SENSOR", 50},
+    {"EPS_STATUS", 25},
+  },
+};
+
+// messages that can be packed and parsed, with every signal the parser is asked for
+struct Message {
+  const Msg* msg;
+  std::vector<const char*> names;
+  bool has_counter;
+};
+
+std::vector<Message> bus_messages(const DBC* dbc) {
+  std::vector<Message> ret;
+  for (int i=0; i<dbc->num_msgs; i++) {
+    const Msg* msg = &dbc->msgs[i];
+    if (msg->size == 0 || msg->size > 8) continue;
+
+    bool dup = false;
+    for (const auto& m : ret) dup |= m.msg->address == msg->address;
+    if (dup) continue;
+
+    Message m = {.msg = msg, .has_counter = false};
+    for (int j=0; j<msg->num_sigs; j++) {
+      const Signal& sig = msg->sigs[j];
+      if (sig.type == SignalType::DEFAULT) {
+        m.names.push_back(sig.name);
+      } else if (sig.type == SignalType::COUNTER) {
+        m.has_counter = true;
+      }
+    }
+    ret.push_back(m);
+  }
+  return ret;
+}
+
+double random_value(const Signal& sig) {
+  if (sig.b2 <= 0) return sig.offset;
+  const int bits = std::min(sig.b2, 30);
+  int64_t raw = rand() & ((1 << bits) - 1);
+  if (sig.is_signed) raw -= 1 << (bits - 1);
+  return raw * sig.factor + sig.offset;
+}
+
+const Msg* find_message(const DBC* dbc, const char* name) {
+  for (int i=0; i<dbc->num_msgs; i++) {
+    if (strcmp(dbc->msgs[i].name, name) == 0) return &dbc->msgs[i];
+  }
+  fprintf(stderr, "no message %s in %s\n", name, dbc->name);
+  exit(1);
+}
+
+// like the python CANParser, messages with signals but no check are added unchecked
+void carstate_options(const DBC* dbc, const Carstate& cs, std::vector<MessageParseOptions>& options,
+                      std::vector<SignalParseOptions>& sigoptions) {
+  for (const auto& c : cs.checks) {
+    options.push_back({find_message(dbc, c.msg)->address, c.frequency});
+  }
+  for (const auto& sig : cs.signals) {
+    const uint32_t address = find_message(dbc, sig.msg)->address;
+    sigoptions.push_back({address, sig.name, sig.default_value});
+
+    bool found = false;
+    for (const auto& op : options) found |= op.address == address;
+    if (!found) options.push_back({address, 0});
+  }
+}
+
+const Signal* find_signal(const Msg* msg, const char* name) {
+  for (int j=0; j<msg->num_sigs; j++) {
+    if (strcmp(msg->sigs[j].name, name) == 0) return &msg->sigs[j];
+  }
+  return NULL;
+}
+
+// the messages of one bus, packed with its dbc and sent from src
+struct SynthBus {
+  void* packer;
+  const std::vector<Message>* messages;
+  int src;
+};
+
+// one event per cycle with the frames of every bus
+std::vector<Event> synthesize(const std::vector<SynthBus>& synth_buses) {
+  size_t num_frames = 0;
+  for (const auto& b : synth_buses) num_frames += b.messages->size();
+
+  std::vector<Event> ret;
+  for (int c=0; c<CYCLES; c++) {
+    capnp::MallocMessageBuilder msg;
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+    const uint64_t mono_time = (c + 1) * CYCLE_NS;
+    event.setLogMonoTime(mono_time);
+    auto cans = event.initCan(num_frames);
+
+    size_t i = 0;
+    for (const auto& b : synth_buses) {
+      for (const auto& m : *b.messages) {
+        std::vector<SignalPackValue> vals;
+        for (auto name : m.names) {
+          vals.push_back({.name = name, .value = random_value(*find_signal(m.msg, name))});
+        }
+        const uint64_t packed = canpack_pack(b.packer, m.msg->address, vals.size(), vals.data(), m.has_counter ? c : -1, true);
+
+        uint8_t dat[8];
+        for (int k=0; k<8; k++) {
+          dat[k] = packed >> (56 - 8*k);
+        }
+        cans[i].setAddress(m.msg->address);
+        cans[i].setBusTime(c);
+        cans[i].setSrc(b.src);
+        cans[i].setDat(kj::arrayPtr(dat, m.msg->size));
+        i++;
+      }
+    }
+    ret.push_back({mono_time, capnp::messageToFlatArray(msg)});
+  }
+  return ret;
+}
+
+std::vector<Event> synthesize(void* packer, const std::vector<Message>& messages) {
+  return synthesize(std::vector<SynthBus>{{packer, &messages, 0}});
+}
+
+// the can events of a raw log
+std::vector<Event> load_log(const char* path) {
+  std::vector<Event> ret;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return ret;
+  struct stat st;
+  fstat(fd, &st);
+  auto words = kj::heapArray<capnp::word>(st.st_size / sizeof(capnp::word));
+  const ssize_t len = read(fd, words.begin(), words.size() * sizeof(capnp::word));
+  close(fd);
+  if (len != (ssize_t)(words.size() * sizeof(capnp::word))) return ret;
+
+  kj::ArrayPtr<const capnp::word> rest = words;
+  while (rest.size() > 0) {
+    capnp::FlatArrayMessageReader reader(rest);
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    auto end = reader.getEnd();
+    if (event.isCan()) {
+      auto copy = kj::heapArray<capnp::word>(end - rest.begin());
+      memcpy(copy.begin(), rest.begin(), copy.size() * sizeof(capnp::word));
+      ret.push_back({event.getLogMonoTime(), std::move(copy)});
+    }
+    rest = kj::arrayPtr(end, rest.end());
+  }
+  return ret;
+}
+
+size_t count_frames(const std::vector<Event>& events) {
+  size_t n = 0;
+  for (const auto& e : events) {
+    capnp::FlatArrayMessageReader reader(e.words);
+    n += reader.getRoot<cereal::Event>().getCan().size();
+  }
+  return n;
+}
+
+void bench_bus(const char* car, const char* dbc_name, const char* log_path) {
+  const DBC* dbc = dbc_lookup(std::string(dbc_name));
+  if (!dbc) {
+    fprintf(stderr, "no dbc %s\n", dbc_name);
+    exit(1);
+  }
+  void* packer = canpack_init(dbc_name);
+  const auto messages = bus_messages(dbc);
+
+  srand(1);
+  const auto events = log_path ? load_log(log_path) : synthesize(packer, messages);
+  if (events.empty()) {
+    fprintf(stderr, "no can events in %s\n", log_path);
+    exit(1);
+  }
+  const size_t frames = count_frames(events);
+
+  // every signal of every message, checked at 100Hz like carstate's checks
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  for (const auto& m : messages) {
+    options.push_back({m.msg->address, 100});
+    for (auto name : m.names) {
+      sigoptions.push_back({m.msg->address, name, 0});
+    }
+  }
+  void* can = can_init(0, dbc_name, options.size(), options.data(), sigoptions.size(), sigoptions.data(), false, NULL);
+
+  bool valid;
+  const size_t num_values = can_query(can, 0, &valid, 0, NULL);
+  std::vector<SignalValue> values(num_values);
+
+  // parse and query_changed, the loop controlsd runs. the first pass warms up.
+  // every pass continues the clock where the last one ended
+  const uint64_t span = events.back().mono_time - events.front().mono_time + CYCLE_NS;
+  size_t signals = 0;
+  double parse_ms = 0;
+  size_t parse_allocs = 0;
+  for (int it=0; it<=ITERS; it++) {
+    const size_t a0 = allocs;
+    double t1 = millis_since_boot();
+    for (const auto& e : events) {
+      const uint64_t sec = it * span + e.mono_time;
+      can_update_event(can, sec, e.words.begin(), e.words.size() * sizeof(capnp::word));
+      signals += can_query_changed(can, &valid, values.size(), values.data());
+    }
+    double t2 = millis_since_boot();
+    if (it == 0) {
+      signals = 0;
+    } else {
+      parse_ms += t2 - t1;
+      parse_allocs += allocs - a0;
+    }
+  }
+
+  // full query, what update_vl(0) does
+  const size_t a1 = allocs;
+  double t1 = millis_since_boot();
+  for (int it=0; it<ITERS; it++) {
+    for (size_t c=0; c<events.size(); c++) {
+      can_query(can, 0, &valid, values.size(), values.data());
+    }
+  }
+  double t2 = millis_since_boot();
+  const size_t query_allocs = allocs - a1;
+  const double query_ms = t2 - t1;
+
+  // pack every message once per cycle, by name and prepared
+  std::vector<void*> plans;
+  std::vector<std::vector<double>> pack_values;
+  std::vector<std::vector<SignalPackValue>> named_values;
+  size_t pack_signals = 0;
+  for (const auto& m : messages) {
+    plans.push_back(canpack_prepare(packer, m.msg->address, m.names.size(), (const char**)m.names.data()));
+    std::vector<double> vals;
+    std::vector<SignalPackValue> named;
+    for (auto name : m.names) {
+      vals.push_back(random_value(*find_signal(m.msg, name)));
+      named.push_back({.name = name, .value = vals.back()});
+    }
+    pack_values.push_back(vals);
+    named_values.push_back(named);
+    pack_signals += m.names.size();
+  }
+
+  uint64_t sink = 0;
+  const size_t a2 = allocs;
+  double t3 = millis_since_boot();
+  for (int it=0; it<ITERS * CYCLES; it++) {
+    for (size_t i=0; i<messages.size(); i++) {
+      sink ^= canpack_pack(packer, messages[i].msg->address, named_values[i].size(), named_values[i].data(),
+                           messages[i].has_counter ? it : -1, true);
+    }
+  }
+  double t4 = millis_since_boot();
+  const size_t a3 = allocs;
+  for (int it=0; it<ITERS * CYCLES; it++) {
+    for (size_t i=0; i<messages.size(); i++) {
+      sink ^= canpack_pack_prepared(plans[i], pack_values[i].data(), messages[i].has_counter ? it : -1);
+    }
+  }
+  double t5 = millis_since_boot();
+  const size_t a4 = allocs;
+
+  // and every cycle's messages as one sendcan event, like controlsd sends them
+  std::vector<CANPackMessage> batch;
+  for (size_t i=0; i<messages.size(); i++) {
+    batch.push_back({plans[i], 0, pack_values[i].data(), -1});
+  }
+  auto sendcan_buf = kj::heapArray<capnp::word>(
+    canpack_pack_sendcan(packer, batch.size(), batch.data(), NULL, 0) / sizeof(capnp::word));
+  const size_t a5 = allocs;
+  double t6 = millis_since_boot();
+  for (int it=0; it<ITERS * CYCLES; it++) {
+    for (size_t i=0; i<messages.size(); i++) {
+      batch[i].counter = messages[i].has_counter ? it : -1;
+    }
+    sink ^= canpack_pack_sendcan(packer, batch.size(), batch.data(), (uint8_t*)sendcan_buf.begin(),
+                                 sendcan_buf.size() * sizeof(capnp::word));
+  }
+  double t7 = millis_since_boot();
+  const size_t a6 = allocs;
+
+  const double cycles = (double)ITERS * events.size();
+  const double pack_cycles = (double)ITERS * CYCLES;
+  printf("{\"car\": \"%s\", \"dbc\": \"%s\", \"source\": \"%s\", \"messages\": %zu, \"signals\": %zu, \"frames_per_cycle\": %.1f, "
+         "\"parse\": {\"frames_per_sec\": %.0f, \"ns_per_frame\": %.1f, \"ns_per_signal\": %.2f, \"allocs_per_cycle\": %.2f}, "
+         "\"query\": {\"us_per_cycle\": %.2f, \"ns_per_signal\": %.2f, \"allocs_per_cycle\": %.2f}, "
+         "\"pack\": {\"ns_per_message\": %.1f, \"ns_per_signal\": %.2f, \"allocs_per_cycle\": %.2f}, "
+         "\"pack_prepared\": {\"ns_per_message\": %.1f, \"ns_per_signal\": %.2f, \"allocs_per_cycle\": %.2f}, "
+         "\"pack_sendcan\": {\"us_per_cycle\": %.2f, \"ns_per_message\": %.1f, \"allocs_per_cycle\": %.2f}, "
+         "\"sink\": %llu}\n",
+         car, dbc_name, log_path ? log_path : "synthesized", messages.size(), num_values, frames / (double)events.size(),
+         frames * ITERS / (parse_ms * 1e-3), parse_ms * 1e6 / (frames * ITERS), signals ? parse_ms * 1e6 / signals : 0,
+         parse_allocs / cycles,
+         query_ms * 1e3 / cycles, query_ms * 1e6 / (cycles * num_values), query_allocs / cycles,
+         (t4-t3) * 1e6 / (pack_cycles * messages.size()), (t4-t3) * 1e6 / (pack_cycles * pack_signals), (a3-a2) / pack_cycles,
+         (t5-t4) * 1e6 / (pack_cycles * messages.size()), (t5-t4) * 1e6 / (pack_cycles * pack_signals), (a4-a3) / pack_cycles,
+         (t7-t6) * 1e3 / pack_cycles, (t7-t6) * 1e6 / (pack_cycles * messages.size()), (a6-a5) / pack_cycles,
+         (unsigned long long)(sink & 1));
+}
+
+// the same carstate parser with the generated decoders and with the signal table interpreter
+void bench_decoders(const Carstate& cs) {
+  const DBC* dbc = dbc_lookup(std::string(cs.dbc_name));
+  void* packer = canpack_init(cs.dbc_name);
+  const auto messages = bus_messages(dbc);
+
+  srand(1);
+  const auto events = synthesize(packer, messages);
+  const size_t frames = count_frames(events);
+
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  carstate_options(dbc, cs, options, sigoptions);
+
+  void* parsers[2];
+  double parse_ms[2] = {0};
+  for (int p=0; p<2; p++) {
+    parsers[p] = can_init(0, cs.dbc_name, options.size(), options.data(), sigoptions.size(), sigoptions.data(), false, NULL);
+  }
+  can_disable_decoders(parsers[1]);
+
+  bool valid;
+  std::vector<SignalValue> values(can_query(parsers[0], 0, &valid, 0, NULL));
+
+  // interleaved so neither gets a warmer cache, the first pass warms up
+  const uint64_t span = events.back().mono_time - events.front().mono_time + CYCLE_NS;
+  for (int it=0; it<=ITERS; it++) {
+    for (int p=0; p<2; p++) {
+      double t1 = millis_since_boot();
+      for (const auto& e : events) {
+        can_update_event(parsers[p], it * span + e.mono_time, e.words.begin(), e.words.size() * sizeof(capnp::word));
+        can_query_changed(parsers[p], &valid, values.size(), values.data());
+      }
+      double t2 = millis_since_boot();
+      if (it > 0) parse_ms[p] += t2 - t1;
+    }
+  }
+
+  printf("{\"car\": \"%s\", \"dbc\": \"%s\", \"source\": \"carstate\", \"messages\": %zu, \"signals\": %zu, "
+         "\"decoders\": {\"ns_per_frame\": %.1f}, \"table\": {\"ns_per_frame\": %.1f}}\n",
+         cs.car, cs.dbc_name, options.size(), values.size(),
+         parse_ms[0] * 1e6 / (frames * ITERS), parse_ms[1] * 1e6 / (frames * ITERS));
+}
+
+// every checksum through the dispatch table like the parser and packer call it, and the honda
+// and toyota batch functions. random 11 and 29 bit addresses and every message size
+void bench_checksums() {
+  const char* names[NUM_SIGNAL_TYPES] = {
+    "", "honda", "", "toyota", "crc8_j1850",
+  };
+
+  const size_t n = 1 << 20;
+  std::vector<uint32_t> address(n);
+  std::vector<uint64_t> dat(n);
+  std::vector<uint8_t> size(n);
+  std::unique_ptr<bool[]> valid(new bool[n]);
+
+  srand(1);
+  for (size_t i=0; i<n; i++) {
+    address[i] = (i % 2) ? (rand() & 0x7FF) : (rand() & 0x1FFFFFFF);
+    dat[i] = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+    size[i] = 1 + (i % 8);
+  }
+
+  for (int t=0; t<NUM_SIGNAL_TYPES; t++) {
+    ChecksumFn fn = checksum_functions[t];
+    if (!fn) continue;
+
+    volatile unsigned int sink = 0;
+    double t1 = millis_since_boot();
+    for (size_t i=0; i<n; i++) sink += fn(address[i], dat[i], size[i]);
+    double t2 = millis_since_boot();
+    printf("{\"checksum\": \"%s\", \"ns_per_frame\": %.2f", names[t], (t2-t1) * 1e6 / n);
+
+    auto batch = t == HONDA_CHECKSUM ? honda_checksum_batch : t == TOYOTA_CHECKSUM ? toyota_checksum_batch : NULL;
+    if (batch) {
+      double t3 = millis_since_boot();
+      batch(n, address.data(), dat.data(), size.data(), valid.get());
+      double t4 = millis_since_boot();
+      printf(", \"batch_ns_per_frame\": %.2f", (t4-t3) * 1e6 / n);
+    }
+    printf("}\n");
+  }
+}
+
+// **** over zmq ****
+
+void* zmq_can_publisher() {
+  void* context = zmq_ctx_new();
+  void* publisher = zmq_socket(context, ZMQ_PUB);
+  if (zmq_bind(publisher, "tcp://*:8006") != 0) {
+    fprintf(stderr, "can't bind 8006, skipping the zmq benchmarks\n");
+    zmq_close(publisher);
+    zmq_ctx_term(context);
+    return NULL;
+  }
+  return publisher;
+}
+
+void zmq_publish(void* publisher, const std::vector<Event>& events) {
+  for (const auto& e : events) {
+    zmq_send(publisher, e.words.begin(), e.words.size() * sizeof(capnp::word), 0);
+  }
+}
+
+// subscriptions take a moment to go through, until then published events are dropped
+template <typename F>
+void zmq_wait_subscribed(void* publisher, const Event& e, F subscribed) {
+  for (int i=0; i<500; i++) {
+    zmq_send(publisher, e.words.begin(), e.words.size() * sizeof(capnp::word), 0);
+    usleep(ZMQ_DELIVER_US);
+    if (subscribed()) return;
+  }
+  fprintf(stderr, "can subscription never got an event\n");
+  exit(1);
+}
+
+size_t frames_received(void* can) {
+  std::vector<CANStats> stats(can_stats(can, false, 0, NULL));
+  can_stats(can, false, stats.size(), stats.data());
+  size_t n = 0;
+  for (const auto& st : stats) n += st.received;
+  return n;
+}
+
+// a cycle's worth of events is published and given time to arrive, then one can_update reads
+// them all: zmq recv, the in place capnp read and the parse, which shouldn't allocate
+void bench_zmq_update(void* publisher, const char* car, const char* dbc_name) {
+  const DBC* dbc = dbc_lookup(std::string(dbc_name));
+  void* packer = canpack_init(dbc_name);
+  const auto messages = bus_messages(dbc);
+
+  srand(1);
+  const auto events = synthesize(packer, messages);
+  const size_t frames = count_frames(events);
+
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  for (const auto& m : messages) {
+    options.push_back({m.msg->address, 100});
+    for (auto name : m.names) {
+      sigoptions.push_back({m.msg->address, name, 0});
+    }
+  }
+  void* can = can_init(0, dbc_name, options.size(), options.data(), sigoptions.size(), sigoptions.data(), false, "127.0.0.1");
+  can_stats_enable(can, true);
+
+  bool valid;
+  std::vector<SignalValue> values(can_query(can, 0, &valid, 0, NULL));
+  zmq_wait_subscribed(publisher, events[0], [&]() {
+    can_update(can, 0, false);
+    return can_query_changed(can, &valid, values.size(), values.data()) > 0;
+  });
+
+  const size_t received0 = frames_received(can);
+  double update_ms = 0;
+  size_t update_allocs = 0;
+  for (int it=0; it<ITERS; it++) {
+    zmq_publish(publisher, events);
+    usleep(ZMQ_DELIVER_US);
+
+    const size_t a0 = allocs;
+    double t1 = millis_since_boot();
+    can_update(can, (it + 1) * CYCLES * CYCLE_NS, false);
+    can_query_changed(can, &valid, values.size(), values.data());
+    double t2 = millis_since_boot();
+    update_allocs += allocs - a0;
+    update_ms += t2 - t1;
+  }
+  const size_t received = frames_received(can) - received0;
+
+  const double num_events = (double)ITERS * events.size();
+  printf("{\"car\": \"%s\", \"dbc\": \"%s\", \"source\": \"zmq\", \"frames_per_event\": %.1f, "
+         "\"update\": {\"us_per_event\": %.2f, \"ns_per_frame\": %.1f, \"allocs_per_event\": %.2f, \"frames_lost\": %lld}}\n",
+         car, dbc_name, frames / (double)events.size(),
+         update_ms * 1e3 / num_events, update_ms * 1e6 / received, update_allocs / num_events,
+         (long long)(frames * ITERS) - (long long)received);
+}
+
+
+// a toyota's powertrain, radar and forwarded camera bus in one can event, read by a parser per
+// bus vs one MultiBusCANParser. both are subscribed to the same published events, each of the
+// single parsers receives and deserializes every event and drops the other buses' frames
+void bench_zmq_multibus(void* publisher) {
+  const char* dbc_names[] = {"toyota_rav4_2017_pt_generated", "toyota_prius_2017_adas", "toyota_rav4_2017_pt_generated"};
+  const size_t num_buses = ARRAYSIZE(dbc_names);
+
+  std::vector<Message> messages[num_buses];
+  std::vector<MessageParseOptions> options[num_buses];
+  std::vector<SignalParseOptions> sigoptions[num_buses];
+  std::vector<SynthBus> synth_buses;
+  std::vector<CANBusOptions> bus_options;
+  for (size_t bus=0; bus<num_buses; bus++) {
+    messages[bus] = bus_messages(dbc_lookup(std::string(dbc_names[bus])));
+    for (const auto& m : messages[bus]) {
+      options[bus].push_back({m.msg->address, 100});
+      for (auto name : m.names) {
+        sigoptions[bus].push_back({m.msg->address, name, 0});
+      }
+    }
+    synth_buses.push_back({canpack_init(dbc_names[bus]), &messages[bus], (int)bus});
+    bus_options.push_back({(int)bus, dbc_names[bus], options[bus].size(), options[bus].data(),
+                           sigoptions[bus].size(), sigoptions[bus].data()});
+  }
+
+  srand(1);
+  const auto events = synthesize(synth_buses);
+  const size_t frames = count_frames(events);
+
+  void* single[num_buses];
+  for (size_t bus=0; bus<num_buses; bus++) {
+    single[bus] = can_init(bus, dbc_names[bus], options[bus].size(), options[bus].data(),
+                           sigoptions[bus].size(), sigoptions[bus].data(), false, "127.0.0.1");
+  }
+  void* multi = can_init_multi(num_buses, bus_options.data(), false, "127.0.0.1");
+
+  bool valid;
+  std::vector<SignalValue> values[num_buses];
+  for (size_t bus=0; bus<num_buses; bus++) {
+    values[bus].resize(can_query(single[bus], 0, &valid, 0, NULL));
+  }
+
+  bool got_single[num_buses] = {false}, got_multi = false;
+  zmq_wait_subscribed(publisher, events[0], [&]() {
+    bool all = true;
+    for (size_t bus=0; bus<num_buses; bus++) {
+      can_update(single[bus], 0, false);
+      got_single[bus] |= can_query_changed(single[bus], &valid, values[bus].size(), values[bus].data()) > 0;
+      all &= got_single[bus];
+    }
+    can_update_multi(multi, 0, false);
+    got_multi |= can_query_changed(can_multi_get_bus(multi, 0), &valid, values[0].size(), values[0].data()) > 0;
+    return all && got_multi;
+  });
+
+  double single_ms = 0, multi_ms = 0;
+  for (int it=0; it<ITERS; it++) {
+    zmq_publish(publisher, events);
+    usleep(ZMQ_DELIVER_US);
+
+    const uint64_t sec = (it + 1) * CYCLES * CYCLE_NS;
+    double t1 = millis_since_boot();
+    for (size_t bus=0; bus<num_buses; bus++) {
+      can_update(single[bus], sec, false);
+      can_query_changed(single[bus], &valid, values[bus].size(), values[bus].data());
+    }
+    double t2 = millis_since_boot();
+    can_update_multi(multi, sec, false);
+    for (size_t bus=0; bus<num_buses; bus++) {
+      can_query_changed(can_multi_get_bus(multi, bus), &valid, values[bus].size(), values[bus].data());
+    }
+    double t3 = millis_since_boot();
+    single_ms += t2 - t1;
+    multi_ms += t3 - t2;
+  }
+
+  const double num_events = (double)ITERS * events.size();
+  printf("{\"car\": \"toyota\", \"source\": \"zmq\", \"buses\": %zu, \"frames_per_event\": %.1f, "
+         "\"single\": {\"us_per_event\": %.2f, \"ns_per_frame\": %.1f}, \"multi\": {\"us_per_event\": %.2f, \"ns_per_frame\": %.1f}}\n",
+         num_buses, frames / (double)events.size(),
+         single_ms * 1e3 / num_events, single_ms * 1e6 / (frames * ITERS),
+         multi_ms * 1e3 / num_events, multi_ms * 1e6 / (frames * ITERS));
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    bench_bus("log", argv[1], argv[2]);
+    return 0;
+  }
+
+  for (const auto& bus : buses) {
+    bench_bus(bus.car, bus.dbc_name, NULL);
+  }
+
+  bench_decoders(civic_carstate);
+  bench_decoders(rav4_carstate);
+  bench_checksums();
+
+  void* publisher = zmq_can_publisher();
+  if (publisher) {
+    for (const auto& bus : buses) {
+      bench_zmq_update(publisher, bus.car, bus.dbc_name);
+    }
+    bench_zmq_multibus(publisher);
+  }
+  return 0;
+}
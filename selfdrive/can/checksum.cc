@@ -0,0 +1,39 @@
+#include <cstdint>
+
+#include "common.h"
+
+namespace {
+
+struct CRC8Table {
+  uint8_t lut[256];
+
+  CRC8Table(uint8_t poly) {
+    for (int i=0; i<256; i++) {
+      uint8_t crc = i;
+      for (int j=0; j<8; j++) {
+        crc = (crc & 0x80) ? (crc << 1) ^ poly : (crc << 1);
+      }
+      lut[i] = crc;
+    }
+  }
+};
+
+const CRC8Table crc8_j1850(0x1D);
+
+}
+
+unsigned int crc8_j1850_checksum(unsigned int address, uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+  for (int i=0; i<l-1; i++) {
+    crc = crc8_j1850.lut[crc ^ ((d >> (56 - i*8)) & 0xFF)];
+  }
+  return crc ^ 0xFF;
+}
+
+const ChecksumFn checksum_functions[NUM_SIGNAL_TYPES] = {
+  NULL,                 // DEFAULT
+  honda_checksum,       // HONDA_CHECKSUM
+  NULL,                 // COUNTER
+  toyota_checksum,      // TOYOTA_CHECKSUM
+  crc8_j1850_checksum,  // CRC8_J1850_CHECKSUM
+};
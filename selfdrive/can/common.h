@@ -8,14 +8,76 @@
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
 
 
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
+// sum of the 16 nibbles of x without a data dependent loop:
+// add nibble pairs into bytes (each <= 30), then sum the bytes with a multiply (total <= 240)
+inline unsigned int nibble_sum(uint64_t x) {
+  x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// sum of the 8 bytes of x: add byte pairs into 16 bit lanes (each <= 510),
+// then sum the lanes with a multiply (total <= 2040)
+inline unsigned int byte_sum(uint64_t x) {
+  x = (x & 0x00FF00FF00FF00FFULL) + ((x >> 8) & 0x00FF00FF00FF00FFULL);
+  return (x * 0x0001000100010001ULL) >> 48;
+}
+
+// inline so the generated decoders can fold the constant address and size
+inline unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 4; // remove checksum
+
+  unsigned int s = nibble_sum(address) + nibble_sum(d);
+  return (8 - s) & 0xF;
+}
+
+inline unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  unsigned int s = l + byte_sum(address) + byte_sum(d);
+  return s & 0xFF;
+}
+
+// CRC-8 SAE J1850 (poly 0x1D, init and xorout 0xFF) of the payload bytes before
+// the checksum in the last byte, chrysler. table driven, in checksum.cc
+unsigned int crc8_j1850_checksum(unsigned int address, uint64_t d, int l);
+
+inline uint64_t read_u64_be(const uint8_t* v) {
+  return (((uint64_t)v[0] << 56)
+          | ((uint64_t)v[1] << 48)
+          | ((uint64_t)v[2] << 40)
+          | ((uint64_t)v[3] << 32)
+          | ((uint64_t)v[4] << 24)
+          | ((uint64_t)v[5] << 16)
+          | ((uint64_t)v[6] << 8)
+          | (uint64_t)v[7]);
+}
+
+inline uint64_t read_u64_le(const uint8_t* v) {
+  return ((uint64_t)v[0]
+          | ((uint64_t)v[1] << 8)
+          | ((uint64_t)v[2] << 16)
+          | ((uint64_t)v[3] << 24)
+          | ((uint64_t)v[4] << 32)
+          | ((uint64_t)v[5] << 40)
+          | ((uint64_t)v[6] << 48)
+          | ((uint64_t)v[7] << 56));
+}
 
 struct SignalPackValue {
   const char* name;
   double value;
 };
 
+// one message of a canpack_pack_sendcan batch, plan is from canpack_prepare. a NULL plan is skipped
+struct CANPackMessage {
+  const void* plan;
+  int bus;
+  const double* values;
+  int counter;
+};
+
 
 struct SignalParseOptions {
   uint32_t address;
@@ -28,6 +90,15 @@ struct MessageParseOptions {
   int check_frequency;
 };
 
+struct CANBusOptions {
+  int bus;
+  const char* dbc_name;
+  size_t num_message_options;
+  const MessageParseOptions* message_options;
+  size_t num_signal_options;
+  const SignalParseOptions* signal_options;
+};
+
 struct SignalValue {
   uint32_t address;
   uint16_t ts;
@@ -35,14 +106,50 @@ struct SignalValue {
   double value;
 };
 
+struct MessageStatus {
+  uint32_t address;
+  bool valid;
+  uint32_t missed;
+  uint32_t timeouts;
+  uint64_t seen;
+};
+
+struct CANStats {
+  uint32_t address;
+  uint32_t received;
+  uint32_t checksum_errors;
+  uint32_t counter_errors;
+  double frequency;     // Hz, from the average interval
+  double interval_min;  // s, since the last reset
+  double interval_max;
+  double jitter;        // s, average deviation from the average interval
+};
+
+struct SignalSeries {
+  uint32_t address;
+  const char* name;
+  size_t size;
+  const uint64_t* ts;  // logMonoTime of the can event
+  const double* vals;
+};
+
 
+// checksum and counter algorithms, picked per dbc by process_dbc.py
 enum SignalType {
   DEFAULT,
   HONDA_CHECKSUM,
-  HONDA_COUNTER,
+  COUNTER,  // counts up by one every frame, wraps at the signal size
   TOYOTA_CHECKSUM,
+  CRC8_J1850_CHECKSUM,
+  NUM_SIGNAL_TYPES,
 };
 
+// checksum of a frame from its big endian payload word and size in bytes
+typedef unsigned int (*ChecksumFn)(unsigned int address, uint64_t d, int l);
+
+// indexed by SignalType, NULL for the types that aren't checksums
+extern const ChecksumFn checksum_functions[NUM_SIGNAL_TYPES];
+
 struct Signal {
   const char* name;
   int b1, b2, bo;
@@ -52,12 +159,18 @@ struct Signal {
   SignalType type;
 };
 
+// generated straight-line decoder for a message, dat is the zero padded payload.
+// writes the scaled value of every signal in Msg::sigs order into vals,
+// returns false if the checksum doesn't match
+typedef bool (*MsgDecodeFn)(const uint8_t* dat, double* vals);
+
 struct Msg {
   const char* name;
   uint32_t address;
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  MsgDecodeFn decode;  // NULL if dbc was generated without decoders
 };
 
 struct Val {
@@ -75,13 +188,33 @@ struct DBC {
   size_t num_vals;
 };
 
+// check n frames at once, dat is the big endian payload word and size its length in bytes.
+// valid[i] is set if the checksum in the last nibble (honda) or byte (toyota) matches,
+// returns the number of valid frames
+extern "C" size_t honda_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                                       const uint8_t* size, bool* valid);
+extern "C" size_t toyota_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                                        const uint8_t* size, bool* valid);
+
 const DBC* dbc_lookup(const std::string& dbc_name);
 
+// parses a .dbc at runtime, through a per user cache in $DBC_CACHE_DIR (default ~/.cache/dbc).
+// same tables process_dbc.py generates but without decoders, NULL if it can't be read or parsed
+const DBC* dbc_parse_file(const std::string& path);
+
 void dbc_register(const DBC* dbc);
 
+#ifdef DBC_SPLIT
+// built as its own dbc_out/<name>.so, dbc_lookup loads it the first time the name is asked for
+#define dbc_init(dbc) \
+extern "C" const DBC* dbc_get(void) { \
+  return &dbc; \
+}
+#else
 #define dbc_init(dbc) \
 static void __attribute__((constructor)) do_dbc_init_ ## dbc(void) { \
   dbc_register(&dbc); \
 }
+#endif
 
 #endif
@@ -1,32 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
 #include <string>
-#include <vector>
+#include <mutex>
+#include <unordered_map>
+
+#include <dlfcn.h>
+#include <libgen.h>
 
 #include "common.h"
 
 namespace {
 
-std::vector<const DBC*>& get_dbcs() {
-  static std::vector<const DBC*> vec;
-  return vec;
+std::unordered_map<std::string, const DBC*>& get_dbcs() {
+  static std::unordered_map<std::string, const DBC*> dbcs;
+  return dbcs;
+}
+
+std::mutex& get_dbcs_lock() {
+  static std::mutex lock;
+  return lock;
+}
+
+// dbcs built with DBC_SPLIT=1 are dbc_out/<name>.so next to libdbc.so
+const DBC* dbc_load_split(const std::string& dbc_name) {
+  Dl_info info;
+  if (!dladdr((void*)&dbc_load_split, &info) || !info.dli_fname) {
+    return NULL;
+  }
+
+  std::string lib_path(info.dli_fname);
+  std::string so_path = std::string(dirname(&lib_path[0])) + "/dbc_out/" + dbc_name + ".so";
+
+  void* handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    return NULL;
+  }
+
+  auto get_dbc = (const DBC* (*)(void))dlsym(handle, "dbc_get");
+  if (!get_dbc) {
+    fprintf(stderr, "dbc_lookup: %s has no dbc_get\n", so_path.c_str());
+    dlclose(handle);
+    return NULL;
+  }
+  // never closed, the parsers and packers keep pointers into it
+  return get_dbc();
+}
+
+// dbcs that aren't built in are parsed from $OPENDBC_PATH, or the opendbc libdbc.so was built against
+const DBC* dbc_load_text(const std::string& dbc_name) {
+  const char* path = getenv("OPENDBC_PATH");
+#ifdef OPENDBC_PATH
+  if (!path) path = OPENDBC_PATH;
+#endif
+  if (!path || !path[0]) {
+    return NULL;
+  }
+  return dbc_parse_file(std::string(path) + "/" + dbc_name + ".dbc");
 }
 
 }
 
 const DBC* dbc_lookup(const std::string& dbc_name) {
-  for (const auto& dbci : get_dbcs()) {
-    if (dbc_name == dbci->name) {
-      return dbci;
+  {
+    std::lock_guard<std::mutex> guard(get_dbcs_lock());
+    auto& dbcs = get_dbcs();
+    auto it = dbcs.find(dbc_name);
+    if (it != dbcs.end()) {
+      return it->second;
     }
   }
-  return NULL;
+
+  // loaded without the lock so a slow parse doesn't hold up lookups of other dbcs
+  const DBC* dbc = dbc_load_split(dbc_name);
+  if (!dbc) {
+    dbc = dbc_load_text(dbc_name);
+  }
+  if (!dbc) {
+    return NULL;
+  }
+
+  // if another thread loaded it meanwhile theirs is kept, so everyone gets the same pointer.
+  // dbcs are never freed, this copy is left like the others
+  std::lock_guard<std::mutex> guard(get_dbcs_lock());
+  return get_dbcs().emplace(dbc->name, dbc).first->second;
 }
 
 void dbc_register(const DBC* dbc) {
-  get_dbcs().push_back(dbc);
+  std::lock_guard<std::mutex> guard(get_dbcs_lock());
+  get_dbcs()[dbc->name] = dbc;
 }
 
 extern "C" {
   const DBC* dbc_lookup(const char* dbc_name) {
     return dbc_lookup(std::string(dbc_name));
   }
+
+  // names of the registered dbcs: the ones built into libdbc.so and any loaded since.
+  // returns how many there are, at most out_size are written
+  size_t dbc_list(size_t out_size, const char** out) {
+    std::lock_guard<std::mutex> guard(get_dbcs_lock());
+
+    size_t n = 0;
+    for (const auto& it : get_dbcs()) {
+      if (n < out_size) {
+        out[n] = it.second->name;
+      }
+      n++;
+    }
+    return n;
+  }
+
+  // parses a .dbc and registers it under its file name, replacing a built in dbc of the same name
+  const DBC* dbc_load_file(const char* path) {
+    const DBC* dbc = dbc_parse_file(std::string(path));
+    if (dbc) {
+      dbc_register(dbc);
+    }
+    return dbc;
+  }
 }
@@ -0,0 +1,609 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cinttypes>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+
+// parses .dbc files at runtime into the same tables process_dbc.py generates, minus the decoders.
+// the result is cached as a relocatable image of the DBC/Msg/Signal/Val structs, keyed by a hash
+// of the dbc name and text, and mmapped on later loads instead of parsed
+
+#define CACHE_MAGIC "DBCCACHE"
+#define CACHE_VERSION 1
+
+namespace {
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  // struct layouts this cache was written with
+  uint16_t sizeof_signal, sizeof_msg, sizeof_val, sizeof_dbc;
+  uint64_t hash;
+  uint64_t size;
+  uint64_t dbc_offset;
+};
+
+// same algorithms and layout checks as CHECKSUMS in process_dbc.py, keep them in sync
+struct ChecksumRule {
+  const char* prefix;
+  SignalType type;
+  int size, start_bit;
+  int counter_size, counter_start_bit;  // -1 if not checked
+};
+
+const ChecksumRule checksum_rules[] = {
+  {"honda", SignalType::HONDA_CHECKSUM, 4, 3, 2, 5},
+  {"acura", SignalType::HONDA_CHECKSUM, 4, 3, 2, 5},
+  {"toyota", SignalType::TOYOTA_CHECKSUM, 8, 7, -1, -1},
+  {"lexus", SignalType::TOYOTA_CHECKSUM, 8, 7, -1, -1},
+  {"chrysler", SignalType::CRC8_J1850_CHECKSUM, 8, 7, 4, -1},
+};
+
+const ChecksumRule* find_checksum_rule(const std::string& dbc_name) {
+  // the radar fusion frames don't use the powertrain crc
+  const std::string fusion = "_private_fusion";
+  if (dbc_name.size() >= fusion.size()
+      && dbc_name.compare(dbc_name.size() - fusion.size(), fusion.size(), fusion) == 0) {
+    return NULL;
+  }
+
+  const ChecksumRule* ret = NULL;
+  for (const auto& rule : checksum_rules) {
+    if (dbc_name.compare(0, strlen(rule.prefix), rule.prefix) == 0) {
+      ret = &rule;
+    }
+  }
+  return ret;
+}
+
+struct ParsedSignal {
+  std::string name;
+  int start_bit, size;
+  bool is_little_endian, is_signed;
+  double factor, offset;
+  SignalType type = SignalType::DEFAULT;
+};
+
+struct ParsedMsg {
+  uint32_t address;
+  std::string name;
+  unsigned int size;
+  std::vector<ParsedSignal> sigs;
+};
+
+struct ParsedVal {
+  uint32_t address;
+  std::string name;
+  std::string def_val;
+};
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t h) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (size_t i=0; i<size; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+bool read_file(const std::string& path, std::string& out) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out.append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+// cursor over one line of the dbc
+struct Cursor {
+  const char* p;
+
+  void skip_spaces() {
+    while (*p == ' ' || *p == '\t') p++;
+  }
+  bool ident(std::string& out) {
+    skip_spaces();
+    const char* start = p;
+    while (isalnum(*p) || *p == '_') p++;
+    out.assign(start, p);
+    return p != start;
+  }
+  bool expect(char c) {
+    skip_spaces();
+    if (*p != c) return false;
+    p++;
+    return true;
+  }
+  bool integer(long& out) {
+    skip_spaces();
+    char* end;
+    out = strtol(p, &end, 10);
+    if (end == p) return false;
+    p = end;
+    return true;
+  }
+  bool number(double& out) {
+    skip_spaces();
+    char* end;
+    out = strtod(p, &end);
+    if (end == p) return false;
+    p = end;
+    return true;
+  }
+};
+
+// BO_ 228 STEERING_CONTROL: 5 ADAS
+bool parse_bo(const char* line, ParsedMsg& msg) {
+  Cursor c = {line + 4};
+  c.skip_spaces();
+  char* end;
+  unsigned long address = strtoul(c.p, &end, 0);
+  if (end == c.p) return false;
+  c.p = end;
+
+  long size;
+  if (!c.ident(msg.name) || !c.expect(':') || !c.integer(size)) return false;
+  msg.address = address;
+  msg.size = size;
+  return true;
+}
+
+// SG_ STEER_TORQUE : 7|16@0- (1,0) [-3840|3840] "" EPS, with an optional multiplexer before the colon
+bool parse_sg(const char* line, ParsedSignal& sig) {
+  Cursor c = {line + 4};
+  std::string mux;
+  long start_bit, size, endian;
+  if (!c.ident(sig.name)) return false;
+  if (!c.expect(':')) {
+    if (!c.ident(mux) || !c.expect(':')) return false;
+  }
+  if (!c.integer(start_bit) || !c.expect('|') || !c.integer(size) || !c.expect('@') || !c.integer(endian)) {
+    return false;
+  }
+  if (*c.p != '+' && *c.p != '-') return false;
+  sig.is_signed = *c.p == '-';
+  c.p++;
+  if (!c.expect('(') || !c.number(sig.factor) || !c.expect(',') || !c.number(sig.offset) || !c.expect(')')) {
+    return false;
+  }
+
+  sig.start_bit = start_bit;
+  sig.size = size;
+  sig.is_little_endian = endian == 1;
+  return true;
+}
+
+// VAL_ 401 GEAR 7 "L" 10 "S" 4 "D" ; -> "7 L 10 S 4 D", descriptions upper cased with spaces as underscores
+bool parse_val(const char* line, ParsedVal& val) {
+  Cursor c = {line + 5};
+  c.skip_spaces();
+  char* end;
+  unsigned long address = strtoul(c.p, &end, 0);
+  if (end == c.p) return false;
+  c.p = end;
+  if (!c.ident(val.name) || *c.p != ' ') return false;
+  c.p++;
+
+  const char* semi = strchr(c.p, ';');
+  std::string defs(c.p, semi ? semi : c.p + strlen(c.p));
+
+  // split on quotes, odd pieces are the descriptions, anything after the last quote is dropped
+  std::vector<std::string> pieces;
+  size_t start = 0, q;
+  while ((q = defs.find('"', start)) != std::string::npos) {
+    pieces.push_back(defs.substr(start, q - start));
+    start = q + 1;
+  }
+  if (pieces.size() < 2) return false;
+
+  val.address = address;
+  val.def_val.clear();
+  for (size_t i=0; i<pieces.size(); i++) {
+    std::string piece = pieces[i];
+    if (i % 2 == 1) {
+      size_t b = piece.find_first_not_of(" \t");
+      size_t e = piece.find_last_not_of(" \t");
+      piece = b == std::string::npos ? "" : piece.substr(b, e - b + 1);
+      for (auto& ch : piece) {
+        ch = ch == ' ' ? '_' : toupper(ch);
+      }
+    }
+    val.def_val += piece;
+  }
+  return true;
+}
+
+bool parse_dbc(const std::string& dbc_name, const std::string& text,
+               std::vector<ParsedMsg>& msgs, std::vector<ParsedVal>& vals) {
+  std::vector<ParsedMsg> all_msgs;
+
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos) eol = text.size();
+    std::string line = text.substr(pos, eol - pos);
+    pos = eol + 1;
+
+    size_t b = line.find_first_not_of(" \t\r");
+    if (b == std::string::npos) continue;
+    line = line.substr(b, line.find_last_not_of(" \t\r") - b + 1);
+
+    if (line.compare(0, 4, "BO_ ") == 0) {
+      ParsedMsg msg;
+      if (!parse_bo(line.c_str(), msg)) {
+        fprintf(stderr, "dbc %s: bad BO %s\n", dbc_name.c_str(), line.c_str());
+        return false;
+      }
+      for (const auto& m : all_msgs) {
+        if (m.address == msg.address) {
+          fprintf(stderr, "dbc %s: duplicate address %u\n", dbc_name.c_str(), msg.address);
+          return false;
+        }
+      }
+      all_msgs.push_back(msg);
+    } else if (line.compare(0, 4, "SG_ ") == 0) {
+      ParsedSignal sig;
+      if (all_msgs.empty() || !parse_sg(line.c_str(), sig)) {
+        fprintf(stderr, "dbc %s: bad SG %s\n", dbc_name.c_str(), line.c_str());
+        return false;
+      }
+      all_msgs.back().sigs.push_back(sig);
+    } else if (line.compare(0, 5, "VAL_ ") == 0) {
+      ParsedVal val;
+      if (!parse_val(line.c_str(), val)) {
+        fprintf(stderr, "dbc %s: bad VAL %s\n", dbc_name.c_str(), line.c_str());
+        return false;
+      }
+      bool dup = false;
+      for (const auto& v : vals) {
+        dup |= v.address == val.address && v.name == val.name && v.def_val == val.def_val;
+      }
+      if (!dup) vals.push_back(val);
+    }
+  }
+
+  const ChecksumRule* checksum = find_checksum_rule(dbc_name);
+
+  for (auto& msg : all_msgs) {
+    if (msg.sigs.empty()) continue;
+
+    for (const auto& m : msgs) {
+      if (m.name == msg.name) {
+        fprintf(stderr, "dbc %s: duplicate message name %s\n", dbc_name.c_str(), msg.name.c_str());
+        return false;
+      }
+    }
+
+    // ordered by start bit with the counter and checksum first, like the generated tables
+    std::stable_sort(msg.sigs.begin(), msg.sigs.end(), [](const ParsedSignal& a, const ParsedSignal& b) {
+      return a.start_bit < b.start_bit;
+    });
+    std::stable_sort(msg.sigs.begin(), msg.sigs.end(), [](const ParsedSignal& a, const ParsedSignal& b) {
+      bool a_first = a.name == "COUNTER" || a.name == "CHECKSUM";
+      bool b_first = b.name == "COUNTER" || b.name == "CHECKSUM";
+      return a_first && !b_first;
+    });
+
+    for (auto& sig : msg.sigs) {
+      sig.type = SignalType::DEFAULT;
+      if (checksum && sig.name == "CHECKSUM") {
+        sig.type = checksum->type;
+      } else if (checksum && checksum->counter_size >= 0 && sig.name == "COUNTER") {
+        sig.type = SignalType::COUNTER;
+      }
+
+      if (checksum && sig.name == "CHECKSUM"
+          && (sig.size != checksum->size || sig.start_bit % 8 != checksum->start_bit)) {
+        fprintf(stderr, "dbc %s: bad CHECKSUM in %s\n", dbc_name.c_str(), msg.name.c_str());
+        return false;
+      }
+      if (checksum && checksum->counter_size >= 0 && sig.name == "COUNTER"
+          && (sig.size != checksum->counter_size
+              || (checksum->counter_start_bit >= 0 && sig.start_bit % 8 != checksum->counter_start_bit))) {
+        fprintf(stderr, "dbc %s: bad COUNTER in %s\n", dbc_name.c_str(), msg.name.c_str());
+        return false;
+      }
+    }
+
+    msgs.push_back(msg);
+  }
+  std::sort(msgs.begin(), msgs.end(), [](const ParsedMsg& a, const ParsedMsg& b) {
+    return a.address < b.address;
+  });
+  std::stable_sort(vals.begin(), vals.end(), [](const ParsedVal& a, const ParsedVal& b) {
+    return a.address < b.address;
+  });
+
+  return true;
+}
+
+
+// lays out the tables as one image: header, DBC, Msgs, Signals, Vals, then the strings.
+// pointers are stored as offsets from the start of the image, relocate() turns them back
+std::vector<char> build_image(const std::string& dbc_name, uint64_t hash,
+                              const std::vector<ParsedMsg>& msgs, const std::vector<ParsedVal>& vals) {
+  std::vector<char> image;
+  auto reserve = [&](size_t size) {
+    size_t offset = (image.size() + 7) & ~(size_t)7;
+    image.resize(offset + size);
+    return offset;
+  };
+
+  size_t header_offset = reserve(sizeof(CacheHeader));
+  size_t dbc_offset = reserve(sizeof(DBC));
+  size_t msgs_offset = reserve(sizeof(Msg) * msgs.size());
+  std::vector<size_t> sigs_offsets;
+  for (const auto& msg : msgs) {
+    sigs_offsets.push_back(reserve(sizeof(Signal) * msg.sigs.size()));
+  }
+  size_t vals_offset = reserve(sizeof(Val) * vals.size());
+
+  auto add_string = [&](const std::string& s) {
+    size_t offset = image.size();
+    image.insert(image.end(), s.c_str(), s.c_str() + s.size() + 1);
+    return (const char*)offset;
+  };
+
+  DBC dbc = {
+    .name = add_string(dbc_name),
+    .num_msgs = msgs.size(),
+    .msgs = (const Msg*)msgs_offset,
+    .vals = (const Val*)vals_offset,
+    .num_vals = vals.size(),
+  };
+  memcpy(&image[dbc_offset], &dbc, sizeof(dbc));
+
+  for (size_t i=0; i<msgs.size(); i++) {
+    const auto& msg = msgs[i];
+    for (size_t j=0; j<msg.sigs.size(); j++) {
+      const auto& sig = msg.sigs[j];
+      int b1 = sig.is_little_endian ? sig.start_bit : (sig.start_bit / 8) * 8 + (7 - sig.start_bit % 8);
+      Signal s = {
+        .name = add_string(sig.name),
+        .b1 = b1,
+        .b2 = sig.size,
+        .bo = 64 - (b1 + sig.size),
+        .is_signed = sig.is_signed,
+        .factor = sig.factor,
+        .offset = sig.offset,
+        .is_little_endian = sig.is_little_endian,
+        .type = sig.type,
+      };
+      memcpy(&image[sigs_offsets[i] + j * sizeof(Signal)], &s, sizeof(s));
+    }
+
+    Msg m = {
+      .name = add_string(msg.name),
+      .address = msg.address,
+      .size = msg.size,
+      .num_sigs = msg.sigs.size(),
+      .sigs = (const Signal*)sigs_offsets[i],
+      .decode = NULL,
+    };
+    memcpy(&image[msgs_offset + i * sizeof(Msg)], &m, sizeof(m));
+  }
+
+  for (size_t i=0; i<vals.size(); i++) {
+    size_t sigs_offset = 0;
+    for (size_t j=0; j<msgs.size(); j++) {
+      if (msgs[j].address == vals[i].address) sigs_offset = sigs_offsets[j];
+    }
+
+    Val v = {
+      .name = add_string(vals[i].name),
+      .address = vals[i].address,
+      .def_val = add_string(vals[i].def_val),
+      .sigs = (const Signal*)sigs_offset,
+    };
+    memcpy(&image[vals_offset + i * sizeof(Val)], &v, sizeof(v));
+  }
+
+  image.resize((image.size() + 7) & ~(size_t)7);
+
+  CacheHeader header = {};
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.sizeof_signal = sizeof(Signal);
+  header.sizeof_msg = sizeof(Msg);
+  header.sizeof_val = sizeof(Val);
+  header.sizeof_dbc = sizeof(DBC);
+  header.hash = hash;
+  header.size = image.size();
+  header.dbc_offset = dbc_offset;
+  memcpy(&image[header_offset], &header, sizeof(header));
+
+  return image;
+}
+
+// an offset into the image becomes a pointer if count Ts fit at it, 0 stays NULL
+template <typename T>
+bool relocate_array(T*& ptr, size_t count, char* base, size_t size) {
+  const uintptr_t offset = (uintptr_t)ptr;
+  if (offset == 0) return count == 0;
+  if (offset > size || offset % alignof(T) != 0 || count > (size - offset) / sizeof(T)) return false;
+  ptr = (T*)(base + offset);
+  return true;
+}
+
+// strings are never NULL and have to end inside the image
+bool relocate_string(const char*& ptr, char* base, size_t size) {
+  const uintptr_t offset = (uintptr_t)ptr;
+  if (offset == 0 || offset >= size || !memchr(base + offset, 0, size - offset)) return false;
+  ptr = base + offset;
+  return true;
+}
+
+// image must be writable, returns NULL if it's not a cache for hash or anything in it points
+// outside of it
+const DBC* relocate(char* base, size_t size, uint64_t hash) {
+  const CacheHeader* header = (const CacheHeader*)base;
+  if (size < sizeof(CacheHeader)
+      || memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != CACHE_VERSION
+      || header->sizeof_signal != sizeof(Signal) || header->sizeof_msg != sizeof(Msg)
+      || header->sizeof_val != sizeof(Val) || header->sizeof_dbc != sizeof(DBC)
+      || header->hash != hash || header->size != size) {
+    return NULL;
+  }
+
+  DBC* dbc = (DBC*)header->dbc_offset;
+  if (!relocate_array(dbc, 1, base, size)
+      || !relocate_string(dbc->name, base, size)
+      || !relocate_array(dbc->msgs, dbc->num_msgs, base, size)
+      || !relocate_array(dbc->vals, dbc->num_vals, base, size)) {
+    return NULL;
+  }
+
+  Msg* msgs = (Msg*)dbc->msgs;
+  for (size_t i=0; i<dbc->num_msgs; i++) {
+    if (!relocate_string(msgs[i].name, base, size)
+        || !relocate_array(msgs[i].sigs, msgs[i].num_sigs, base, size)
+        || msgs[i].decode != NULL) {
+      return NULL;
+    }
+
+    Signal* sigs = (Signal*)msgs[i].sigs;
+    for (size_t j=0; j<msgs[i].num_sigs; j++) {
+      // the type indexes checksum_functions, read as an int since it may not be a SignalType
+      int type;
+      memcpy(&type, &sigs[j].type, sizeof(type));
+      if (!relocate_string(sigs[j].name, base, size) || type < 0 || type >= NUM_SIGNAL_TYPES) {
+        return NULL;
+      }
+    }
+  }
+
+  Val* vals = (Val*)dbc->vals;
+  for (size_t i=0; i<dbc->num_vals; i++) {
+    if (!relocate_string(vals[i].name, base, size)
+        || !relocate_string(vals[i].def_val, base, size)
+        || !relocate_array(vals[i].sigs, vals[i].sigs ? 1 : 0, base, size)) {
+      return NULL;
+    }
+  }
+  return dbc;
+}
+
+const DBC* map_cache(const std::string& path, uint64_t hash) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;
+
+  // someone else's file could point the tables anywhere, only trust our own
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid()
+      || st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  // private and writable for the relocation, read only after
+  void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return NULL;
+
+  const DBC* dbc = relocate((char*)mem, st.st_size, hash);
+  if (!dbc) {
+    munmap(mem, st.st_size);
+    return NULL;
+  }
+  mprotect(mem, st.st_size, PROT_READ);
+  return dbc;
+}
+
+// best effort, written next to the final name and renamed so readers never see half a file
+void write_cache(const std::string& dir, const std::string& path, const std::vector<char>& image) {
+  if (dir.empty()) return;
+  mkdir(dir.c_str(), 0700);
+
+  std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (!f) return;
+
+  bool ok = fwrite(image.data(), 1, image.size(), f) == image.size();
+  ok &= fclose(f) == 0;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+  }
+}
+
+// per user: $DBC_CACHE_DIR, else dbc in $XDG_CACHE_HOME or ~/.cache. empty if there's no home,
+// then nothing is cached
+std::string cache_dir() {
+  const char* dir = getenv("DBC_CACHE_DIR");
+  if (dir && dir[0]) return dir;
+
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  if (xdg && xdg[0]) {
+    mkdir(xdg, 0700);
+    return std::string(xdg) + "/dbc";
+  }
+
+  const char* home = getenv("HOME");
+  if (home && home[0]) {
+    std::string cache = std::string(home) + "/.cache";
+    mkdir(cache.c_str(), 0700);
+    return cache + "/dbc";
+  }
+  return "";
+}
+
+}
+
+const DBC* dbc_parse_file(const std::string& path) {
+  std::string text;
+  if (!read_file(path, text)) {
+    return NULL;
+  }
+
+  size_t slash = path.rfind('/');
+  std::string dbc_name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  if (dbc_name.size() > 4 && dbc_name.compare(dbc_name.size() - 4, 4, ".dbc") == 0) {
+    dbc_name.resize(dbc_name.size() - 4);
+  }
+
+  // the name picks the checksum algorithm, so it's part of the key
+  uint64_t hash = fnv1a(dbc_name.c_str(), dbc_name.size() + 1, 0xcbf29ce484222325ULL);
+  hash = fnv1a(text.data(), text.size(), hash);
+
+  char cache_name[32];
+  snprintf(cache_name, sizeof(cache_name), "/%016" PRIx64 ".bin", hash);
+  std::string dir = cache_dir();
+  std::string cache_path = dir + cache_name;
+
+  const DBC* dbc = dir.empty() ? NULL : map_cache(cache_path, hash);
+  if (dbc) {
+    return dbc;
+  }
+
+  std::vector<ParsedMsg> msgs;
+  std::vector<ParsedVal> vals;
+  if (!parse_dbc(dbc_name, text, msgs, vals)) {
+    return NULL;
+  }
+  std::vector<char> image = build_image(dbc_name, hash, msgs, vals);
+
+  write_cache(dir, cache_path, image);
+  dbc = dir.empty() ? NULL : map_cache(cache_path, hash);
+  if (!dbc) {
+    // no usable cache dir, keep the image on the heap
+    char* mem = new char[image.size()];
+    memcpy(mem, image.data(), image.size());
+    dbc = relocate(mem, image.size(), hash);
+  }
+  return dbc;
+}
@@ -0,0 +1,57 @@
+#include <cstdio>
+#include <cassert>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#include "common/timing.h"
+
+#include "common.h"
+
+// time and resident memory to dlopen libdbc.so and look up one dbc, which is all a process
+// driving one car needs. compare a default build against DBC_SPLIT=1
+
+static long rss_kb() {
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char** argv) {
+  const char* lib_path = argc > 1 ? argv[1] : "./libdbc.so";
+  const char* dbc_name = argc > 2 ? argv[2] : "honda_civic_touring_2016_can_generated";
+
+  long rss_start = rss_kb();
+
+  double t1 = millis_since_boot();
+  void* lib = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 1;
+  }
+  double t2 = millis_since_boot();
+
+  auto lookup = (const DBC* (*)(const char*))dlsym(lib, "dbc_lookup");
+  assert(lookup);
+  const DBC* dbc = lookup(dbc_name);
+  if (!dbc) {
+    fprintf(stderr, "no dbc %s\n", dbc_name);
+    return 1;
+  }
+  double t3 = millis_since_boot();
+
+  // registered lookups after the first one
+  const int iters = 100000;
+  for (int i=0; i<iters; i++) {
+    assert(lookup(dbc_name) == dbc);
+  }
+  double t4 = millis_since_boot();
+
+  printf("{\"dbc\": \"%s\", \"load_ms\": %.3f, \"first_lookup_ms\": %.3f, \"lookup_ns\": %.1f, \"rss_kb\": %ld}\n",
+         dbc_name, t2-t1, t3-t2, (t4-t3) * 1e6 / iters, rss_kb() - rss_start);
+  return 0;
+}
@@ -21,12 +21,10 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
+      {% if checksum and sig.name == "CHECKSUM" %}
+      .type = SignalType::{{checksum.signal_type}},
+      {% elif checksum and checksum.counter_size and sig.name == "COUNTER" %}
+      .type = SignalType::COUNTER,
       {% else %}
       .type = SignalType::DEFAULT,
       {% endif %}
@@ -35,6 +33,48 @@ const Signal sigs_{{address}}[] = {
 };
 {% endfor %}
 
+{% if decoders %}
+{% for address, msg_name, msg_size, sigs in msgs %}
+{% set has_le = sigs|selectattr("is_little_endian")|list|length > 0 %}
+{% set has_be = sigs|rejectattr("is_little_endian")|list|length > 0
+                or (checksum and "CHECKSUM" in sigs|map(attribute="name")|list) %}
+bool decode_{{address}}(const uint8_t* dat, double* vals) {
+  {% if has_le %}
+  const uint64_t le = read_u64_le(dat);
+  {% endif %}
+  {% if has_be %}
+  const uint64_t be = read_u64_be(dat);
+  {% endif %}
+  int64_t tmp;
+
+  {% for sig in sigs %}
+    {% if sig.is_little_endian %}
+      {% set b1 = sig.start_bit %}
+    {% else %}
+      {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
+    {% endif %}
+  // {{sig.name}}
+  tmp = ({{"le" if sig.is_little_endian else "be"}} >> {{b1 if sig.is_little_endian else 64 - (b1 + sig.size)}}) & {{"0x%XULL" % (2 ** sig.size - 1)}};
+    {% if sig.is_signed %}
+  tmp = (int64_t)((uint64_t)tmp << {{64 - sig.size}}) >> {{64 - sig.size}};
+    {% endif %}
+    {% if checksum and sig.name == "CHECKSUM" %}
+  if ({{checksum.function}}({{"0x%X" % address}}, be, {{msg_size}}) != tmp) return false;
+    {% endif %}
+    {% if sig.factor == 1 and sig.offset == 0 %}
+  vals[{{loop.index0}}] = tmp;
+    {% elif sig.offset == 0 %}
+  vals[{{loop.index0}}] = tmp * {{sig.factor}};
+    {% else %}
+  vals[{{loop.index0}}] = tmp * {{sig.factor}} + {{sig.offset}};
+    {% endif %}
+
+  {% endfor %}
+  return true;
+}
+
+{% endfor %}
+{% endif %}
 const Msg msgs[] = {
 {% for address, msg_name, msg_size, sigs in msgs %}
   {% set address_hex = "0x%X" % address %}
@@ -44,6 +84,7 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    .decode = {{"decode_%d" % address if decoders else "NULL"}},
   },
 {% endfor %}
 };
@@ -0,0 +1,138 @@
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common.h"
+
+// libFuzzer entry for the parse path. the first input byte picks a dbc, the rest is frames of
+// [message][length][payload]: message indexes the dbc's messages, 0xFF takes a raw 4 byte address
+// instead, and bit 7 of length moves the frame to bus 1 which isn't parsed. the frames go into one
+// can event fed to a parser kept per dbc with can_update_event, tracking every signal of every
+// message. the parsers live across inputs like they do in carstate, so counter and checksum
+// failures and timeouts build up from one input to the next. every input is 10ms later
+
+extern "C" {
+  size_t dbc_list(size_t out_size, const char** out);
+
+  void* can_init(int bus, const char* dbc_name,
+                 size_t num_message_options, const MessageParseOptions* message_options,
+                 size_t num_signal_options, const SignalParseOptions* signal_options,
+                 bool sendcan, const char* tcp_addr);
+  void can_update_event(void* can, uint64_t sec, const void* data, size_t size);
+  size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+  size_t can_query_changed(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+}
+
+#define MAX_FRAMES 256
+#define INPUT_NS 10000000ULL
+
+namespace {
+
+struct Target {
+  const DBC* dbc;
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+
+  // made on the first input for this dbc
+  void* can;
+  std::vector<SignalValue> values;
+};
+
+std::vector<Target> make_targets() {
+  std::vector<const char*> names(dbc_list(0, NULL));
+  dbc_list(names.size(), names.data());
+
+  std::vector<Target> targets;
+  for (auto name : names) {
+    Target t = {.dbc = dbc_lookup(std::string(name))};
+    for (int i=0; i<t.dbc->num_msgs; i++) {
+      const Msg& msg = t.dbc->msgs[i];
+
+      bool dup = false;
+      for (const auto& op : t.options) dup |= op.address == msg.address;
+      if (dup) continue;
+
+      t.options.push_back({msg.address, 100});
+      for (int j=0; j<msg.num_sigs; j++) {
+        if (msg.sigs[j].type == SignalType::DEFAULT) {
+          t.sigoptions.push_back({msg.address, msg.sigs[j].name, 0});
+        }
+      }
+    }
+    targets.push_back(t);
+  }
+  return targets;
+}
+
+struct Frame {
+  uint32_t address;
+  uint8_t src;
+  const uint8_t* dat;
+  size_t len;
+};
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static std::vector<Target> targets = make_targets();
+  static uint64_t sec = 0;
+  if (size < 1 || targets.empty()) return 0;
+
+  Target& t = targets[data[0] % targets.size()];
+  if (!t.can) {
+    t.can = can_init(0, t.dbc->name, t.options.size(), t.options.data(),
+                     t.sigoptions.size(), t.sigoptions.data(), false, NULL);
+    t.values.resize(can_query(t.can, 0, NULL, 0, NULL));
+  }
+  const uint8_t* p = data + 1;
+  const uint8_t* end = data + size;
+
+  std::vector<Frame> frames;
+  while (p + 2 <= end && frames.size() < MAX_FRAMES) {
+    Frame f;
+    if (p[0] == 0xFF) {
+      if (p + 6 > end) break;
+      memcpy(&f.address, p + 1, 4);
+      p += 5;
+    } else {
+      f.address = t.dbc->num_msgs ? t.dbc->msgs[p[0] % t.dbc->num_msgs].address : 0;
+      p += 1;
+    }
+    f.src = (p[0] & 0x80) ? 1 : 0;
+    // lengths over 8 go through too, the parser has to drop them
+    f.len = std::min((size_t)(p[0] & 0xF), (size_t)(end - p - 1));
+    f.dat = p + 1;
+    p += 1 + f.len;
+    frames.push_back(f);
+  }
+
+  sec += INPUT_NS;
+  capnp::MallocMessageBuilder msg;
+  cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(sec);
+  auto cans = event.initCan(frames.size());
+  for (size_t i=0; i<frames.size(); i++) {
+    cans[i].setAddress(frames[i].address);
+    cans[i].setSrc(frames[i].src);
+    cans[i].setDat(kj::arrayPtr(frames[i].dat, frames[i].len));
+  }
+  auto words = capnp::messageToFlatArray(msg);
+
+  can_update_event(t.can, sec, words.begin(), words.size() * sizeof(capnp::word));
+
+  bool valid;
+  const size_t changed = can_query_changed(t.can, &valid, t.values.size(), t.values.data());
+  for (size_t i=0; i<changed; i++) {
+    // every parsed value and name is read so asan sees them
+    volatile double v = t.values[i].value;
+    volatile size_t n = strlen(t.values[i].name);
+    (void)v;
+    (void)n;
+  }
+  return 0;
+}
@@ -15,6 +15,13 @@ typedef struct {
   double value;
 } SignalPackValue;
 
+typedef struct {
+  const void* plan;
+  int bus;
+  const double* values;
+  int counter;
+} CANPackMessage;
+
 typedef struct {
   uint32_t address;
   const char* name;
@@ -26,6 +33,15 @@ typedef struct {
   int check_frequency;
 } MessageParseOptions;
 
+typedef struct {
+  int bus;
+  const char* dbc_name;
+  size_t num_message_options;
+  const MessageParseOptions* message_options;
+  size_t num_signal_options;
+  const SignalParseOptions* signal_options;
+} CANBusOptions;
+
 typedef struct {
   uint32_t address;
   uint16_t ts;
@@ -33,12 +49,40 @@ typedef struct {
   double value;
 } SignalValue;
 
+typedef struct {
+  uint32_t address;
+  bool valid;
+  uint32_t missed;
+  uint32_t timeouts;
+  uint64_t seen;
+} MessageStatus;
+
+typedef struct {
+  uint32_t address;
+  uint32_t received;
+  uint32_t checksum_errors;
+  uint32_t counter_errors;
+  double frequency;
+  double interval_min;
+  double interval_max;
+  double jitter;
+} CANStats;
+
+typedef struct {
+  uint32_t address;
+  const char* name;
+  size_t size;
+  const uint64_t* ts;
+  const double* vals;
+} SignalSeries;
+
 
 typedef enum {
   DEFAULT,
   HONDA_CHECKSUM,
-  HONDA_COUNTER,
+  COUNTER,
   TOYOTA_CHECKSUM,
+  CRC8_J1850_CHECKSUM,
 } SignalType;
 
 typedef struct {
@@ -46,6 +90,7 @@ typedef struct {
   int b1, b2, bo;
   bool is_signed;
   double factor, offset;
+  bool is_little_endian;
   SignalType type;
 } Signal;
 
@@ -55,6 +100,7 @@ typedef struct {
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  bool (*decode)(const uint8_t* dat, double* vals);
 } Msg;
 
 typedef struct {
@@ -80,13 +126,54 @@ void* can_init(int bus, const char* dbc_name,
 
 void can_update(void* can, uint64_t sec, bool wait);
 
+void* can_init_multi(size_t num_buses, const CANBusOptions* buses, bool sendcan, const char* tcp_addr);
+
+void can_update_multi(void* can, uint64_t sec, bool wait);
+
+void* can_multi_get_bus(void* can, size_t bus_idx);
+
+void can_update_event(void* can, uint64_t sec, const void* data, size_t size);
+
 size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
 
+size_t can_query_changed(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+
+size_t can_query_status(void* can, size_t out_size, MessageStatus* out);
+
+void can_stats_enable(void* can, bool enable);
+
+size_t can_stats(void* can, bool reset, size_t out_size, CANStats* out);
+
+void* can_parse_log(int bus, const char* dbc_name,
+                    size_t num_message_options, const MessageParseOptions* message_options,
+                    size_t num_signal_options, const SignalParseOptions* signal_options,
+                    bool sendcan, const void* log_data, size_t log_size);
+
+size_t can_parse_log_query(void* log, size_t out_series_size, SignalSeries* out_series);
+
+void can_parse_log_free(void* log);
+
+size_t honda_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                            const uint8_t* size, bool* valid);
+size_t toyota_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                             const uint8_t* size, bool* valid);
+
 const DBC* dbc_lookup(const char* dbc_name);
 
+const DBC* dbc_load_file(const char* path);
+
+size_t dbc_list(size_t out_size, const char** out);
+
 void* canpack_init(const char* dbc_name);
 
 uint64_t canpack_pack(void* inst, uint32_t address, size_t num_vals, const SignalPackValue *vals, int counter);
+
+void* canpack_prepare(void* inst, uint32_t address, size_t num_names, const char** names);
+
+uint64_t canpack_pack_prepared(void* plan, const double* values, int counter);
+
+size_t canpack_pack_sendcan(void* inst, size_t num_msgs, const CANPackMessage* msgs,
+                            uint8_t* out, size_t out_size);
 """)
 
 libdbc = ffi.dlopen(libdbc_fn)
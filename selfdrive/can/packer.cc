@@ -4,12 +4,22 @@
 #include <utility>
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <cmath>
+#include <cstring>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common/timing.h"
 
 #include "common.h"
 
 #define WARN printf
 
+// first segment of the sendcan event, enough for a few dozen frames without allocating
+#define SENDCAN_SEGMENT_WORDS 1024
+
 namespace {
 
   // this is the same as read_u64_le, but uses uint64_t as in/out
@@ -24,7 +34,7 @@ namespace {
            ((x & 0x00000000000000ffull) << 56);
   }
 
-  uint64_t set_value(uint64_t ret, Signal sig, int64_t ival){
+  uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival){
     int shift = sig.is_little_endian? sig.b1 : sig.bo;
     uint64_t mask = ((1ULL << sig.b2)-1) << shift;
     uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
@@ -37,6 +47,51 @@ namespace {
     return ret;
   }
 
+  // signals of one message resolved once by CANPacker::prepare, packed by position
+  struct PackPlan {
+    uint32_t address;
+    unsigned int size;
+    std::vector<const Signal*> sigs;  // NULL for names the dbc doesn't have
+    std::vector<std::string> names;
+    const Signal* counter;
+    const Signal* checksum;
+    ChecksumFn checksum_fn;
+  };
+
+  // same result as pack with the prepared names, values in the same order. no allocation
+  uint64_t pack_prepared(const PackPlan* plan, const double* values, int counter) {
+    uint64_t ret = 0;
+    for (size_t i=0; i<plan->sigs.size(); i++) {
+      const Signal* sig = plan->sigs[i];
+      if (!sig) {
+        WARN("undefined signal %s - %d\n", plan->names[i].c_str(), plan->address);
+        continue;
+      }
+
+      int64_t ival = (int64_t)(round((values[i] - sig->offset) / sig->factor));
+      if (ival < 0) {
+        ival = (1ULL << sig->b2) + ival;
+      }
+
+      ret = set_value(ret, *sig, ival);
+    }
+
+    if (counter >= 0){
+      if (!plan->counter) {
+        WARN("COUNTER not defined\n");
+        return ret;
+      }
+      ret = set_value(ret, *plan->counter, counter);
+    }
+
+    if (plan->checksum_fn) {
+      unsigned int chksm = plan->checksum_fn(plan->address, ret, plan->size);
+      ret = set_value(ret, *plan->checksum, chksm);
+    }
+
+    return ret;
+  }
+
   class CANPacker {
   public:
     CANPacker(const std::string& dbc_name) {
@@ -48,9 +103,13 @@ namespace {
         message_lookup[msg->address] = *msg;
         for (int j=0; j<msg->num_sigs; j++) {
           const Signal* sig = &msg->sigs[j];
-          signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+          signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = sig;
         }
       }
+
+      // MallocMessageBuilder wants it zeroed, and zeroes it again when it's done
+      sendcan_segment = kj::heapArray<capnp::word>(SENDCAN_SEGMENT_WORDS);
+      memset(sendcan_segment.begin(), 0, sendcan_segment.size() * sizeof(capnp::word));
     }
 
     uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
@@ -64,7 +123,7 @@ namespace {
           WARN("undefined signal %s - %d\n", name.c_str(), address);
           continue;
         }
-        auto sig = sig_it->second;
+        const Signal& sig = *sig_it->second;
 
         int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
         if (ival < 0) {
@@ -80,9 +139,9 @@ namespace {
           WARN("COUNTER not defined\n");
           return ret;
         }
-        auto sig = sig_it->second;
+        const Signal& sig = *sig_it->second;
 
-        if (sig.type != SignalType::HONDA_COUNTER){
+        if (sig.type != SignalType::COUNTER){
           WARN("COUNTER signal type not valid\n");
         }
 
@@ -91,13 +150,10 @@ namespace {
 
       auto sig_it = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
       if (sig_it != signal_lookup.end()) {
-        auto sig = sig_it->second;
-        if (sig.type == SignalType::HONDA_CHECKSUM){
-          unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
-          ret = set_value(ret, sig, chksm);
-        }
-        else if (sig.type == SignalType::TOYOTA_CHECKSUM){
-          unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
+        const Signal& sig = *sig_it->second;
+        ChecksumFn checksum_fn = checksum_functions[sig.type];
+        if (checksum_fn) {
+          unsigned int chksm = checksum_fn(address, ret, message_lookup[address].size);
           ret = set_value(ret, sig, chksm);
         } else {
           WARN("CHECKSUM signal type not valid\n");
@@ -107,12 +163,96 @@ namespace {
       return ret;
     }
 
+    // does the string lookups for pack_prepared up front, the plan lives as long as the packer
+    const PackPlan* prepare(uint32_t address, const std::vector<std::string>& names) {
+      auto msg_it = message_lookup.find(address);
+      if (msg_it == message_lookup.end()) {
+        WARN("undefined message %d\n", address);
+        return NULL;
+      }
+
+      std::unique_ptr<PackPlan> plan(new PackPlan());
+      plan->address = address;
+      plan->size = msg_it->second.size;
+      plan->names = names;
+
+      for (const auto& name : names) {
+        const Signal* sig = find_signal(address, name);
+        if (!sig) {
+          WARN("undefined signal %s - %d\n", name.c_str(), address);
+        }
+        plan->sigs.push_back(sig);
+      }
+
+      plan->counter = find_signal(address, "COUNTER");
+      if (plan->counter && plan->counter->type != SignalType::COUNTER) {
+        WARN("COUNTER signal type not valid\n");
+      }
+
+      plan->checksum = find_signal(address, "CHECKSUM");
+      plan->checksum_fn = plan->checksum ? checksum_functions[plan->checksum->type] : NULL;
+      if (plan->checksum && !plan->checksum_fn) {
+        WARN("CHECKSUM signal type not valid\n");
+      }
+
+      plans.push_back(std::move(plan));
+      return plans.back().get();
+    }
+
+    // packs every message and serializes them as one sendcan event into out. messages without a
+    // plan, canpack_prepare failed for them, are left out.
+    // returns the serialized size, out is left untouched if it doesn't fit
+    size_t pack_sendcan(size_t num_msgs, const CANPackMessage* msgs, uint8_t* out, size_t out_size) {
+      capnp::MallocMessageBuilder msg(sendcan_segment);
+      cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+      event.setLogMonoTime(nanos_since_boot());
 
+      size_t num_planned = 0;
+      for (size_t i=0; i<num_msgs; i++) {
+        if (msgs[i].plan) {
+          num_planned++;
+        } else {
+          WARN("sendcan message %zu has no plan, skipped\n", i);
+        }
+      }
+
+      auto cans = event.initSendcan(num_planned);
+      size_t j = 0;
+      for (size_t i=0; i<num_msgs; i++) {
+        const PackPlan* plan = (const PackPlan*)msgs[i].plan;
+        if (!plan) continue;
+
+        uint64_t dat = pack_prepared(plan, msgs[i].values, msgs[i].counter);
+
+        auto can = cans[j++];
+        can.setAddress(plan->address);
+        can.setBusTime(0);
+        can.setSrc(msgs[i].bus);
+        auto can_dat = can.initDat(plan->size);
+        for (int k=0; k<plan->size; k++) {
+          can_dat[k] = dat >> (56 - 8*k);
+        }
+      }
+
+      size_t size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+      if (size <= out_size) {
+        kj::ArrayOutputStream stream(kj::arrayPtr(out, out_size));
+        capnp::writeMessage(stream, msg);
+      }
+      return size;
+    }
 
   private:
+    const Signal* find_signal(uint32_t address, const std::string& name) {
+      auto it = signal_lookup.find(std::make_pair(address, name));
+      return it == signal_lookup.end() ? NULL : it->second;
+    }
+
     const DBC *dbc = NULL;
-    std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
+    std::map<std::pair<uint32_t, std::string>, const Signal*> signal_lookup;
     std::map<uint32_t, Msg> message_lookup;
+    std::vector<std::unique_ptr<PackPlan>> plans;
+    kj::Array<capnp::word> sendcan_segment;
   };
 
 }
@@ -129,4 +269,25 @@ extern "C" {
     return cp->pack(address, std::vector<SignalPackValue>(vals, vals+num_vals), counter);
   }
 
+  // returns NULL if the message isn't in the dbc. owned by the packer
+  void* canpack_prepare(void* inst, uint32_t address, size_t num_names, const char** names) {
+    CANPacker *cp = (CANPacker*)inst;
+
+    return (void*)cp->prepare(address, std::vector<std::string>(names, names+num_names));
+  }
+
+  // values are in the order of the names given to canpack_prepare
+  uint64_t canpack_pack_prepared(void* plan, const double* values, int counter) {
+    return pack_prepared((const PackPlan*)plan, values, counter);
+  }
+
+  // serialized Event with a sendcan list of the packed messages, ready to publish.
+  // returns the size needed, call again with a bigger buffer if it's more than out_size
+  size_t canpack_pack_sendcan(void* inst, size_t num_msgs, const CANPackMessage* msgs,
+                              uint8_t* out, size_t out_size) {
+    CANPacker *cp = (CANPacker*)inst;
+
+    return cp->pack_sendcan(num_msgs, msgs, out, out_size);
+  }
+
 }
@@ -7,6 +7,8 @@ class CANPacker(object):
     self.packer = libdbc.canpack_init(dbc_name)
     self.dbc = libdbc.dbc_lookup(dbc_name)
     self.sig_names = {}
+    self.plans = {}
+    self.sendcan_buf = ffi.new("uint8_t[]", 4096)
     self.name_to_address_and_size = {}
 
     num_msgs = self.dbc[0].num_msgs
@@ -18,20 +20,30 @@ class CANPacker(object):
       self.name_to_address_and_size[name] = (address, msg.size)
       self.name_to_address_and_size[address] = (address, msg.size)
 
-  def pack(self, addr, values, counter):
-    values_thing = []
-    for name, value in values.iteritems():
-      if name not in self.sig_names:
-        self.sig_names[name] = ffi.new("char[]", name)
+  def _plan(self, addr, values):
+    # signal lookups are done once per address and set of signal names. unknown signals are
+    # warned about on every pack, an unknown address isn't cached so it's warned about again
+    key = (addr, frozenset(values))
+    plan = self.plans.get(key)
+    if plan is None:
+      names = sorted(values)
+      for name in names:
+        if name not in self.sig_names:
+          self.sig_names[name] = ffi.new("char[]", name)
 
-      values_thing.append({
-        'name': self.sig_names[name],
-        'value': value
-      })
+      names_c = ffi.new("const char*[]", [self.sig_names[name] for name in names])
+      plan = (libdbc.canpack_prepare(self.packer, addr, len(names), names_c), names)
+      if plan[0] != ffi.NULL:
+        self.plans[key] = plan
+    return plan
 
-    values_c = ffi.new("SignalPackValue[]", values_thing)
+  def pack(self, addr, values, counter):
+    handle, names = self._plan(addr, values)
+    if handle == ffi.NULL:
+      return 0
 
-    return libdbc.canpack_pack(self.packer, addr, len(values_thing), values_c, counter)
+    values_c = ffi.new("double[]", [values[name] for name in names])
+    return libdbc.canpack_pack_prepared(handle, values_c, counter)
 
   def pack_bytes(self, addr, values, counter=-1):
     addr, size = self.name_to_address_and_size[addr]
@@ -44,6 +56,33 @@ class CANPacker(object):
     addr, msg = self.pack_bytes(addr, values, counter)
     return [addr, 0, msg, bus]
 
+  def make_sendcan(self, msgs):
+    """msgs is a list of (addr, bus, values, counter) like make_can_msg takes them.
+    returns a serialized Event with all of them packed in its sendcan list. like pack, a message
+    canpack_prepare fails for isn't sent"""
+    planned = []
+    for addr, bus, values, counter in msgs:
+      addr, _ = self.name_to_address_and_size[addr]
+      handle, names = self._plan(addr, values)
+      if handle != ffi.NULL:
+        planned.append((handle, names, bus, values, counter))
+
+    msgs_c = ffi.new("CANPackMessage[]", len(planned))
+    values_c = []
+    for i, (handle, names, bus, values, counter) in enumerate(planned):
+      values_c.append(ffi.new("double[]", [values[name] for name in names]))
+
+      msgs_c[i].plan = handle
+      msgs_c[i].bus = bus
+      msgs_c[i].values = values_c[-1]
+      msgs_c[i].counter = counter
+
+    size = libdbc.canpack_pack_sendcan(self.packer, len(planned), msgs_c, self.sendcan_buf, len(self.sendcan_buf))
+    if size > len(self.sendcan_buf):
+      self.sendcan_buf = ffi.new("uint8_t[]", size)
+      size = libdbc.canpack_pack_sendcan(self.packer, len(planned), msgs_c, self.sendcan_buf, len(self.sendcan_buf))
+    return ffi.buffer(self.sendcan_buf, size)[:]
+
 
 if __name__ == "__main__":
   ## little endian test
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <cassert>
 #include <cstring>
+#include <cmath>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,13 +12,17 @@
 #include <string>
 #include <vector>
 #include <algorithm>
-#include <unordered_map>
+#include <utility>
+#include <functional>
+#include <memory>
 
 #include <zmq.h>
 
 #include <capnp/serialize.h>
 #include "cereal/gen/cpp/log.capnp.h"
 
+#include "common/msgq.h"
+
 #include "common.h"
 
 #define DEBUG(...)
@@ -27,78 +32,100 @@
 
 #define MAX_BAD_COUNTER 5
 
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 4; // remove checksum
-
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
-  s = 8-s;
-  s &= 0xF;
-
-  return s;
-}
-
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
-  d >>= ((8-l)*8); // remove padding
-  d >>= 8; // remove checksum
-
-  unsigned int s = l;
-  while (address) { s += address & 0xff; address >>= 8; }
-  while (d) { s += d & 0xff; d >>= 8; }
-
-  return s & 0xFF;
-}
+// weight of the newest interval in the arrival averages
+#define STATS_EWMA_K (1.0 / 16)
 
 namespace {
 
-uint64_t read_u64_be(const uint8_t* v) {
-  return (((uint64_t)v[0] << 56)
-          | ((uint64_t)v[1] << 48)
-          | ((uint64_t)v[2] << 40)
-          | ((uint64_t)v[3] << 32)
-          | ((uint64_t)v[4] << 24)
-          | ((uint64_t)v[5] << 16)
-          | ((uint64_t)v[6] << 8)
-          | (uint64_t)v[7]);
-}
-
-uint64_t read_u64_le(const uint8_t* v) {
-  return ((uint64_t)v[0]
-          | ((uint64_t)v[1] << 8)
-          | ((uint64_t)v[2] << 16)
-          | ((uint64_t)v[3] << 24)
-          | ((uint64_t)v[4] << 32)
-          | ((uint64_t)v[5] << 40)
-          | ((uint64_t)v[6] << 48)
-          | ((uint64_t)v[7] << 56));
-}
-
-
 struct MessageState {
   uint32_t address;
   unsigned int size;
 
+  // index of parse_sigs[0] in the parser's flat signal list
+  size_t sig_base;
+
   std::vector<Signal> parse_sigs;
   std::vector<double> vals;
 
+  // generated decoder, fills decoded with every signal of the message
+  MsgDecodeFn decode;
+  std::vector<double> decoded;
+  std::vector<int> sig_index;  // parse_sigs[i] is decoded[sig_index[i]]
+  int counter_index;  // into decoded, -1 if the message has no counter
+  int counter_size;
+
+  // byte orders used by parse_sigs
+  bool has_le;
+  bool has_be;
+
   uint16_t ts;
   uint64_t seen;
   uint64_t check_threshold;
 
+  // checked messages are invalid until they first parse and after every timeout
+  bool valid;
+  uint32_t missed;    // frames estimated lost from the gaps between arrivals
+  uint32_t timeouts;  // times the message went invalid
+
+  // every failure is counted, unlike counter_fail which decays
+  uint32_t checksum_errors;
+  uint32_t counter_errors;
+
+  // arrival statistics, only kept while the parser's stats are enabled
+  uint32_t received;
+  uint64_t last_rx;
+  uint64_t interval_min;
+  uint64_t interval_max;
+  double interval_avg;  // ewma, ns
+  double jitter_avg;    // ewma of the deviation from interval_avg, ns
+
   uint8_t counter;
   uint8_t counter_fail;
 
-  bool parse(uint64_t sec, uint16_t ts_, uint64_t dat) {
+  bool parse(uint64_t sec, uint16_t ts_, const uint8_t* dat) {
+    if (decode) {
+      return parse_decoded(sec, ts_, dat);
+    }
+
+    // only build the byte orders the tracked signals use, single-endian messages pay for one
+    uint64_t le = has_le ? read_u64_le(dat) : 0;
+    uint64_t be = has_be ? read_u64_be(dat) : 0;
+
+    DEBUG("  proc %X: le %llx be %llx\n", address, le, be);
+
+    return parse_table(sec, ts_, le, be);
+  }
+
+  bool parse_decoded(uint64_t sec, uint16_t ts_, const uint8_t* dat) {
+    if (!decode(dat, decoded.data())) {
+      INFO("%X CHECKSUM FAIL\n", address);
+      checksum_errors++;
+      return false;
+    }
+
+    if (counter_index >= 0 && !update_counter((int64_t)decoded[counter_index], counter_size)) {
+      return false;
+    }
+
+    for (int i=0; i < parse_sigs.size(); i++) {
+      vals[i] = decoded[sig_index[i]];
+    }
+    ts = ts_;
+    seen = sec;
+
+    return true;
+  }
+
+  // checksums are always computed over the big endian word
+  bool parse_table(uint64_t sec, uint16_t ts_, uint64_t le, uint64_t be) {
     for (int i=0; i < parse_sigs.size(); i++) {
       auto& sig = parse_sigs[i];
       int64_t tmp;
 
       if (sig.is_little_endian){
-        tmp = (dat >> sig.b1) & ((1ULL << sig.b2)-1);
+        tmp = (le >> sig.b1) & ((1ULL << sig.b2)-1);
       } else {
-        tmp = (dat >> sig.bo) & ((1ULL << sig.b2)-1);
+        tmp = (be >> sig.bo) & ((1ULL << sig.b2)-1);
       }
 
       if (sig.is_signed) {
@@ -107,20 +134,16 @@ struct MessageState {
 
       DEBUG("parse %X %s -> %lld\n", address, sig.name, tmp);
 
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat, size) != tmp) {
-          INFO("%X CHECKSUM FAIL\n", address);
+      if (sig.type == SignalType::COUNTER) {
+        if (!update_counter(tmp, sig.b2)) {
           return false;
         }
-      } else if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!honda_update_counter(tmp)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        // INFO("CHECKSUM %d %d %018llX - %lld vs %d\n", address, size, dat, tmp, toyota_checksum(address, dat, size));
+      } else if (sig.type != SignalType::DEFAULT) {
+        // INFO("CHECKSUM %d %d %018llX - %lld vs %d\n", address, size, be, tmp, checksum_functions[sig.type](address, be, size));
 
-        if (toyota_checksum(address, dat, size) != tmp) {
+        if (checksum_functions[sig.type](address, be, size) != tmp) {
           INFO("%X CHECKSUM FAIL\n", address);
+          checksum_errors++;
           return false;
         }
       }
@@ -134,10 +157,11 @@ struct MessageState {
   }
 
 
-  bool honda_update_counter(int64_t v) {
+  bool update_counter(int64_t v, int cnt_size) {
     uint8_t old_counter = counter;
     counter = v;
-    if (((old_counter+1) & 3) != v) {
+    if (((old_counter+1) & ((1 << cnt_size) - 1)) != v) {
+      counter_errors++;
       counter_fail += 1;
       if (counter_fail > 1) {
         INFO("%X COUNTER FAIL %d -- %d vs %d\n", address, counter_fail, old_counter, (int)v);
@@ -151,16 +175,44 @@ struct MessageState {
     return true;
   }
 
+  // rx is when the frame arrived, failed frames count too
+  void update_stats(uint64_t rx) {
+    received++;
+    if (last_rx > 0 && rx >= last_rx) {
+      const uint64_t interval = rx - last_rx;
+      interval_min = std::min(interval_min, interval);
+      interval_max = std::max(interval_max, interval);
+      if (interval_avg == 0) {
+        interval_avg = interval;
+      } else {
+        jitter_avg += (std::abs(interval - interval_avg) - jitter_avg) * STATS_EWMA_K;
+        interval_avg += (interval - interval_avg) * STATS_EWMA_K;
+      }
+    }
+    last_rx = rx;
+  }
+
+  void reset_interval_range() {
+    interval_min = UINT64_MAX;
+    interval_max = 0;
+  }
+
 };
 
 
-class CANParser {
+// subscription to can or sendcan, hands every received event's frames to a callback.
+// local can is read out of boardd's shared memory ring when it's listed in MSGQ_SERVICES.
+// nothing writes sendcan to a ring, so it's always zmq
+class CANSubscriber {
  public:
-  CANParser(int abus, const std::string& dbc_name,
-            const std::vector<MessageParseOptions> &options,
-            const std::vector<SignalParseOptions> &sigoptions,
-            bool sendcan, const std::string& tcp_addr)
-    : bus(abus) {
+  CANSubscriber(bool asendcan, const std::string& tcp_addr)
+    : sendcan(asendcan) {
+    if (!sendcan && tcp_addr == "127.0.0.1" && msgq_enabled("can")) {
+      use_msgq = true;
+      msgq_sub_init(&msgq, "can", false);
+      return;
+    }
+
     // connect to can on 8006
     context = zmq_ctx_new();
     subscriber = zmq_socket(context, ZMQ_SUB);
@@ -176,7 +228,139 @@ class CANParser {
     const char *tcp_addr_char = tcp_addr_str.c_str();
 
     zmq_connect(subscriber, tcp_addr_char);
+  }
+
+  ~CANSubscriber() {
+    if (use_msgq) {
+      msgq_sub_destroy(&msgq);
+    }
+  }
+
+  template <typename F>
+  void recv(bool wait, F f) {
+    if (use_msgq) {
+      recv_msgq(wait, f);
+      return;
+    }
+
+    int err;
+
+    // recv from can
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
 
+    // multiple recv is fine
+    bool first = wait;
+    while (1) {
+      if (first) {
+        err = zmq_msg_recv(&msg, subscriber, 0);
+        first = false;
+      } else {
+        err = zmq_msg_recv(&msg, subscriber, ZMQ_DONTWAIT);
+      }
+      if (err < 0) break;
+
+      // extract the messages
+      capnp::FlatArrayMessageReader cmsg(aligned_words(&msg));
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+      f(event.getLogMonoTime(), sendcan ? event.getSendcan() : event.getCan());
+    }
+
+    zmq_msg_close(&msg);
+  }
+
+ private:
+  template <typename F>
+  void recv_msgq(bool wait, F f) {
+    size_t size;
+    const void *data = msgq_sub_recv(&msgq, &size);
+    while (data == NULL && wait) {
+      msgq_sub_wait(&msgq, -1);
+      data = msgq_sub_recv(&msgq, &size);
+    }
+
+    for (; data != NULL; data = msgq_sub_recv(&msgq, &size)) {
+      check_laps();
+
+      // copied out and checked before anything is parsed, the writer may lap the ring while
+      // it's being read. it holds seconds of can, so that takes a reader stalled for as long
+      const size_t num_words = size / sizeof(capnp::word);
+      if (scratch.size() < num_words) {
+        scratch = kj::heapArray<capnp::word>(num_words);
+      }
+      memcpy(scratch.begin(), data, num_words * sizeof(capnp::word));
+      if (!msgq_sub_valid(&msgq)) {
+        msgq_dropped++;
+        INFO("can msgq: dropped an event overwritten while it was copied, %llu so far\n",
+             (unsigned long long)msgq_dropped);
+        continue;
+      }
+
+      capnp::FlatArrayMessageReader cmsg(kj::arrayPtr((const capnp::word*)scratch.begin(), num_words));
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+      f(event.getLogMonoTime(), event.getCan());
+    }
+    check_laps();
+  }
+
+  // the writer got a ring ahead and msgq_sub_recv skipped to the newest events, what was in
+  // between is lost
+  void check_laps() {
+    if (msgq.laps != msgq_laps) {
+      INFO("can msgq: lost events, lapped %llu times, %llu so far\n",
+           (unsigned long long)(msgq.laps - msgq_laps), (unsigned long long)msgq.laps);
+      msgq_laps = msgq.laps;
+    }
+  }
+
+  // read the message in place when zmq hands back an aligned buffer,
+  // otherwise copy into the scratch buffer which only ever grows
+  kj::ArrayPtr<const capnp::word> aligned_words(zmq_msg_t *msg) {
+    const size_t size = zmq_msg_size(msg);
+    const size_t num_words = size / sizeof(capnp::word);
+
+    if (((uintptr_t)zmq_msg_data(msg) % sizeof(capnp::word)) == 0) {
+      return kj::arrayPtr((const capnp::word*)zmq_msg_data(msg), num_words);
+    }
+
+    if (scratch.size() < num_words) {
+      scratch = kj::heapArray<capnp::word>(num_words);
+    }
+    memcpy(scratch.begin(), zmq_msg_data(msg), num_words * sizeof(capnp::word));
+    return kj::arrayPtr((const capnp::word*)scratch.begin(), num_words);
+  }
+
+  const bool sendcan;
+  // zmq vars
+  void *context = NULL;
+  void *subscriber = NULL;
+  kj::Array<capnp::word> scratch;
+
+  bool use_msgq = false;
+  MsgqSub msgq;
+  // events the writer overwrote before they were copied out
+  uint64_t msgq_dropped = 0;
+  // msgq.laps already logged
+  uint64_t msgq_laps = 0;
+};
+
+class CANParser {
+ public:
+  CANParser(int abus, const std::string& dbc_name,
+            const std::vector<MessageParseOptions> &options,
+            const std::vector<SignalParseOptions> &sigoptions,
+            bool sendcan, const std::string& tcp_addr)
+    : CANParser(abus, dbc_name, options, sigoptions) {
+    subscriber.reset(new CANSubscriber(sendcan, tcp_addr));
+  }
+
+  // offline parser, frames are fed through UpdateCans
+  CANParser(int abus, const std::string& dbc_name,
+            const std::vector<MessageParseOptions> &options,
+            const std::vector<SignalParseOptions> &sigoptions)
+    : bus(abus) {
     dbc = dbc_lookup(dbc_name);
     assert(dbc);
 
@@ -189,6 +373,9 @@ class CANParser {
       // msg is not valid if a message isn't received for 10 consecutive steps
       if (op.check_frequency > 0) {
         state.check_threshold = (1000000000ULL / op.check_frequency) * 10;
+        num_invalid++;
+      } else {
+        state.valid = true;
       }
 
 
@@ -205,6 +392,13 @@ class CANParser {
       }
 
       state.size = msg->size;
+      state.decode = msg->decode;
+      state.has_le = false;
+      state.has_be = false;
+      state.decoded.resize(msg->num_sigs);
+      state.counter_index = -1;
+      state.counter_size = 0;
+      state.reset_interval_range();
 
       // track checksums and counters for this message
       for (int i=0; i<msg->num_sigs; i++) {
@@ -212,6 +406,11 @@ class CANParser {
         if (sig->type != SignalType::DEFAULT) {
           state.parse_sigs.push_back(*sig);
           state.vals.push_back(0);
+          state.sig_index.push_back(i);
+        }
+        if (sig->type == SignalType::COUNTER) {
+          state.counter_index = i;
+          state.counter_size = sig->b2;
         }
       }
 
@@ -225,108 +424,140 @@ class CANParser {
               && sig->type == SignalType::DEFAULT) {
             state.parse_sigs.push_back(*sig);
             state.vals.push_back(sigop.default_value);
+            state.sig_index.push_back(i);
             break;
           }
         }
 
       }
 
-      message_states[state.address] = state;
+      for (const auto& sig : state.parse_sigs) {
+        if (sig.is_little_endian) {
+          state.has_le = true;
+        } else {
+          state.has_be = true;
+        }
+        if (checksum_functions[sig.type]) {
+          state.has_be = true;
+        }
+      }
+
+      if (lookup(state.address)) {
+        fprintf(stderr, "CANParser: message 0x%X requested twice\n", op.address);
+        assert(false);
+      }
+
+      state.sig_base = num_sigs;
+      num_sigs += state.parse_sigs.size();
+
+      message_states.push_back(state);
+      if (state.address < ARRAYSIZE(std_index)) {
+        std_index[state.address] = message_states.size();
+      } else {
+        auto entry = std::make_pair(state.address, (uint16_t)message_states.size());
+        ext_index.insert(std::upper_bound(ext_index.begin(), ext_index.end(), entry), entry);
+      }
     }
+
+    dirty.resize((message_states.size() + 63) / 64);
+    deadlines.reserve(message_states.size());
   }
 
-  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
+  // rx is the logMonoTime of the event the frames came in, used for the arrival stats. 0 uses sec
+  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans, uint64_t rx = 0) {
       int msg_count = cans.size();
-      uint64_t p;
 
       DEBUG("got %d messages\n", msg_count);
 
       // parse the messages
       for (int i = 0; i < msg_count; i++) {
-        auto cmsg = cans[i];
-        if (cmsg.getSrc() != bus) {
-          // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
-          continue;
-        }
-        auto state_it = message_states.find(cmsg.getAddress());
-        if (state_it == message_states.end()) {
-          // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-          continue;
-        }
+        UpdateCan(sec, cans[i], rx);
+      }
+  }
 
-        if (cmsg.getDat().size() > 8) continue; //shouldnt ever happen
-        uint8_t dat[8] = {0};
-        memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
+  // returns the state of the message if the frame was parsed
+  MessageState* UpdateCan(uint64_t sec, const cereal::CanData::Reader& cmsg, uint64_t rx = 0) {
+    if (cmsg.getSrc() != bus) {
+      // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
+      return NULL;
+    }
+    MessageState* state = lookup(cmsg.getAddress());
+    if (!state) {
+      // DEBUG("skip %d: not specified\n", cmsg.getAddress());
+      return NULL;
+    }
 
-        // Assumes all signals in the message are of the same type (little or big endian)
-        // TODO: allow signals within the same message to have different endianess
-        auto& sig = message_states[cmsg.getAddress()].parse_sigs[0];
-        if (sig.is_little_endian) {
-            p = read_u64_le(dat);
-        } else {
-            p = read_u64_be(dat);
-        }
+    if (cmsg.getDat().size() > 8) return NULL; //shouldnt ever happen
+    uint8_t dat[8] = {0};
+    memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
+
+    if (stats_enabled) {
+      state->update_stats(rx ? rx : sec);
+    }
+
+    const uint64_t prev_seen = state->seen;
+    if (!state->parse(sec, cmsg.getBusTime(), dat)) {
+      return NULL;
+    }
 
-        DEBUG("  proc %X: %llx\n", cmsg.getAddress(), p);
+    const size_t idx = state - message_states.data();
+    dirty[idx / 64] |= 1ULL << (idx % 64);
 
-        state_it->second.parse(sec, cmsg.getBusTime(), p);
+    if (state->check_threshold > 0) {
+      // the threshold is 10 periods, count the periods in the gap that had no frame
+      const uint64_t period = state->check_threshold / 10;
+      if (prev_seen > 0 && sec > prev_seen) {
+        const uint64_t frames = (sec - prev_seen + period / 2) / period;
+        if (frames > 1) state->missed += frames - 1;
       }
-  }
 
-  void UpdateValid(uint64_t sec) {
-    can_valid = true;
-    for (const auto& kv : message_states) {
-      const auto& state = kv.second;
-      if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
-        if (state.seen > 0) {
-          DEBUG("%X TIMEOUT\n", state.address);
-        }
-        can_valid = false;
+      if (!state->valid) {
+        state->valid = true;
+        num_invalid--;
+        push_deadline(sec + state->check_threshold, idx);
       }
     }
+    return state;
   }
 
-  void update(uint64_t sec, bool wait) {
-    int err;
-
-    // recv from can
-    zmq_msg_t msg;
-    zmq_msg_init(&msg);
-
-    // multiple recv is fine
-    bool first = wait;
-    while (1) {
-      if (first) {
-        err = zmq_msg_recv(&msg, subscriber, 0);
-        first = false;
+  // only the messages whose deadline passed are looked at. the heap isn't touched when a
+  // message parses, so an expired entry is checked against seen and pushed back if it was
+  // refreshed. a checked message has one entry while it's valid and none while it isn't
+  void UpdateValid(uint64_t sec) {
+    while (!deadlines.empty() && deadlines.front().first < sec) {
+      std::pop_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
+      const uint16_t idx = deadlines.back().second;
+      deadlines.pop_back();
+
+      auto& state = message_states[idx];
+      const uint64_t deadline = state.seen + state.check_threshold;
+      if (deadline < sec) {
+        DEBUG("%X TIMEOUT\n", state.address);
+        state.valid = false;
+        state.timeouts++;
+        num_invalid++;
       } else {
-        err = zmq_msg_recv(&msg, subscriber, ZMQ_DONTWAIT);
+        push_deadline(deadline, idx);
       }
-      if (err < 0) break;
-
-      // format for board, make copy due to alignment issues, will be freed on out of scope
-      auto amsg = kj::heapArray<capnp::word>((zmq_msg_size(&msg) / sizeof(capnp::word)) + 1);
-      memcpy(amsg.begin(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-
-      // extract the messages
-      capnp::FlatArrayMessageReader cmsg(amsg);
-      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-
-      auto cans = event.getCan();
+    }
+    can_valid = num_invalid == 0;
+  }
 
-      UpdateCans(sec, cans);
+  void update(uint64_t sec, bool wait) {
+    // parsers owned by a MultiBusCANParser are fed by it
+    if (subscriber) {
+      subscriber->recv(wait, [&](uint64_t rx, const capnp::List<cereal::CanData>::Reader& cans) {
+        UpdateCans(sec, cans, rx);
+      });
     }
 
     UpdateValid(sec);
-
-    zmq_msg_close(&msg);
   }
 
   std::vector<SignalValue> query(uint64_t sec) {
     std::vector<SignalValue> ret;
 
-    for (const auto& kv : message_states) {
-      const auto& state = kv.second;
+    for (const auto& state : message_states) {
       if (sec != 0 && state.seen != sec) continue;
 
       for (int i=0; i<state.parse_sigs.size(); i++) {
@@ -343,31 +574,285 @@ class CANParser {
     return ret;
   }
 
+  // writes the signals of messages that parsed since the last call, without allocating.
+  // every signal of a message updates together, so dirty tracks one bit per message.
+  // messages that don't fit in out stay dirty for the next call
+  size_t query_changed(size_t out_size, SignalValue* out) {
+    size_t n = 0;
+    for (size_t w = 0; w < dirty.size(); w++) {
+      while (dirty[w]) {
+        const int bit = __builtin_ctzll(dirty[w]);
+        const auto& state = message_states[w * 64 + bit];
+        if (n + state.parse_sigs.size() > out_size) {
+          return n;
+        }
+
+        for (int i=0; i<state.parse_sigs.size(); i++) {
+          out[n++] = (SignalValue){
+            .address = state.address,
+            .ts = state.ts,
+            .name = state.parse_sigs[i].name,
+            .value = state.vals[i],
+          };
+        }
+        dirty[w] &= ~(1ULL << bit);
+      }
+    }
+    return n;
+  }
+
+  // fall back to the signal table interpreter, for comparing against the generated decoders
+  void DisableDecoders() {
+    for (auto& state : message_states) {
+      state.decode = NULL;
+    }
+  }
+
+  // calls f(state, i) for every tracked signal, i indexes state.parse_sigs
+  template <typename F>
+  void ForEachSignal(F f) const {
+    for (const auto& state : message_states) {
+      for (int i=0; i<state.parse_sigs.size(); i++) {
+        f(state, i);
+      }
+    }
+  }
+
+  // validity of every tracked message, as of the last UpdateValid
+  size_t query_status(size_t out_size, MessageStatus* out) const {
+    for (size_t i = 0; i < std::min(out_size, message_states.size()); i++) {
+      const auto& state = message_states[i];
+      out[i] = (MessageStatus){
+        .address = state.address,
+        .valid = state.valid,
+        .missed = state.missed,
+        .timeouts = state.timeouts,
+        .seen = state.seen,
+      };
+    }
+    return message_states.size();
+  }
+
+  // per message arrival statistics and failure counts. reset starts a new min/max interval window
+  size_t query_stats(bool reset, size_t out_size, CANStats* out) {
+    for (size_t i = 0; i < std::min(out_size, message_states.size()); i++) {
+      auto& state = message_states[i];
+      const bool have_interval = state.interval_max > 0;
+      out[i] = (CANStats){
+        .address = state.address,
+        .received = state.received,
+        .checksum_errors = state.checksum_errors,
+        .counter_errors = state.counter_errors,
+        .frequency = state.interval_avg > 0 ? 1e9 / state.interval_avg : 0,
+        .interval_min = have_interval ? state.interval_min * 1e-9 : 0,
+        .interval_max = state.interval_max * 1e-9,
+        .jitter = state.jitter_avg * 1e-9,
+      };
+      if (reset) {
+        state.reset_interval_range();
+      }
+    }
+    return message_states.size();
+  }
+
   bool can_valid = false;
+  bool stats_enabled = false;
+  size_t num_sigs = 0;
 
  private:
+  typedef std::pair<uint64_t, uint16_t> Deadline;  // (time the message goes invalid, index into message_states)
+
+  void push_deadline(uint64_t deadline, size_t idx) {
+    deadlines.push_back(std::make_pair(deadline, (uint16_t)idx));
+    std::push_heap(deadlines.begin(), deadlines.end(), std::greater<Deadline>());
+  }
+
+  // standard ids index straight into a table, extended ids are binary searched
+  MessageState* lookup(uint32_t address) {
+    if (address < ARRAYSIZE(std_index)) {
+      uint16_t i = std_index[address];
+      return i ? &message_states[i-1] : NULL;
+    }
+
+    auto it = std::lower_bound(ext_index.begin(), ext_index.end(), std::make_pair(address, (uint16_t)0));
+    if (it == ext_index.end() || it->first != address) {
+      return NULL;
+    }
+    return &message_states[it->second-1];
+  }
+
   const int bus;
-  // zmq vars
-  void *context = NULL;
-  void *subscriber = NULL;
+  std::unique_ptr<CANSubscriber> subscriber;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  std::vector<MessageState> message_states;
+
+  // index+1 into message_states, 0 if the address isn't tracked
+  uint16_t std_index[0x800] = {0};
+  std::vector<std::pair<uint32_t, uint16_t>> ext_index;
+
+  // bit per message_states entry, set when it parses
+  std::vector<uint64_t> dirty;
+
+  // min-heap of the valid checked messages
+  std::vector<Deadline> deadlines;
+  size_t num_invalid = 0;
+};
+
+// one subscription for several buses: every can event is read once and its frames
+// are dispatched to the parser tracking their bus
+class MultiBusCANParser {
+ public:
+  MultiBusCANParser(const std::vector<CANBusOptions> &options, bool sendcan, const std::string& tcp_addr)
+    : MultiBusCANParser(options) {
+    subscriber.reset(new CANSubscriber(sendcan, tcp_addr));
+  }
+
+  // offline parser, frames are fed through UpdateCans
+  explicit MultiBusCANParser(const std::vector<CANBusOptions> &options) {
+    memset(bus_index, -1, sizeof(bus_index));
+
+    parsers.reserve(options.size());
+    for (const auto& op : options) {
+      assert(op.bus >= 0 && op.bus < ARRAYSIZE(bus_index));
+      if (bus_index[op.bus] >= 0) {
+        fprintf(stderr, "MultiBusCANParser: bus %d requested twice\n", op.bus);
+        assert(false);
+      }
+
+      bus_index[op.bus] = parsers.size();
+      parsers.emplace_back(op.bus, std::string(op.dbc_name),
+                           (op.message_options ? std::vector<MessageParseOptions>(op.message_options, op.message_options+op.num_message_options)
+                            : std::vector<MessageParseOptions>{}),
+                           (op.signal_options ? std::vector<SignalParseOptions>(op.signal_options, op.signal_options+op.num_signal_options)
+                            : std::vector<SignalParseOptions>{}));
+    }
+  }
+
+  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans, uint64_t rx = 0) {
+    int msg_count = cans.size();
+    for (int i = 0; i < msg_count; i++) {
+      auto cmsg = cans[i];
+      int idx = bus_index[cmsg.getSrc()];
+      if (idx >= 0) {
+        parsers[idx].UpdateCan(sec, cmsg, rx);
+      }
+    }
+  }
+
+  void update(uint64_t sec, bool wait) {
+    if (subscriber) {
+      subscriber->recv(wait, [&](uint64_t rx, const capnp::List<cereal::CanData>::Reader& cans) {
+        UpdateCans(sec, cans, rx);
+      });
+    }
+
+    for (auto& cp : parsers) {
+      cp.UpdateValid(sec);
+    }
+  }
+
+  // in options order
+  CANParser* bus_parser(size_t i) {
+    return i < parsers.size() ? &parsers[i] : NULL;
+  }
+
+ private:
+  std::unique_ptr<CANSubscriber> subscriber;
+  std::vector<CANParser> parsers;
+
+  // src -> index into parsers, -1 if the bus isn't parsed
+  int8_t bus_index[256];
+};
+
+// decodes a whole serialized log into one time series per signal, no zmq involved
+class CANLogParser {
+ public:
+  CANLogParser(int abus, const std::string& dbc_name,
+               const std::vector<MessageParseOptions> &options,
+               const std::vector<SignalParseOptions> &sigoptions,
+               bool asendcan)
+    : parser(abus, dbc_name, options, sigoptions), sendcan(asendcan), series(parser.num_sigs) {
+    parser.ForEachSignal([&](const MessageState& state, int i) {
+      auto& s = series[state.sig_base + i];
+      s.address = state.address;
+      s.name = state.parse_sigs[i].name;
+    });
+  }
+
+  void Parse(kj::ArrayPtr<const capnp::word> words) {
+    while (words.size() > 0) {
+      // read in place, the log outlives the reader
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+
+      if (sendcan ? event.isSendcan() : event.isCan()) {
+        uint64_t sec = event.getLogMonoTime();
+        auto cans = sendcan ? event.getSendcan() : event.getCan();
+
+        int msg_count = cans.size();
+        for (int i = 0; i < msg_count; i++) {
+          const MessageState* state = parser.UpdateCan(sec, cans[i]);
+          if (!state) continue;
+
+          for (int j = 0; j < state->vals.size(); j++) {
+            auto& s = series[state->sig_base + j];
+            s.ts.push_back(sec);
+            s.vals.push_back(state->vals[j]);
+          }
+        }
+      }
+
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+    }
+  }
+
+  size_t query(size_t out_size, SignalSeries* out) const {
+    for (size_t i = 0; i < std::min(out_size, series.size()); i++) {
+      const auto& s = series[i];
+      out[i] = (SignalSeries){
+        .address = s.address,
+        .name = s.name,
+        .size = s.ts.size(),
+        .ts = s.ts.data(),
+        .vals = s.vals.data(),
+      };
+    }
+    return series.size();
+  }
+
+ private:
+  struct Series {
+    uint32_t address;
+    const char* name;
+    std::vector<uint64_t> ts;
+    std::vector<double> vals;
+  };
+
+  CANParser parser;
+  const bool sendcan;
+  std::vector<Series> series;
 };
 
 }
 
 extern "C" {
 
+// a NULL tcp_addr makes an offline parser, fed with can_update_event instead of a subscription
 void* can_init(int bus, const char* dbc_name,
                size_t num_message_options, const MessageParseOptions* message_options,
                size_t num_signal_options, const SignalParseOptions* signal_options,
                bool sendcan, const char* tcp_addr) {
-  CANParser* ret = new CANParser(bus, std::string(dbc_name),
-                                 (message_options ? std::vector<MessageParseOptions>(message_options, message_options+num_message_options)
-                                  : std::vector<MessageParseOptions>{}),
-                                 (signal_options ? std::vector<SignalParseOptions>(signal_options, signal_options+num_signal_options)
-                                  : std::vector<SignalParseOptions>{}), sendcan, std::string(tcp_addr));
+  auto options = message_options ? std::vector<MessageParseOptions>(message_options, message_options+num_message_options)
+                                 : std::vector<MessageParseOptions>{};
+  auto sigoptions = signal_options ? std::vector<SignalParseOptions>(signal_options, signal_options+num_signal_options)
+                                   : std::vector<SignalParseOptions>{};
+  CANParser* ret;
+  if (tcp_addr) {
+    ret = new CANParser(bus, std::string(dbc_name), options, sigoptions, sendcan, std::string(tcp_addr));
+  } else {
+    ret = new CANParser(bus, std::string(dbc_name), options, sigoptions);
+  }
   return (void*)ret;
 }
 
@@ -376,6 +861,29 @@ void can_update(void* can, uint64_t sec, bool wait) {
   cp->update(sec, wait);
 }
 
+// parses the frames of one serialized can or sendcan event and refreshes validity, like can_update
+// does for every event it receives. data is read in place when it's word aligned
+void can_update_event(void* can, uint64_t sec, const void* data, size_t size) {
+  CANParser* cp = (CANParser*)can;
+
+  auto words = kj::arrayPtr((const capnp::word*)data, size/sizeof(capnp::word));
+  kj::Array<capnp::word> amsg;
+  if (((uintptr_t)data % sizeof(capnp::word)) != 0) {
+    amsg = kj::heapArray<capnp::word>(words.size());
+    memcpy(amsg.begin(), data, words.size() * sizeof(capnp::word));
+    words = amsg.asPtr();
+  }
+
+  capnp::FlatArrayMessageReader cmsg(words);
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+  if (event.isCan()) {
+    cp->UpdateCans(sec, event.getCan(), event.getLogMonoTime());
+  } else if (event.isSendcan()) {
+    cp->UpdateCans(sec, event.getSendcan(), event.getLogMonoTime());
+  }
+  cp->UpdateValid(sec);
+}
+
 size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values_size, SignalValue* out_values) {
   CANParser* cp = (CANParser*)can;
 
@@ -390,98 +898,109 @@ size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values
   return values.size();
 };
 
-}
+size_t can_query_changed(void* can, bool *out_can_valid, size_t out_values_size, SignalValue* out_values) {
+  CANParser* cp = (CANParser*)can;
 
-#ifdef TEST
-
-int main(int argc, char** argv) {
-  CANParser cp(0, "honda_civic_touring_2016_can",
-    std::vector<MessageParseOptions>{
-      // address, check_frequency
-      {0x14a, 100},
-      {0x158, 100},
-      {0x17c, 100},
-      {0x191, 100},
-      {0x1a4, 50},
-      {0x326, 10},
-      {0x1b0, 50},
-      {0x1d0, 50},
-      {0x305, 10},
-      {0x324, 10},
-      {0x405, 3},
-      {0x18f, 0},
-      {0x130, 0},
-      {0x296, 0},
-      {0x30c, 0},
-    },
-    std::vector<SignalParseOptions>{
-      //  sig_name, sig_address, default
-      {0x158, "XMISSION_SPEED", 0},
-      {0x1d0, "WHEEL_SPEED_FL", 0},
-      {0x1d0, "WHEEL_SPEED_FR", 0},
-      {0x1d0, "WHEEL_SPEED_RL", 0},
-      {0x14a, "STEER_ANGLE", 0},
-      {0x18f, "STEER_TORQUE_SENSOR", 0},
-      {0x191, "GEAR", 0},
-      {0x1b0, "WHEELS_MOVING", 1},
-      {0x405, "DOOR_OPEN_FL", 1},
-      {0x405, "DOOR_OPEN_FR", 1},
-      {0x405, "DOOR_OPEN_RL", 1},
-      {0x405, "DOOR_OPEN_RR", 1},
-      {0x324, "CRUISE_SPEED_PCM", 0},
-      {0x305, "SEATBELT_DRIVER_LAMP", 1},
-      {0x305, "SEATBELT_DRIVER_LATCHED", 0},
-      {0x17c, "BRAKE_PRESSED", 0},
-      {0x130, "CAR_GAS", 0},
-      {0x296, "CRUISE_BUTTONS", 0},
-      {0x1a4, "ESP_DISABLED", 1},
-      {0x30c, "HUD_LEAD", 0},
-      {0x1a4, "USER_BRAKE", 0},
-      {0x18f, "STEER_STATUS", 5},
-      {0x1d0, "WHEEL_SPEED_RR", 0},
-      {0x1b0, "BRAKE_ERROR_1", 1},
-      {0x1b0, "BRAKE_ERROR_2", 1},
-      {0x191, "GEAR_SHIFTER", 0},
-      {0x326, "MAIN_ON", 0},
-      {0x17c, "ACC_STATUS", 0},
-      {0x17c, "PEDAL_GAS", 0},
-      {0x296, "CRUISE_SETTING", 0},
-      {0x326, "LEFT_BLINKER", 0},
-      {0x326, "RIGHT_BLINKER", 0},
-      {0x324, "COUNTER", 0},
-      {0x17c, "ENGINE_RPM", 0},
-    });
+  if (out_can_valid) {
+    *out_can_valid = cp->can_valid;
+  }
 
+  return cp->query_changed(out_values ? out_values_size : 0, out_values);
+}
 
+// per message validity and missed frame counters, in message options order.
+// returns the number of tracked messages, at most out_size are written
+size_t can_query_status(void* can, size_t out_size, MessageStatus* out) {
+  CANParser* cp = (CANParser*)can;
+  return cp->query_status(out ? out_size : 0, out);
+}
 
-  const std::string log_fn = "dats.bin";
+// fall back to the signal table interpreter, for comparing against the generated decoders
+void can_disable_decoders(void* can) {
+  CANParser* cp = (CANParser*)can;
+  cp->DisableDecoders();
+}
 
-  int log_fd = open(log_fn.c_str(), O_RDONLY, 0);
-  assert(log_fd >= 0);
+void can_stats_enable(void* can, bool enable) {
+  CANParser* cp = (CANParser*)can;
+  cp->stats_enabled = enable;
+}
 
-  off_t log_size = lseek(log_fd, 0, SEEK_END);
-  lseek(log_fd, 0, SEEK_SET);
+size_t can_stats(void* can, bool reset, size_t out_size, CANStats* out) {
+  CANParser* cp = (CANParser*)can;
+  return cp->query_stats(reset, out ? out_size : 0, out);
+}
 
-  void* log_data = mmap(NULL, log_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
-  assert(log_data);
+void* can_init_multi(size_t num_buses, const CANBusOptions* buses, bool sendcan, const char* tcp_addr) {
+  MultiBusCANParser* ret = new MultiBusCANParser(std::vector<CANBusOptions>(buses, buses+num_buses),
+                                                 sendcan, std::string(tcp_addr));
+  return (void*)ret;
+}
 
-  auto words = kj::arrayPtr((const capnp::word*)log_data, log_size/sizeof(capnp::word));
-  while (words.size() > 0) {
-    capnp::FlatArrayMessageReader reader(words);
+void can_update_multi(void* can, uint64_t sec, bool wait) {
+  MultiBusCANParser* cp = (MultiBusCANParser*)can;
+  cp->update(sec, wait);
+}
 
-    auto evt = reader.getRoot<cereal::Event>();
-    auto cans = evt.getCan();
+// the parser for buses[bus_idx], query it with can_query/can_query_changed.
+// it is updated by can_update_multi, can_update on it only refreshes validity
+void* can_multi_get_bus(void* can, size_t bus_idx) {
+  MultiBusCANParser* cp = (MultiBusCANParser*)can;
+  return (void*)cp->bus_parser(bus_idx);
+}
 
-    cp.UpdateCans(0, cans);
+void* can_parse_log(int bus, const char* dbc_name,
+                    size_t num_message_options, const MessageParseOptions* message_options,
+                    size_t num_signal_options, const SignalParseOptions* signal_options,
+                    bool sendcan, const void* log_data, size_t log_size) {
+  CANLogParser* ret = new CANLogParser(bus, std::string(dbc_name),
+                                       (message_options ? std::vector<MessageParseOptions>(message_options, message_options+num_message_options)
+                                        : std::vector<MessageParseOptions>{}),
+                                       (signal_options ? std::vector<SignalParseOptions>(signal_options, signal_options+num_signal_options)
+                                        : std::vector<SignalParseOptions>{}), sendcan);
 
-    words = kj::arrayPtr(reader.getEnd(), words.end());
+  auto words = kj::arrayPtr((const capnp::word*)log_data, log_size/sizeof(capnp::word));
+  if (((uintptr_t)log_data % sizeof(capnp::word)) == 0) {
+    ret->Parse(words);
+  } else {
+    // mmapped logs are always aligned, only copy for odd callers
+    auto amsg = kj::heapArray<capnp::word>(words.size());
+    memcpy(amsg.begin(), log_data, words.size() * sizeof(capnp::word));
+    ret->Parse(amsg);
   }
+  return (void*)ret;
+}
 
-  munmap(log_data, log_size);
+size_t can_parse_log_query(void* log, size_t out_series_size, SignalSeries* out_series) {
+  CANLogParser* lp = (CANLogParser*)log;
+  return lp->query(out_series ? out_series_size : 0, out_series);
+}
 
-  close(log_fd);
+void can_parse_log_free(void* log) {
+  delete (CANLogParser*)log;
+}
 
-  return 0;
+// branch free so the loops vectorize, frames are independent
+size_t honda_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                            const uint8_t* size, bool* valid) {
+  size_t ret = 0;
+  for (size_t i=0; i<n; i++) {
+    unsigned int tmp = (dat[i] >> ((8-size[i])*8)) & 0xF;
+    valid[i] = honda_checksum(address[i], dat[i], size[i]) == tmp;
+    ret += valid[i];
+  }
+  return ret;
 }
 
-#endif
+size_t toyota_checksum_batch(size_t n, const uint32_t* address, const uint64_t* dat,
+                             const uint8_t* size, bool* valid) {
+  size_t ret = 0;
+  for (size_t i=0; i<n; i++) {
+    unsigned int tmp = (dat[i] >> ((8-size[i])*8)) & 0xFF;
+    valid[i] = toyota_checksum(address[i], dat[i], size[i]) == tmp;
+    ret += valid[i];
+  }
+  return ret;
+}
+
+}
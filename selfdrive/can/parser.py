@@ -1,11 +1,20 @@
 import time
 from collections import defaultdict
 import numbers
+import numpy as np
 
 from selfdrive.can.libdbc_py import libdbc, ffi
 
 class CANParser(object):
   def __init__(self, dbc_name, signals, checks=[], bus=0, sendcan=False, tcp_addr="127.0.0.1"):
+    self._setup(dbc_name, signals, checks)
+    self.bus = bus
+
+    can = libdbc.can_init(bus, dbc_name, len(self.message_options_c), self.message_options_c,
+                          len(self.signal_options_c), self.signal_options_c, sendcan, tcp_addr)
+    self._attach(can)
+
+  def _setup(self, dbc_name, signals, checks):
     self.can_valid = True
     self.vl = defaultdict(dict)
     self.ts = defaultdict(dict)
@@ -38,37 +47,44 @@ class CANParser(object):
         c = (self.msg_name_to_addres[c[0]], c[1])
         checks[i] = c
 
-    sig_names = dict((name, ffi.new("char[]", name)) for name, _, _ in signals)
+    self.sig_names = dict((name, ffi.new("char[]", name)) for name, _, _ in signals)
 
-    signal_options_c = ffi.new("SignalParseOptions[]", [
+    self.signal_options_c = ffi.new("SignalParseOptions[]", [
       {
         'address': sig_address,
-        'name': sig_names[sig_name],
+        'name': self.sig_names[sig_name],
         'default_value': sig_default,
       } for sig_name, sig_address, sig_default in signals])
 
     message_options = dict((address, 0) for _, address, _ in signals)
     message_options.update(dict(checks))
 
-    message_options_c = ffi.new("MessageParseOptions[]", [
+    self.message_options_c = ffi.new("MessageParseOptions[]", [
       {
         'address': msg_address,
         'check_frequency': freq,
       } for msg_address, freq in message_options.iteritems()])
 
-    self.can = libdbc.can_init(bus, dbc_name, len(message_options_c), message_options_c,
-                               len(signal_options_c), signal_options_c, sendcan, tcp_addr)
+  def _attach(self, can):
+    self.can = can
 
     self.p_can_valid = ffi.new("bool*")
 
     value_count = libdbc.can_query(self.can, 0, self.p_can_valid, 0, ffi.NULL)
     self.can_values = ffi.new("SignalValue[%d]" % value_count)
+    status_count = libdbc.can_query_status(self.can, 0, ffi.NULL)
+    self.can_status = ffi.new("MessageStatus[%d]" % status_count)
+    self.can_stats = None
     self.update_vl(0)
     # print "==="
 
   def update_vl(self, sec):
-
-    can_values_len = libdbc.can_query(self.can, sec, self.p_can_valid, len(self.can_values), self.can_values)
+    if sec == 0:
+      # everything, including defaults for messages that haven't been seen
+      can_values_len = libdbc.can_query(self.can, sec, self.p_can_valid, len(self.can_values), self.can_values)
+    else:
+      # only the signals of messages that parsed since the last query
+      can_values_len = libdbc.can_query_changed(self.can, self.p_can_valid, len(self.can_values), self.can_values)
     assert can_values_len <= len(self.can_values)
 
     self.can_valid = self.p_can_valid[0]
@@ -93,6 +109,131 @@ class CANParser(object):
     libdbc.can_update(self.can, sec, wait)
     return self.update_vl(sec)
 
+  def query_status(self):
+    """{address: (valid, missed, timeouts)} for every tracked message, as of the last update.
+    lets carstate tell which message went stale instead of only seeing can_valid drop"""
+    n = libdbc.can_query_status(self.can, len(self.can_status), self.can_status)
+    ret = {}
+    for i in xrange(n):
+      st = self.can_status[i]
+      ret[st.address] = (st.valid, st.missed, st.timeouts)
+    return ret
+
+  def enable_stats(self):
+    """keep per address arrival statistics, read them with stats()"""
+    libdbc.can_stats_enable(self.can, True)
+    self.can_stats = ffi.new("CANStats[%d]" % len(self.can_status))
+
+  def stats(self):
+    """a dict per tracked message with the fields of a log CanStats. min and max intervals
+    restart on every call"""
+    if self.can_stats is None:
+      return []
+    n = libdbc.can_stats(self.can, True, len(self.can_stats), self.can_stats)
+    libdbc.can_query_status(self.can, len(self.can_status), self.can_status)
+
+    ret = []
+    for i in xrange(n):
+      cs, st = self.can_stats[i], self.can_status[i]
+      ret.append({
+        'address': cs.address,
+        'src': self.bus,
+        'received': cs.received,
+        'valid': st.valid,
+        'missed': st.missed,
+        'timeouts': st.timeouts,
+        'checksumErrors': cs.checksum_errors,
+        'counterErrors': cs.counter_errors,
+        'frequency': cs.frequency,
+        'intervalMin': cs.interval_min,
+        'intervalMax': cs.interval_max,
+        'jitter': cs.jitter,
+      })
+    return ret
+
+class MultiCANParser(object):
+  """Several buses behind one can subscription, each event is deserialized once.
+
+  buses is a list of (dbc_name, signals, checks, bus), self.parsers has a CANParser
+  for each entry that is updated by MultiCANParser.update."""
+  def __init__(self, buses, sendcan=False, tcp_addr="127.0.0.1"):
+    self.parsers = []
+    for dbc_name, signals, checks, bus in buses:
+      cp = CANParser.__new__(CANParser)
+      cp._setup(dbc_name, signals, checks)
+      cp.dbc_name_c = ffi.new("char[]", dbc_name)
+      cp.bus = bus
+      self.parsers.append(cp)
+
+    bus_options_c = ffi.new("CANBusOptions[]", [
+      {
+        'bus': cp.bus,
+        'dbc_name': cp.dbc_name_c,
+        'num_message_options': len(cp.message_options_c),
+        'message_options': cp.message_options_c,
+        'num_signal_options': len(cp.signal_options_c),
+        'signal_options': cp.signal_options_c,
+      } for cp in self.parsers])
+
+    self.can = libdbc.can_init_multi(len(bus_options_c), bus_options_c, sendcan, tcp_addr)
+    for i, cp in enumerate(self.parsers):
+      cp._attach(libdbc.can_multi_get_bus(self.can, i))
+
+  def update(self, sec, wait):
+    libdbc.can_update_multi(self.can, sec, wait)
+    return [cp.update_vl(sec) for cp in self.parsers]
+
+def parse_log(dbc_name, signals, dat, bus=0, sendcan=False):
+  """Decodes every can event in a raw log in one native pass.
+
+  signals is a list of (sig_name, sig_address, default) like CANParser, dat is the
+  serialized log (e.g. an mmap). Returns {address: {sig_name: (ts, vals)}}, also keyed
+  by message name, where ts are the logMonoTimes of the frames that parsed."""
+  dbc = libdbc.dbc_lookup(dbc_name)
+  msg_name_to_address = {}
+  address_to_msg_name = {}
+  for i in range(dbc[0].num_msgs):
+    msg = dbc[0].msgs[i]
+    msg_name_to_address[ffi.string(msg.name)] = msg.address
+    address_to_msg_name[msg.address] = ffi.string(msg.name)
+
+  signals = [(name, address if isinstance(address, numbers.Number) else msg_name_to_address[address], default)
+             for name, address, default in signals]
+  sig_names = dict((name, ffi.new("char[]", name)) for name, _, _ in signals)
+
+  signal_options_c = ffi.new("SignalParseOptions[]", [
+    {
+      'address': sig_address,
+      'name': sig_names[sig_name],
+      'default_value': sig_default,
+    } for sig_name, sig_address, sig_default in signals])
+
+  message_options_c = ffi.new("MessageParseOptions[]", [
+    {
+      'address': msg_address,
+      'check_frequency': 0,
+    } for msg_address in set(address for _, address, _ in signals)])
+
+  log = libdbc.can_parse_log(bus, dbc_name, len(message_options_c), message_options_c,
+                             len(signal_options_c), signal_options_c, sendcan,
+                             ffi.from_buffer(dat), len(dat))
+  try:
+    series_count = libdbc.can_parse_log_query(log, 0, ffi.NULL)
+    series = ffi.new("SignalSeries[%d]" % series_count)
+    libdbc.can_parse_log_query(log, series_count, series)
+
+    ret = defaultdict(dict)
+    for s in series:
+      name = ffi.string(s.name)
+      ts = np.frombuffer(ffi.buffer(s.ts, s.size * 8), dtype=np.uint64).copy()
+      vals = np.frombuffer(ffi.buffer(s.vals, s.size * 8), dtype=np.float64).copy()
+      ret[s.address][name] = (ts, vals)
+      ret[address_to_msg_name[s.address]][name] = ret[s.address][name]
+  finally:
+    libdbc.can_parse_log_free(log)
+
+  return ret
+
 class CANDefine(object):
   def __init__(self, dbc_name):
     self.dv = defaultdict(dict)
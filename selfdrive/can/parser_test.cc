@@ -0,0 +1,377 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+
+#include <string>
+#include <vector>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common.h"
+
+// checks of the parser through the same c api carstate uses: offline parsers made with a NULL
+// tcp_addr are fed serialized events with can_update_event and read back with can_query and
+// can_query_status. a failed check aborts, run by make test after roundtrip_test
+
+extern "C" {
+  void* can_init(int bus, const char* dbc_name,
+                 size_t num_message_options, const MessageParseOptions* message_options,
+                 size_t num_signal_options, const SignalParseOptions* signal_options,
+                 bool sendcan, const char* tcp_addr);
+  void can_update(void* can, uint64_t sec, bool wait);
+  void can_update_event(void* can, uint64_t sec, const void* data, size_t size);
+  size_t can_query(void* can, uint64_t sec, bool *out_can_valid, size_t out_values_size, SignalValue* out_values);
+  size_t can_query_status(void* can, size_t out_size, MessageStatus* out);
+  void can_stats_enable(void* can, bool enable);
+  size_t can_stats(void* can, bool reset, size_t out_size, CANStats* out);
+
+  void* canpack_init(const char* dbc_name);
+  uint64_t canpack_pack(void* inst, uint32_t address, size_t num_vals, const SignalPackValue *vals, int counter, bool checksum);
+  void* canpack_prepare(void* inst, uint32_t address, size_t num_names, const char** names);
+  uint64_t canpack_pack_prepared(void* plan, const double* values, int counter);
+  size_t canpack_pack_sendcan(void* inst, size_t num_msgs, const CANPackMessage* msgs,
+                              uint8_t* out, size_t out_size);
+}
+
+namespace {
+
+// a can event with one frame, logMonoTime is what the parser takes as the receive time
+kj::Array<capnp::word> can_event(uint64_t mono_time, uint32_t address, const uint8_t* dat, size_t len) {
+  capnp::MallocMessageBuilder msg;
+  cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(mono_time);
+  auto cans = event.initCan(1);
+  cans[0].setAddress(address);
+  cans[0].setSrc(0);
+  cans[0].setDat(kj::arrayPtr(dat, len));
+  return capnp::messageToFlatArray(msg);
+}
+
+void update(void* can, uint64_t sec, const kj::Array<capnp::word>& event) {
+  can_update_event(can, sec, event.begin(), event.size() * sizeof(capnp::word));
+}
+
+// without a subscription can_update only refreshes validity
+bool valid_at(void* can, uint64_t sec) {
+  can_update(can, sec, false);
+  bool valid;
+  can_query(can, 0, &valid, 0, NULL);
+  return valid;
+}
+
+std::vector<SignalValue> query(void* can, uint64_t sec) {
+  std::vector<SignalValue> values(can_query(can, sec, NULL, 0, NULL));
+  can_query(can, sec, NULL, values.size(), values.data());
+  return values;
+}
+
+// synthetic message with both byte orders, decoded by hand
+const Signal mixed_sigs[] = {
+  {.name = "LE_U16", .b1 = 0, .b2 = 16, .bo = 48, .is_signed = false,
+   .factor = 1, .offset = 0, .is_little_endian = true, .type = SignalType::DEFAULT},
+  {.name = "BE_U16", .b1 = 32, .b2 = 16, .bo = 16, .is_signed = false,
+   .factor = 0.5, .offset = 0, .is_little_endian = false, .type = SignalType::DEFAULT},
+  {.name = "LE_S8", .b1 = 48, .b2 = 8, .bo = 8, .is_signed = true,
+   .factor = 1, .offset = -1, .is_little_endian = true, .type = SignalType::DEFAULT},
+};
+
+const Msg mixed_msgs[] = {
+  {.name = "MIXED", .address = 0x123, .size = 8, .num_sigs = ARRAYSIZE(mixed_sigs), .sigs = mixed_sigs, .decode = NULL},
+};
+
+const DBC mixed_dbc = {
+  .name = "test_mixed_endian",
+  .num_msgs = ARRAYSIZE(mixed_msgs),
+  .msgs = mixed_msgs,
+  .vals = NULL,
+  .num_vals = 0,
+};
+
+void test_mixed_endian() {
+  const MessageParseOptions options[] = {{0x123, 0}};
+  const SignalParseOptions sigoptions[] = {
+    {0x123, "LE_U16", 0},
+    {0x123, "BE_U16", 0},
+    {0x123, "LE_S8", 0},
+  };
+  void* can = can_init(0, "test_mixed_endian", ARRAYSIZE(options), options,
+                       ARRAYSIZE(sigoptions), sigoptions, false, NULL);
+
+  const uint8_t dat[8] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0};
+  update(can, 1, can_event(1, 0x123, dat, sizeof(dat)));
+
+  const std::vector<SignalValue> values = query(can, 1);
+  assert(values.size() == 3);
+  for (const auto& v : values) {
+    if (strcmp(v.name, "LE_U16") == 0) {
+      assert(v.value == 0x3412);
+    } else if (strcmp(v.name, "BE_U16") == 0) {
+      assert(v.value == 0x9ABC * 0.5);
+    } else {
+      assert(v.value == (int8_t)0xDE - 1);
+    }
+  }
+  printf("mixed endian ok\n");
+}
+
+void test_timeouts() {
+  // 100 Hz, times out after 100ms without a frame
+  const MessageParseOptions options[] = {{0x123, 100}};
+  const SignalParseOptions sigoptions[] = {{0x123, "LE_U16", 0}};
+  void* can = can_init(0, "test_mixed_endian", ARRAYSIZE(options), options,
+                       ARRAYSIZE(sigoptions), sigoptions, false, NULL);
+
+  const uint8_t dat[8] = {0};
+  const uint64_t t0 = 1000000000ULL, ms = 1000000ULL;
+  MessageStatus st;
+
+  // not seen yet
+  assert(!valid_at(can, t0));
+
+  for (uint64_t t : {t0, t0 + 10*ms, t0 + 40*ms}) {
+    update(can, t, can_event(t, 0x123, dat, sizeof(dat)));
+  }
+  assert(valid_at(can, t0 + 140*ms));
+  assert(can_query_status(can, 1, &st) == 1);
+  assert(st.valid && st.missed == 2 && st.timeouts == 0);
+
+  assert(!valid_at(can, t0 + 140*ms + 1));
+  can_query_status(can, 1, &st);
+  assert(!st.valid && st.timeouts == 1);
+
+  update(can, t0 + 200*ms, can_event(t0 + 200*ms, 0x123, dat, sizeof(dat)));
+  assert(valid_at(can, t0 + 200*ms));
+  can_query_status(can, 1, &st);
+  assert(st.valid && st.missed == 2 + 15 && st.timeouts == 1 && st.seen == t0 + 200*ms);
+  printf("timeouts ok\n");
+}
+
+void test_stats() {
+  const MessageParseOptions options[] = {{0x123, 100}};
+  const SignalParseOptions sigoptions[] = {{0x123, "LE_U16", 0}};
+  void* can = can_init(0, "test_mixed_endian", ARRAYSIZE(options), options,
+                       ARRAYSIZE(sigoptions), sigoptions, false, NULL);
+  can_stats_enable(can, true);
+
+  // update time is the same, the event times are what's measured
+  const uint8_t dat[8] = {0};
+  const uint64_t ms = 1000000ULL;
+  for (uint64_t t : {1000*ms, 1010*ms, 1020*ms, 1035*ms}) {
+    update(can, 1040*ms, can_event(t, 0x123, dat, sizeof(dat)));
+  }
+
+  CANStats st;
+  assert(can_stats(can, true, 1, &st) == 1);
+  assert(st.received == 4 && st.checksum_errors == 0 && st.counter_errors == 0);
+  assert(fabs(st.interval_min - 0.010) < 1e-9 && fabs(st.interval_max - 0.015) < 1e-9);
+  assert(st.frequency > 90 && st.frequency < 100 && st.jitter > 0);
+
+  // reset only restarts the min/max window
+  can_stats(can, false, 1, &st);
+  assert(st.received == 4 && st.interval_min == 0 && st.interval_max == 0);
+  printf("stats ok\n");
+}
+
+// the loop versions the checksums used to be, kept to check the bit tricks against
+unsigned int honda_checksum_ref(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 4; // remove checksum
+
+  int s = 0;
+  while (address) { s += (address & 0xF); address >>= 4; }
+  while (d) { s += (d & 0xF); d >>= 4; }
+  s = 8-s;
+  s &= 0xF;
+
+  return s;
+}
+
+unsigned int toyota_checksum_ref(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  unsigned int s = l;
+  while (address) { s += address & 0xff; address >>= 8; }
+  while (d) { s += d & 0xff; d >>= 8; }
+
+  return s & 0xFF;
+}
+
+// random 11 and 29 bit addresses plus all ones payloads, every message size
+void test_checksums() {
+  const size_t n = 1 << 20;
+  std::vector<uint32_t> address(n);
+  std::vector<uint64_t> dat(n);
+  std::vector<uint8_t> size(n);
+  std::vector<uint8_t> valid(n);
+
+  srand(1);
+  size_t expected_honda = 0, expected_toyota = 0;
+  for (size_t i=0; i<n; i++) {
+    address[i] = (i % 2) ? (rand() & 0x7FF) : (rand() & 0x1FFFFFFF);
+    dat[i] = (i % 64 == 0) ? ~0ULL : ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+    size[i] = 1 + (i % 8);
+
+    assert(honda_checksum(address[i], dat[i], size[i]) == honda_checksum_ref(address[i], dat[i], size[i]));
+    assert(toyota_checksum(address[i], dat[i], size[i]) == toyota_checksum_ref(address[i], dat[i], size[i]));
+    expected_honda += ((dat[i] >> ((8-size[i])*8)) & 0xF) == honda_checksum_ref(address[i], dat[i], size[i]);
+    expected_toyota += ((dat[i] >> ((8-size[i])*8)) & 0xFF) == toyota_checksum_ref(address[i], dat[i], size[i]);
+  }
+
+  bool* out = (bool*)valid.data();
+  assert(honda_checksum_batch(n, address.data(), dat.data(), size.data(), out) == expected_honda);
+  assert(toyota_checksum_batch(n, address.data(), dat.data(), size.data(), out) == expected_toyota);
+  printf("checksums ok\n");
+}
+
+// "1234567" followed by the checksum byte, the CRC-8 SAE J1850 check value
+void test_checksum_functions() {
+  uint64_t be = 0x31323334353637ULL << 8;
+  assert(crc8_j1850_checksum(0, be, 8) == 0x4D);
+
+  // the checksum byte itself and the padding are ignored
+  assert(crc8_j1850_checksum(0, be | 0xFF, 8) == 0x4D);
+  assert(crc8_j1850_checksum(0, be, 7) == crc8_j1850_checksum(0, (0x313233343536ULL << 16) | 0xFFFF, 7));
+
+  // frames from a pacifica: a cancel press on WHEEL_BUTTONS and an LKAS_INDICATOR_2
+  assert(crc8_j1850_checksum(0x23b, 0x012075ULL << 40, 3) == 0x75);
+  assert(crc8_j1850_checksum(0x292, 0x1400000020CCULL << 16, 6) == 0xCC);
+  printf("checksum functions ok\n");
+}
+
+
+// a steering and a brake command like controlsd sends them, prepared plans have to pack the
+// same frames as the name lookups, counters and checksums included
+void test_pack_prepared() {
+  void* packer = canpack_init("honda_civic_touring_2016_can_generated");
+
+  const char* steer_names[] = {"STEER_TORQUE", "STEER_TORQUE_REQUEST"};
+  const char* brake_names[] = {"COMPUTER_BRAKE", "BRAKE_PUMP_REQUEST", "CRUISE_OVERRIDE", "CRUISE_FAULT_CMD",
+                               "CRUISE_CANCEL_CMD", "COMPUTER_BRAKE_REQUEST", "SET_ME_0X80", "BRAKE_LIGHTS"};
+  void* steer_plan = canpack_prepare(packer, 0xe4, ARRAYSIZE(steer_names), steer_names);
+  void* brake_plan = canpack_prepare(packer, 0x1fa, ARRAYSIZE(brake_names), brake_names);
+  assert(steer_plan && brake_plan);
+
+  for (int i=0; i<1000; i++) {
+    double steer_vals[ARRAYSIZE(steer_names)] = {(double)((i * 37 % 7680) - 3840), (double)(i & 1)};
+    double brake_vals[ARRAYSIZE(brake_names)];
+    SignalPackValue steer_pack[ARRAYSIZE(steer_names)], brake_pack[ARRAYSIZE(brake_names)];
+    for (int j=0; j<ARRAYSIZE(steer_names); j++) {
+      steer_pack[j] = {steer_names[j], steer_vals[j]};
+    }
+    for (int j=0; j<ARRAYSIZE(brake_names); j++) {
+      brake_vals[j] = (i >> j) & 1;
+      brake_pack[j] = {brake_names[j], brake_vals[j]};
+    }
+
+    assert(canpack_pack_prepared(steer_plan, steer_vals, i & 3)
+           == canpack_pack(packer, 0xe4, ARRAYSIZE(steer_names), steer_pack, i & 3, true));
+    assert(canpack_pack_prepared(brake_plan, brake_vals, i & 3)
+           == canpack_pack(packer, 0x1fa, ARRAYSIZE(brake_names), brake_pack, i & 3, true));
+  }
+  printf("pack prepared ok\n");
+}
+
+// a steering and a brake command serialized as one sendcan event, the frames have to be the
+// prepared ones on the right buses
+void test_pack_sendcan() {
+  void* packer = canpack_init("honda_civic_touring_2016_can_generated");
+
+  const char* steer_names[] = {"STEER_TORQUE", "STEER_TORQUE_REQUEST"};
+  const char* brake_names[] = {"COMPUTER_BRAKE", "BRAKE_PUMP_REQUEST"};
+  void* steer_plan = canpack_prepare(packer, 0xe4, ARRAYSIZE(steer_names), steer_names);
+  void* brake_plan = canpack_prepare(packer, 0x1fa, ARRAYSIZE(brake_names), brake_names);
+  assert(steer_plan && brake_plan);
+
+  const double steer_vals[] = {-1234, 1};
+  const double brake_vals[] = {300, 1};
+  const CANPackMessage batch[] = {
+    {steer_plan, 0, steer_vals, 2},
+    {brake_plan, 1, brake_vals, 3},
+  };
+  const uint64_t expected[] = {
+    canpack_pack_prepared(steer_plan, steer_vals, 2),
+    canpack_pack_prepared(brake_plan, brake_vals, 3),
+  };
+
+  // too small, only the size comes back and out isn't written
+  capnp::word buf[64];
+  memset(buf, 0xAA, sizeof(buf));
+  const size_t size = canpack_pack_sendcan(packer, ARRAYSIZE(batch), batch, (uint8_t*)buf, 8);
+  assert(size > 8 && size <= sizeof(buf) && ((uint8_t*)buf)[0] == 0xAA);
+
+  assert(canpack_pack_sendcan(packer, ARRAYSIZE(batch), batch, (uint8_t*)buf, sizeof(buf)) == size);
+  capnp::FlatArrayMessageReader reader(kj::arrayPtr(buf, size / sizeof(capnp::word)));
+  auto sendcan = reader.getRoot<cereal::Event>().getSendcan();
+  assert(sendcan.size() == 2);
+  for (int j=0; j<2; j++) {
+    auto dat = sendcan[j].getDat();
+    assert(sendcan[j].getAddress() == (j ? 0x1fa : 0xe4) && sendcan[j].getSrc() == j);
+    assert(dat.size() == (j ? 8 : 5));
+    for (int k=0; k<dat.size(); k++) {
+      assert(dat[k] == (uint8_t)(expected[j] >> (56 - 8*k)));
+    }
+  }
+
+  // a message canpack_prepare failed for is left out, the rest still go
+  const CANPackMessage with_null[] = {
+    {steer_plan, 0, steer_vals, 2},
+    {NULL, 0, steer_vals, 0},
+    {brake_plan, 1, brake_vals, 3},
+  };
+  assert(canpack_pack_sendcan(packer, ARRAYSIZE(with_null), with_null, (uint8_t*)buf, sizeof(buf)) == size);
+  capnp::FlatArrayMessageReader null_reader(kj::arrayPtr(buf, size / sizeof(capnp::word)));
+  auto null_sendcan = null_reader.getRoot<cereal::Event>().getSendcan();
+  assert(null_sendcan.size() == 2);
+  assert(null_sendcan[0].getAddress() == 0xe4 && null_sendcan[1].getAddress() == 0x1fa);
+  printf("pack sendcan ok\n");
+}
+
+// the runtime parser has to produce the generated tables, twice to go through the cache
+void test_dbc_file(const char* dbc_name) {
+  const DBC* gen = dbc_lookup(dbc_name);
+  assert(gen);
+
+  for (int i=0; i<2; i++) {
+    const DBC* dbc = dbc_parse_file(std::string("../../opendbc/") + dbc_name + ".dbc");
+    assert(dbc);
+
+    assert(strcmp(dbc->name, gen->name) == 0);
+    assert(dbc->num_msgs == gen->num_msgs && dbc->num_vals == gen->num_vals);
+    for (int j=0; j<gen->num_msgs; j++) {
+      const Msg& a = dbc->msgs[j];
+      const Msg& b = gen->msgs[j];
+      assert(strcmp(a.name, b.name) == 0 && a.address == b.address && a.size == b.size);
+      assert(a.num_sigs == b.num_sigs && a.decode == NULL);
+      for (int k=0; k<a.num_sigs; k++) {
+        const Signal& x = a.sigs[k];
+        const Signal& y = b.sigs[k];
+        assert(strcmp(x.name, y.name) == 0 && x.type == y.type);
+        assert(x.b1 == y.b1 && x.b2 == y.b2 && x.bo == y.bo);
+        assert(x.is_signed == y.is_signed && x.is_little_endian == y.is_little_endian);
+        assert(x.factor == y.factor && x.offset == y.offset);
+      }
+    }
+  }
+  printf("%s: dbc file ok\n", dbc_name);
+}
+
+}
+
+int main(int argc, char** argv) {
+  dbc_register(&mixed_dbc);
+
+  test_mixed_endian();
+  test_timeouts();
+  test_stats();
+  test_checksums();
+  test_checksum_functions();
+  test_pack_prepared();
+  test_pack_sendcan();
+  test_dbc_file("honda_civic_touring_2016_can_generated");
+  test_dbc_file("toyota_rav4_2017_pt_generated");
+  return 0;
+}
@@ -4,15 +4,22 @@ import sys
 
 import jinja2
 
-from collections import Counter
+from collections import Counter, namedtuple
 from common.dbc import dbc
 
-if len(sys.argv) != 3:
-  print "usage: %s dbc_path struct_path" % (sys.argv[0],)
+args = sys.argv[1:]
+
+# also emit a straight-line decode function per message
+decoders = "--decoders" in args
+if decoders:
+  args.remove("--decoders")
+
+if len(args) != 2:
+  print "usage: %s [--decoders] dbc_path struct_path" % (sys.argv[0],)
   sys.exit(0)
 
-dbc_fn = sys.argv[1]
-out_fn = sys.argv[2]
+dbc_fn = args[0]
+out_fn = args[1]
 
 template_fn = os.path.join(os.path.dirname(__file__), "dbc_template.cc")
 
@@ -27,28 +34,38 @@ msgs = [(address, msg_name, msg_size, sorted(msg_sigs, key=lambda s: s.name not
 def_vals = {a: set(b) for a,b in can_dbc.def_vals.items()} #remove duplicates
 def_vals = [(address, sig) for address, sig in sorted(def_vals.iteritems())]
 
-if can_dbc.name.startswith("honda") or can_dbc.name.startswith("acura"):
-  checksum_type = "honda"
-  checksum_size = 4
-elif can_dbc.name.startswith("toyota") or can_dbc.name.startswith("lexus"):
-  checksum_type = "toyota"
-  checksum_size = 8
-else:
-  checksum_type = None
+# checksum and counter algorithms by dbc name prefix, start bits are checked mod 8.
+# signal_type is the SignalType for CHECKSUM, function the C++ function the decoders call.
+# chrysler frames with a CHECKSUM signal (ACC_1, ACC_2, ACC_10c, 0x200) are dropped on a crc
+# or counter mismatch like honda and toyota ones, before they were passed through unchecked
+Checksum = namedtuple("Checksum", ["prefixes", "signal_type", "function", "size", "start_bit",
+                                   "counter_size", "counter_start_bit"])
+CHECKSUMS = [
+  Checksum(("honda", "acura"), "HONDA_CHECKSUM", "honda_checksum", 4, 3, 2, 5),
+  Checksum(("toyota", "lexus"), "TOYOTA_CHECKSUM", "toyota_checksum", 8, 7, None, None),
+  Checksum(("chrysler",), "CRC8_J1850_CHECKSUM", "crc8_j1850_checksum", 8, 7, 4, None),
+]
+
+checksum = None
+for c in CHECKSUMS:
+  if can_dbc.name.startswith(c.prefixes):
+    checksum = c
+
+# the radar fusion frames don't use the powertrain crc
+if can_dbc.name.endswith("_private_fusion"):
+  checksum = None
 
 for address, msg_name, msg_size, sigs in msgs:
   for sig in sigs:
-    if checksum_type is not None and sig.name == "CHECKSUM":
-      if sig.size != checksum_size:
-        sys.exit("CHECKSUM is not %d bits longs %s" % (checksum_size, msg_name))
-      if checksum_type == "honda" and sig.start_bit % 8 != 3:
-        sys.exit("CHECKSUM starts at wrong bit %s" % msg_name)
-      if checksum_type == "toyota" and sig.start_bit % 8 != 7:
+    if checksum is not None and sig.name == "CHECKSUM":
+      if sig.size != checksum.size:
+        sys.exit("CHECKSUM is not %d bits longs %s" % (checksum.size, msg_name))
+      if sig.start_bit % 8 != checksum.start_bit:
         sys.exit("CHECKSUM starts at wrong bit %s" % msg_name)
-    if checksum_type == "honda" and sig.name == "COUNTER":
-      if sig.size != 2:
-        sys.exit("COUNTER is not 2 bits longs %s" % msg_name)
-      if sig.start_bit % 8 != 5:
+    if checksum is not None and checksum.counter_size is not None and sig.name == "COUNTER":
+      if sig.size != checksum.counter_size:
+        sys.exit("COUNTER is not %d bits longs %s" % (checksum.counter_size, msg_name))
+      if checksum.counter_start_bit is not None and sig.start_bit % 8 != checksum.counter_start_bit:
         sys.exit("COUNTER starts at wrong bit %s" % msg_name)
 
 
@@ -58,7 +75,8 @@ for name, count in c.items():
   if count > 1:
     sys.exit("Duplicate message name in DBC file %s" % name)
 
-parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+parser_code = template.render(dbc=can_dbc, checksum=checksum, msgs=msgs, def_vals=def_vals, len=len,
+                              decoders=decoders)
 
 with open(out_fn, "w") as out_f:
   out_f.write(parser_code)
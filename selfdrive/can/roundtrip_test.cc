@@ -0,0 +1,291 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <capnp/serialize.h>
+#include "cereal/gen/cpp/log.capnp.h"
+
+#include "common.h"
+
+// packs random in range values into every message of a dbc with the packer, parses them back
+// with can_parse_log and checks the raw bits of every signal come back unchanged. the parsed
+// values are then packed again, which has to give the same frame. counters count up every
+// round and the packer fills in the checksums, so a frame the parser rejects shows up as a
+// short series. run with dbc names, or none for every dbc libdbc.so was built with.
+// --seed N picks other random values
+
+extern "C" {
+  size_t dbc_list(size_t out_size, const char** out);
+
+  void* canpack_init(const char* dbc_name);
+  uint64_t canpack_pack(void* inst, uint32_t address, size_t num_vals, const SignalPackValue *vals, int counter, bool checksum);
+
+  void* can_parse_log(int bus, const char* dbc_name,
+                      size_t num_message_options, const MessageParseOptions* message_options,
+                      size_t num_signal_options, const SignalParseOptions* signal_options,
+                      bool sendcan, const void* log_data, size_t log_size);
+  size_t can_parse_log_query(void* log, size_t out_series_size, SignalSeries* out_series);
+  void can_parse_log_free(void* log);
+}
+
+#define ROUNDS 32
+#define MAX_REPORTS 20
+
+namespace {
+
+// one message and the signals that get random values
+struct MsgCase {
+  const Msg* msg;
+  std::vector<const Signal*> sigs;
+  const Signal* counter;
+  const Signal* checksum;
+  ChecksumFn checksum_fn;
+
+  std::vector<std::vector<int64_t>> raws;  // [round][sig]
+  std::vector<uint64_t> packed;            // [round]
+};
+
+int failures = 0;
+
+void fail(const DBC* dbc, const MsgCase& c, const char* what, int round, int64_t expected, int64_t got) {
+  failures++;
+  if (failures <= MAX_REPORTS) {
+    printf("%s 0x%X %s: round %d expected %lld got %lld\n", dbc->name, c.msg->address, what,
+           round, (long long)expected, (long long)got);
+  }
+}
+
+// bits of the big endian word the signal covers, placed the way the packer's set_value does.
+// 0 for signals no frame can hold
+uint64_t signal_mask(const Signal& sig) {
+  const int shift = sig.is_little_endian ? sig.b1 : sig.bo;
+  if (sig.b2 <= 0 || sig.b2 >= 64 || shift < 0 || shift + sig.b2 > 64) {
+    return 0;
+  }
+  uint64_t mask = ((1ULL << sig.b2) - 1) << shift;
+  return sig.is_little_endian ? __builtin_bswap64(mask) : mask;
+}
+
+// in range for the signal, and small enough that raw * factor + offset is exact
+int64_t random_raw(const Signal& sig) {
+  const int bits = std::min(sig.b2, 52);
+  uint64_t r = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+  r &= (1ULL << bits) - 1;
+  if (sig.is_signed) {
+    return (int64_t)r - (int64_t)(1ULL << (bits - 1));
+  }
+  return r;
+}
+
+int64_t to_raw(const Signal& sig, double value) {
+  return llround((value - sig.offset) / sig.factor);
+}
+
+// every signal gets its own bits, the ones that overlap an earlier signal (multiplexed or
+// broken dbcs) or don't fit the frame keep their default
+MsgCase make_case(const Msg* msg, int* skipped) {
+  MsgCase c = {.msg = msg};
+
+  const uint64_t frame_mask = msg->size >= 8 ? ~0ULL : ~(~0ULL >> (8 * msg->size));
+  uint64_t used = 0;
+
+  for (size_t i=0; i<msg->num_sigs; i++) {
+    const Signal& sig = msg->sigs[i];
+    if (sig.type == SignalType::COUNTER) {
+      c.counter = &sig;
+      used |= signal_mask(sig);
+    } else if (checksum_functions[sig.type]) {
+      c.checksum = &sig;
+      c.checksum_fn = checksum_functions[sig.type];
+      used |= signal_mask(sig);
+    }
+  }
+
+  for (size_t i=0; i<msg->num_sigs; i++) {
+    const Signal& sig = msg->sigs[i];
+    if (sig.type != SignalType::DEFAULT) continue;
+
+    const uint64_t mask = signal_mask(sig);
+    if (mask == 0 || (mask & ~frame_mask) || (mask & used) || sig.factor == 0) {
+      (*skipped)++;
+      continue;
+    }
+    used |= mask;
+    c.sigs.push_back(&sig);
+  }
+  return c;
+}
+
+std::vector<SignalPackValue> pack_values(const MsgCase& c, const std::vector<double>& values) {
+  std::vector<SignalPackValue> ret;
+  for (size_t i=0; i<c.sigs.size(); i++) {
+    ret.push_back({.name = c.sigs[i]->name, .value = values[i]});
+  }
+  return ret;
+}
+
+int counter_for(const MsgCase& c, int round) {
+  return c.counter ? (round & ((1 << c.counter->b2) - 1)) : -1;
+}
+
+void roundtrip(const DBC* dbc) {
+  void* packer = canpack_init(dbc->name);
+
+  std::vector<MsgCase> cases;
+  std::vector<MessageParseOptions> options;
+  std::vector<SignalParseOptions> sigoptions;
+  std::set<uint32_t> addresses;
+  int skipped = 0, num_sigs = 0;
+
+  for (size_t i=0; i<dbc->num_msgs; i++) {
+    const Msg* msg = &dbc->msgs[i];
+    if (msg->size == 0 || msg->size > 8 || !addresses.insert(msg->address).second) continue;
+
+    cases.push_back(make_case(msg, &skipped));
+    options.push_back({msg->address, 0});
+    for (auto sig : cases.back().sigs) {
+      sigoptions.push_back({msg->address, sig->name, 0});
+    }
+    num_sigs += cases.back().sigs.size();
+  }
+
+  // one can event per round with a frame of every message
+  std::vector<capnp::word> log;
+  for (int r=0; r<ROUNDS; r++) {
+    capnp::MallocMessageBuilder msg;
+    cereal::Event::Builder event = msg.initRoot<cereal::Event>();
+    event.setLogMonoTime(r + 1);
+    auto cans = event.initCan(cases.size());
+
+    for (size_t i=0; i<cases.size(); i++) {
+      auto& c = cases[i];
+
+      std::vector<int64_t> raws;
+      std::vector<double> values;
+      for (auto sig : c.sigs) {
+        raws.push_back(random_raw(*sig));
+        values.push_back(raws.back() * sig->factor + sig->offset);
+      }
+      auto vals = pack_values(c, values);
+      const uint64_t packed = canpack_pack(packer, c.msg->address, vals.size(), vals.data(), counter_for(c, r), true);
+      c.raws.push_back(raws);
+      c.packed.push_back(packed);
+
+      uint8_t dat[8];
+      for (int k=0; k<8; k++) {
+        dat[k] = packed >> (56 - 8*k);
+      }
+      cans[i].setAddress(c.msg->address);
+      cans[i].setBusTime(0);
+      cans[i].setSrc(0);
+      cans[i].setDat(kj::arrayPtr(dat, c.msg->size));
+    }
+
+    auto words = capnp::messageToFlatArray(msg);
+    log.insert(log.end(), words.begin(), words.end());
+  }
+
+  void* lp = can_parse_log(0, dbc->name, options.size(), options.data(), sigoptions.size(), sigoptions.data(),
+                           false, log.data(), log.size() * sizeof(capnp::word));
+  std::vector<SignalSeries> series(can_parse_log_query(lp, 0, NULL));
+  can_parse_log_query(lp, series.size(), series.data());
+
+  std::map<std::pair<uint32_t, std::string>, const SignalSeries*> by_name;
+  for (const auto& s : series) {
+    by_name[std::make_pair(s.address, std::string(s.name))] = &s;
+  }
+  auto find = [&](const MsgCase& c, const Signal* sig) -> const SignalSeries* {
+    auto it = by_name.find(std::make_pair(c.msg->address, std::string(sig->name)));
+    return it == by_name.end() ? NULL : it->second;
+  };
+
+  const int failures_before = failures;
+  for (const auto& c : cases) {
+    std::vector<const SignalSeries*> sig_series;
+    bool complete = true;
+    for (auto sig : c.sigs) {
+      sig_series.push_back(find(c, sig));
+      if (!sig_series.back() || sig_series.back()->size != ROUNDS) complete = false;
+    }
+    const SignalSeries* counter_series = c.counter ? find(c, c.counter) : NULL;
+    const SignalSeries* checksum_series = c.checksum ? find(c, c.checksum) : NULL;
+    if ((counter_series && counter_series->size != ROUNDS) || (checksum_series && checksum_series->size != ROUNDS)) {
+      complete = false;
+    }
+    if (!complete) {
+      // a rejected frame, the rounds no longer line up
+      fail(dbc, c, "frames parsed", -1, ROUNDS, sig_series.empty() || !sig_series[0] ? 0 : sig_series[0]->size);
+      continue;
+    }
+
+    for (int r=0; r<ROUNDS; r++) {
+      std::vector<double> values;
+      for (size_t i=0; i<c.sigs.size(); i++) {
+        const double v = sig_series[i]->vals[r];
+        values.push_back(v);
+        if (to_raw(*c.sigs[i], v) != c.raws[r][i]) {
+          fail(dbc, c, c.sigs[i]->name, r, c.raws[r][i], to_raw(*c.sigs[i], v));
+        }
+      }
+      if (counter_series && to_raw(*c.counter, counter_series->vals[r]) != counter_for(c, r)) {
+        fail(dbc, c, c.counter->name, r, counter_for(c, r), to_raw(*c.counter, counter_series->vals[r]));
+      }
+      if (checksum_series) {
+        const int64_t expected = c.checksum_fn(c.msg->address, c.packed[r], c.msg->size);
+        if (to_raw(*c.checksum, checksum_series->vals[r]) != expected) {
+          fail(dbc, c, c.checksum->name, r, expected, to_raw(*c.checksum, checksum_series->vals[r]));
+        }
+      }
+
+      auto vals = pack_values(c, values);
+      const uint64_t repacked = canpack_pack(packer, c.msg->address, vals.size(), vals.data(), counter_for(c, r), true);
+      if (repacked != c.packed[r]) {
+        fail(dbc, c, "repack", r, c.packed[r], repacked);
+      }
+    }
+  }
+  can_parse_log_free(lp);
+
+  printf("%s: %zu messages, %d signals, %d skipped, %d failures\n", dbc->name, cases.size(),
+         num_sigs, skipped, failures - failures_before);
+}
+
+}
+
+int main(int argc, char** argv) {
+  unsigned int seed = 1;
+  std::vector<std::string> names;
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+      seed = atoi(argv[++i]);
+    } else {
+      names.push_back(argv[i]);
+    }
+  }
+  srand(seed);
+  if (names.empty()) {
+    std::vector<const char*> registered(dbc_list(0, NULL));
+    dbc_list(registered.size(), registered.data());
+    names.assign(registered.begin(), registered.end());
+  }
+
+  for (const auto& name : names) {
+    const DBC* dbc = dbc_lookup(name);
+    if (!dbc) {
+      printf("%s: not found\n", name.c_str());
+      failures++;
+      continue;
+    }
+    roundtrip(dbc);
+  }
+
+  printf("%zu dbcs, %d failures\n", names.size(), failures);
+  return failures != 0;
+}
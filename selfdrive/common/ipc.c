@@ -83,7 +83,12 @@ int ipc_sendrecv_with_fds(bool send, int fd, void *buf, size_t buf_size, int* fd
       memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
       // printf("send clen %d -> %d\n", num_fds, cmsg->cmsg_len);
     }
+    // a peer that went away is an error, not a SIGPIPE
+#ifdef MSG_NOSIGNAL
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
     return sendmsg(fd, &msg, 0);
+#endif
   } else {
     int r = recvmsg(fd, &msg, 0);
     if (r < 0) return r;
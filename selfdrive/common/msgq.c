@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+#include "efd.h"
+#include "ipc.h"
+
+#include "msgq.h"
+
+#define MSGQ_MAGIC 0x3171716773676d31ULL
+
+// ring starts at this offset in the mapping, clear of the header's cache line
+#define MSGQ_DATA_OFFSET 64
+
+// every message is its length in a uint64_t then the message, padded to 8 bytes.
+// a length of MSGQ_WRAP means the rest of the ring is unused and the next one is at its start
+#define MSGQ_WRAP (~0ULL)
+#define MSGQ_ALIGN(len) (((len) + 7) & ~(uint64_t)7)
+#define MSGQ_RECORD(len) (8 + MSGQ_ALIGN(len))
+
+typedef struct MsgqHello {
+  uint64_t magic;
+  uint64_t size;
+} MsgqHello;
+
+bool msgq_enabled(const char *service) {
+  const char *services = getenv("MSGQ_SERVICES");
+  if (services == NULL) return false;
+
+  const size_t len = strlen(service);
+  const char *p = services;
+  while (*p) {
+    const char *end = strchr(p, ',');
+    if (end == NULL) end = p + strlen(p);
+    if ((size_t)(end - p) == len && strncmp(p, service, len) == 0) return true;
+    p = *end ? end + 1 : end;
+  }
+  return false;
+}
+
+static void socket_path(char *path, size_t size, const char *name) {
+  snprintf(path, size, MSGQ_SOCKET_PATH, name);
+}
+
+// **** writer ****
+
+static void reader_remove(MsgqPub *q, int sock) {
+  pthread_mutex_lock(&q->lock);
+  for (int i = 0; i < q->num_readers; i++) {
+    if (q->reader_socks[i] == sock) {
+      close(q->reader_efds[i]);
+      q->num_readers--;
+      q->reader_socks[i] = q->reader_socks[q->num_readers];
+      q->reader_efds[i] = q->reader_efds[q->num_readers];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  close(sock);
+}
+
+// a reader sends its eventfd and gets the ring back
+static void reader_accept(MsgqPub *q) {
+  int err;
+
+  int sock = accept(q->listen_fd, NULL, NULL);
+  if (sock < 0) return;
+
+  // don't let a reader that never says hello hold up the others
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  MsgqHello hello = {0};
+  int efd = -1, num_fds = 0;
+  err = ipc_sendrecv_with_fds(false, sock, &hello, sizeof(hello), &efd, 1, &num_fds);
+  if (err != sizeof(hello) || hello.magic != MSGQ_MAGIC || num_fds != 1) {
+    if (num_fds == 1) close(efd);
+    close(sock);
+    return;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  const bool full = q->num_readers == MSGQ_MAX_READERS;
+  pthread_mutex_unlock(&q->lock);
+  if (full) {
+    fprintf(stderr, "msgq %s: too many readers\n", q->name);
+    close(efd);
+    close(sock);
+    return;
+  }
+
+  MsgqHello reply = {.magic = MSGQ_MAGIC, .size = q->hdr->size};
+  err = ipc_sendrecv_with_fds(true, sock, &reply, sizeof(reply), &q->reader_fd, 1, NULL);
+  if (err != sizeof(reply)) {
+    close(efd);
+    close(sock);
+    return;
+  }
+
+  // only this thread adds readers, so there's still room
+  pthread_mutex_lock(&q->lock);
+  q->reader_socks[q->num_readers] = sock;
+  q->reader_efds[q->num_readers] = efd;
+  q->num_readers++;
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void* accept_thread(void *arg) {
+  MsgqPub *q = (MsgqPub*)arg;
+
+  while (1) {
+    struct pollfd polls[2 + MSGQ_MAX_READERS] = {{0}};
+    polls[0].fd = q->stop_efd;
+    polls[0].events = POLLIN;
+    polls[1].fd = q->listen_fd;
+    polls[1].events = POLLIN;
+
+    pthread_mutex_lock(&q->lock);
+    const int num_readers = q->num_readers;
+    for (int i = 0; i < num_readers; i++) {
+      polls[2+i].fd = q->reader_socks[i];
+      // readers don't send after the hello, anything is a hang up
+      polls[2+i].events = POLLIN;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    int ret = poll(polls, 2 + num_readers, -1);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (polls[0].revents) break;
+    for (int i = 0; i < num_readers; i++) {
+      if (polls[2+i].revents) {
+        reader_remove(q, polls[2+i].fd);
+      }
+    }
+    if (polls[1].revents & POLLIN) {
+      reader_accept(q);
+    }
+  }
+
+  return NULL;
+}
+
+// readers get the fd, not a path, so a restarted writer never shares a ring
+static int ring_create(const char *name) {
+  int fd;
+#ifdef __NR_memfd_create
+  // no bionic wrapper
+  fd = syscall(__NR_memfd_create, name, 0);
+  if (fd >= 0) return fd;
+#endif
+
+  const char *dir = getenv("MSGQ_SHM_DIR");
+  if (dir == NULL) dir = MSGQ_SHM_DIR;
+  char path[256];
+  snprintf(path, sizeof(path), "%s/msgq_%s.XXXXXX", dir, name);
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "msgq %s: can't create %s: %s\n", name, path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  return fd;
+}
+
+// the ring again, read only. readers can't map it writable or truncate it
+static int ring_open_rdonly(int fd) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, O_RDONLY);
+}
+
+int msgq_pub_init(MsgqPub *q, const char *name, size_t size) {
+  int err;
+
+  memset(q, 0, sizeof(*q));
+  assert(strlen(name) < sizeof(q->name));
+  strcpy(q->name, name);
+
+  size = MSGQ_ALIGN(size);
+  assert(size >= 4096);
+
+  q->ring_fd = ring_create(name);
+  if (q->ring_fd < 0) return -1;
+
+  q->map_len = MSGQ_DATA_OFFSET + size;
+  err = ftruncate(q->ring_fd, q->map_len);
+  if (err != 0) {
+    close(q->ring_fd);
+    return -1;
+  }
+  q->reader_fd = ring_open_rdonly(q->ring_fd);
+  if (q->reader_fd < 0) {
+    fprintf(stderr, "msgq %s: can't reopen the ring read only: %s\n", name, strerror(errno));
+    close(q->ring_fd);
+    return -1;
+  }
+  void *addr = mmap(NULL, q->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, q->ring_fd, 0);
+  if (addr == MAP_FAILED) {
+    close(q->reader_fd);
+    close(q->ring_fd);
+    return -1;
+  }
+  q->hdr = (MsgqHeader*)addr;
+  q->data = (uint8_t*)addr + MSGQ_DATA_OFFSET;
+  q->hdr->size = size;
+  q->hdr->magic = MSGQ_MAGIC;
+
+  char sock_path[108];
+  socket_path(sock_path, sizeof(sock_path), name);
+  q->listen_fd = ipc_bind(sock_path);
+  q->stop_efd = efd_init();
+  assert(q->stop_efd >= 0);
+
+  pthread_mutex_init(&q->lock, NULL);
+  err = pthread_create(&q->accept_thread, NULL, accept_thread, q);
+  assert(err == 0);
+
+  return 0;
+}
+
+void *msgq_pub_alloc(MsgqPub *q, size_t len) {
+  const uint64_t size = q->hdr->size;
+  const uint64_t rec = MSGQ_RECORD(len);
+  assert(rec <= size / 4);
+
+  uint64_t pos = __atomic_load_n(&q->hdr->write_pos, __ATOMIC_RELAXED);
+  uint64_t off = pos % size;
+  const bool wrap = off + rec > size;
+  if (wrap) {
+    pos += size - off;
+    off = 0;
+  }
+
+  // readers check reserve_pos after reading, so it has to move before anything is overwritten.
+  // it never goes back, a commit can be shorter than its alloc
+  const uint64_t reserve = pos + rec;
+  if (reserve > q->hdr->reserve_pos) {
+    __atomic_store_n(&q->hdr->reserve_pos, reserve, __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (wrap) {
+    const uint64_t wrap_pos = __atomic_load_n(&q->hdr->write_pos, __ATOMIC_RELAXED);
+    *(uint64_t*)(q->data + wrap_pos % size) = MSGQ_WRAP;
+  }
+
+  q->alloc_pos = pos;
+  q->alloc_len = len;
+  return q->data + off + 8;
+}
+
+void msgq_pub_commit(MsgqPub *q, size_t len) {
+  assert(len <= q->alloc_len);
+
+  const uint64_t pos = q->alloc_pos;
+  *(uint64_t*)(q->data + pos % q->hdr->size) = len;
+
+  // last_pos first, a reader that sees it sees a write_pos at least up to it
+  __atomic_store_n(&q->hdr->last_pos, pos, __ATOMIC_RELEASE);
+  __atomic_store_n(&q->hdr->write_pos, pos + MSGQ_RECORD(len), __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&q->lock);
+  for (int i = 0; i < q->num_readers; i++) {
+    efd_write(q->reader_efds[i]);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
+
+void msgq_pub_send(MsgqPub *q, const void *data, size_t len) {
+  void *dst = msgq_pub_alloc(q, len);
+  memcpy(dst, data, len);
+  msgq_pub_commit(q, len);
+}
+
+void msgq_pub_destroy(MsgqPub *q) {
+  efd_write(q->stop_efd);
+  pthread_join(q->accept_thread, NULL);
+
+  for (int i = 0; i < q->num_readers; i++) {
+    close(q->reader_efds[i]);
+    close(q->reader_socks[i]);
+  }
+  q->num_readers = 0;
+  pthread_mutex_destroy(&q->lock);
+
+  char sock_path[108];
+  socket_path(sock_path, sizeof(sock_path), q->name);
+  unlink(sock_path);
+  close(q->listen_fd);
+  close(q->stop_efd);
+
+  munmap(q->hdr, q->map_len);
+  close(q->reader_fd);
+  close(q->ring_fd);
+}
+
+// **** reader ****
+
+static void sub_disconnect(MsgqSub *q) {
+  if (q->sock < 0) return;
+  munmap((void*)q->hdr, q->map_len);
+  close(q->efd);
+  close(q->sock);
+  q->sock = -1;
+  q->hdr = NULL;
+  q->data = NULL;
+}
+
+static bool sub_connect(MsgqSub *q) {
+  int err;
+
+  char sock_path[108];
+  socket_path(sock_path, sizeof(sock_path), q->name);
+  int sock = ipc_connect(sock_path);
+  if (sock < 0) return false;
+
+  int efd = efd_init();
+  assert(efd >= 0);
+
+  MsgqHello hello = {.magic = MSGQ_MAGIC};
+  err = ipc_sendrecv_with_fds(true, sock, &hello, sizeof(hello), &efd, 1, NULL);
+  MsgqHello reply = {0};
+  int ring_fd = -1, num_fds = 0;
+  if (err == sizeof(hello)) {
+    err = ipc_sendrecv_with_fds(false, sock, &reply, sizeof(reply), &ring_fd, 1, &num_fds);
+  }
+  if (err != sizeof(reply) || reply.magic != MSGQ_MAGIC || num_fds != 1) {
+    if (num_fds == 1) close(ring_fd);
+    close(efd);
+    close(sock);
+    return false;
+  }
+
+  // the writer only hands out a read only fd, so a reader can't corrupt the ring for the others
+  const size_t map_len = MSGQ_DATA_OFFSET + reply.size;
+  void *addr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, ring_fd, 0);
+  close(ring_fd);
+  if (addr == MAP_FAILED) {
+    close(efd);
+    close(sock);
+    return false;
+  }
+
+  q->sock = sock;
+  q->efd = efd;
+  q->map_len = map_len;
+  q->hdr = (const MsgqHeader*)addr;
+  q->data = (const uint8_t*)addr + MSGQ_DATA_OFFSET;
+  // like a zmq subscriber, only what's published from now on
+  q->read_pos = __atomic_load_n(&q->hdr->write_pos, __ATOMIC_ACQUIRE);
+  return true;
+}
+
+// the writer closing its end means it exited, a restarted one has a new ring
+static bool sub_hung_up(MsgqSub *q) {
+  struct pollfd poll_sock = {.fd = q->sock, .events = POLLIN};
+  return poll(&poll_sock, 1, 0) > 0;
+}
+
+void msgq_sub_init(MsgqSub *q, const char *name, bool conflate) {
+  memset(q, 0, sizeof(*q));
+  assert(strlen(name) < sizeof(q->name));
+  strcpy(q->name, name);
+  q->conflate = conflate;
+  q->sock = -1;
+  q->efd = -1;
+}
+
+const void *msgq_sub_recv(MsgqSub *q, size_t *len) {
+  if (q->sock < 0 && !sub_connect(q)) return NULL;
+
+  const uint64_t size = q->hdr->size;
+  const uint64_t last_pos = __atomic_load_n(&q->hdr->last_pos, __ATOMIC_ACQUIRE);
+  const uint64_t write_pos = __atomic_load_n(&q->hdr->write_pos, __ATOMIC_ACQUIRE);
+
+  if (q->conflate && last_pos >= q->read_pos && last_pos < write_pos) {
+    q->read_pos = last_pos;
+  }
+
+  while (q->read_pos < write_pos) {
+    const uint64_t off = q->read_pos % size;
+    const uint64_t msg_len = *(const volatile uint64_t*)(q->data + off);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&q->hdr->reserve_pos, __ATOMIC_RELAXED) > q->read_pos + size) {
+      // lapped, what's here may already be the next time around. start again at the newest
+      q->laps++;
+      q->read_pos = (last_pos < write_pos) ? last_pos : write_pos;
+      if (q->read_pos + size < __atomic_load_n(&q->hdr->reserve_pos, __ATOMIC_RELAXED)) {
+        q->read_pos = write_pos;
+      }
+      continue;
+    }
+
+    if (msg_len == MSGQ_WRAP) {
+      q->read_pos += size - off;
+      continue;
+    }
+
+    q->msg_pos = q->read_pos;
+    q->read_pos += MSGQ_RECORD(msg_len);
+    *len = msg_len;
+    return q->data + off + 8;
+  }
+
+  if (sub_hung_up(q)) {
+    sub_disconnect(q);
+  }
+  return NULL;
+}
+
+bool msgq_sub_valid(const MsgqSub *q) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return q->hdr && __atomic_load_n(&q->hdr->reserve_pos, __ATOMIC_RELAXED) <= q->msg_pos + q->hdr->size;
+}
+
+int msgq_sub_wait(MsgqSub *q, int timeout_ms) {
+  if (q->sock < 0 && !sub_connect(q)) {
+    // no writer yet, check again in a bit
+    const int retry_ms = (timeout_ms < 0 || timeout_ms > 100) ? 100 : timeout_ms;
+    usleep(retry_ms * 1000);
+    return 0;
+  }
+
+  if (q->read_pos < __atomic_load_n(&q->hdr->write_pos, __ATOMIC_ACQUIRE)) return 1;
+
+  struct pollfd polls[2] = {
+    {.fd = q->efd, .events = POLLIN},
+    {.fd = q->sock, .events = POLLIN},
+  };
+  int ret = poll(polls, 2, timeout_ms);
+  if (ret <= 0) return 0;
+
+  if (polls[1].revents) {
+    sub_disconnect(q);
+    return 0;
+  }
+  efd_clear(q->efd);
+  return 1;
+}
+
+void msgq_sub_destroy(MsgqSub *q) {
+  sub_disconnect(q);
+}
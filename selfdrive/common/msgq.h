@@ -0,0 +1,106 @@
+#ifndef MSGQ_H
+#define MSGQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// shared memory pub/sub for services on the same device, in place of a tcp zmq socket.
+// one writer per service publishes into a ring, any number of readers read messages in place
+// out of their own read only mapping of it. readers are woken with an eventfd each.
+//
+// the writer never waits for readers: a reader that falls a ring behind loses messages,
+// like a zmq subscriber past its high water mark. a message handed to a reader stays valid
+// until the writer wraps around to it, check msgq_sub_valid after reading it.
+
+#define MSGQ_SOCKET_PATH "/tmp/msgq_%s"
+// where rings are created without memfd_create, MSGQ_SHM_DIR overrides it. unlinked right away
+#define MSGQ_SHM_DIR "/dev/shm"
+#define MSGQ_MAX_READERS 16
+#define MSGQ_NAME_LEN 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// start of the mapping. positions count bytes written since the ring was created,
+// a position's offset in the ring is pos % size
+typedef struct MsgqHeader {
+  uint64_t magic;
+  uint64_t size;
+  // end of the last committed message
+  uint64_t write_pos;
+  // start of the last committed message
+  uint64_t last_pos;
+  // end of what the writer may be overwriting
+  uint64_t reserve_pos;
+} MsgqHeader;
+
+typedef struct MsgqPub {
+  char name[MSGQ_NAME_LEN];
+  MsgqHeader *hdr;
+  uint8_t *data;
+  size_t map_len;
+  int ring_fd;
+  // ring_fd reopened read only, what readers are sent
+  int reader_fd;
+
+  uint64_t alloc_pos;
+  size_t alloc_len;
+
+  // readers connect on listen_fd and get the ring, the accept thread keeps track of them
+  int listen_fd;
+  int stop_efd;
+  pthread_t accept_thread;
+  pthread_mutex_t lock;
+  int num_readers;
+  int reader_socks[MSGQ_MAX_READERS];
+  int reader_efds[MSGQ_MAX_READERS];
+} MsgqPub;
+
+typedef struct MsgqSub {
+  char name[MSGQ_NAME_LEN];
+  bool conflate;
+
+  // -1 until connected to the writer
+  int sock;
+  int efd;
+  const MsgqHeader *hdr;
+  const uint8_t *data;
+  size_t map_len;
+
+  uint64_t read_pos;
+  uint64_t msg_pos;
+  // times the writer got a ring ahead and messages were skipped
+  uint64_t laps;
+} MsgqSub;
+
+// true if service is listed in MSGQ_SERVICES, comma separated
+bool msgq_enabled(const char *service);
+
+// size is the ring's, a message can be at most a quarter of it
+int msgq_pub_init(MsgqPub *q, const char *name, size_t size);
+// space for a message of up to len bytes, 8 byte aligned. nothing is visible to readers
+// until msgq_pub_commit with the length actually written
+void *msgq_pub_alloc(MsgqPub *q, size_t len);
+void msgq_pub_commit(MsgqPub *q, size_t len);
+void msgq_pub_send(MsgqPub *q, const void *data, size_t len);
+void msgq_pub_destroy(MsgqPub *q);
+
+// doesn't need the writer to be up, it's connected to on the first recv or wait.
+// a conflating reader only ever gets the newest message
+void msgq_sub_init(MsgqSub *q, const char *name, bool conflate);
+// the next message or NULL, never blocks. the pointer is 8 byte aligned and into the ring
+const void *msgq_sub_recv(MsgqSub *q, size_t *len);
+// false if the writer may have overwritten the last message from msgq_sub_recv since
+bool msgq_sub_valid(const MsgqSub *q);
+// waits up to timeout_ms for a message, -1 forever. 1 when there might be one
+int msgq_sub_wait(MsgqSub *q, int timeout_ms);
+void msgq_sub_destroy(MsgqSub *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
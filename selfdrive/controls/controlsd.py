@@ -396,6 +396,17 @@ def data_send(perception_state, plan, plan_ts, CS, CI, CP, VM, state, events, ac
   return CC
 
 
+def send_can_stats(can_stats, can_parsers):
+  """Publish the receive statistics of the car's can parsers"""
+  stats = [st for cp in can_parsers for st in cp.stats()]
+  dat = messaging.new_message()
+  dat.init('canStats', len(stats))
+  for i, st in enumerate(stats):
+    for k, v in st.iteritems():
+      setattr(dat.canStats[i], k, v)
+  can_stats.send(dat.to_bytes())
+
+
 def controlsd_thread(gctx=None, rate=100, default_bias=0.):
   gc.disable()
 
@@ -410,6 +421,7 @@ def controlsd_thread(gctx=None, rate=100, default_bias=0.):
   carstate = messaging.pub_sock(context, service_list['carState'].port)
   carcontrol = messaging.pub_sock(context, service_list['carControl'].port)
   livempc = messaging.pub_sock(context, service_list['liveMpc'].port)
+  can_stats = messaging.pub_sock(context, service_list['canStats'].port)
 
   is_metric = params.get("IsMetric") == "1"
   passive = params.get("Passive") != "0"
@@ -435,6 +447,10 @@ def controlsd_thread(gctx=None, rate=100, default_bias=0.):
   if CI is None:
     raise Exception("unsupported car")
 
+  can_parsers = [cp for cp in (getattr(CI, name, None) for name in ('cp', 'cp_cam', 'pt_cp')) if cp is not None]
+  for cp in can_parsers:
+    cp.enable_stats()
+
   # if stock camera is connected, then force passive behavior
   if not CP.enableCamera:
     passive = True
@@ -514,6 +530,9 @@ def controlsd_thread(gctx=None, rate=100, default_bias=0.):
                    live100, livempc, AM, driver_status, LaC, LoC, angle_offset, passive)
     prof.checkpoint("Sent")
 
+    if rk.frame % 100 == 0:
+      send_can_stats(can_stats, can_parsers)
+
     rk.keep_time()  # Run at 100Hz
     prof.display()
 
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <zmq.h>
+
+#include "common/msgq.h"
+#include "common/timing.h"
+
+// one way latency and throughput between a publisher and a subscriber process, for msgq and for
+// zmq over tcp:// and ipc://. one json line per transport, message size and mode.
+//
+// latency sends LATENCY_MSGS messages every LATENCY_PERIOD_US, throughput sends THROUGHPUT_MSGS
+// back to back, fewer of the big ones. the subscriber reads every byte of every message, so the
+// copy zmq makes and msgq doesn't is compared against the same amount of work.
+// ./msgq_bench [msgq|tcp|ipc]... runs only those transports
+
+#define MSGQ_NAME "msgq_bench"
+#define MSGQ_SIZE (8 << 20)
+#define TCP_ADDR "tcp://127.0.0.1:8099"
+#define IPC_ADDR "ipc:///tmp/msgq_bench_zmq"
+
+#define LATENCY_MSGS 2000
+#define LATENCY_PERIOD_US 500
+#define THROUGHPUT_MSGS 100000
+#define THROUGHPUT_BYTES (1ULL << 30)
+
+#define FLAG_WARMUP 1
+#define FLAG_DONE 2
+
+static const size_t sizes[] = {64, 1024, 16384, 131072};
+
+typedef enum Transport {
+  TRANSPORT_MSGQ,
+  TRANSPORT_TCP,
+  TRANSPORT_IPC,
+  TRANSPORT_MAX,
+} Transport;
+
+static const char *transport_names[TRANSPORT_MAX] = {"msgq", "tcp", "ipc"};
+
+typedef struct BenchMsg {
+  uint64_t seq;
+  uint64_t sent_nanos;
+  uint64_t flags;
+} BenchMsg;
+
+typedef struct BenchResult {
+  uint64_t received;
+  uint64_t lost;
+  // msgq only, overwritten while being read
+  uint64_t invalid;
+  uint64_t first_nanos, last_nanos;
+  uint64_t p50, p90, p99, max;
+  uint64_t checksum;
+} BenchResult;
+
+typedef struct Sub {
+  Transport transport;
+  MsgqSub msgq;
+  void *context;
+  void *sock;
+  zmq_msg_t msg;
+  bool msg_open;
+} Sub;
+
+typedef struct Pub {
+  Transport transport;
+  MsgqPub msgq;
+  void *context;
+  void *sock;
+  uint8_t *buf;
+} Pub;
+
+static const char *zmq_addr(Transport transport) {
+  return transport == TRANSPORT_TCP ? TCP_ADDR : IPC_ADDR;
+}
+
+// **** subscriber ****
+
+static void sub_init(Sub *s, Transport transport) {
+  memset(s, 0, sizeof(*s));
+  s->transport = transport;
+  if (transport == TRANSPORT_MSGQ) {
+    msgq_sub_init(&s->msgq, MSGQ_NAME, false);
+  } else {
+    s->context = zmq_ctx_new();
+    s->sock = zmq_socket(s->context, ZMQ_SUB);
+    zmq_setsockopt(s->sock, ZMQ_SUBSCRIBE, "", 0);
+    int timeout = 100;
+    zmq_setsockopt(s->sock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    zmq_connect(s->sock, zmq_addr(transport));
+  }
+}
+
+// the next message, waiting up to 100ms for one
+static const void *sub_recv(Sub *s, size_t *len) {
+  if (s->transport == TRANSPORT_MSGQ) {
+    const void *p = msgq_sub_recv(&s->msgq, len);
+    if (p == NULL && msgq_sub_wait(&s->msgq, 100) > 0) {
+      p = msgq_sub_recv(&s->msgq, len);
+    }
+    return p;
+  }
+
+  if (s->msg_open) zmq_msg_close(&s->msg);
+  zmq_msg_init(&s->msg);
+  s->msg_open = true;
+  if (zmq_msg_recv(&s->msg, s->sock, 0) < 0) return NULL;
+  *len = zmq_msg_size(&s->msg);
+  return zmq_msg_data(&s->msg);
+}
+
+static void sub_destroy(Sub *s) {
+  if (s->transport == TRANSPORT_MSGQ) {
+    msgq_sub_destroy(&s->msgq);
+    return;
+  }
+  if (s->msg_open) zmq_msg_close(&s->msg);
+  zmq_close(s->sock);
+  zmq_ctx_term(s->context);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// runs in the child, results go back over result_fd
+static void subscriber(Transport transport, uint64_t count, int ready_fd, int result_fd) {
+  Sub s;
+  sub_init(&s, transport);
+
+  BenchResult r = {0};
+  uint64_t *latencies = calloc(count, sizeof(uint64_t));
+  assert(latencies);
+
+  bool ready = false;
+  uint64_t next_seq = 0;
+  while (1) {
+    size_t len;
+    const void *p = sub_recv(&s, &len);
+    if (p == NULL) continue;
+    const uint64_t now = nanos_since_boot();
+
+    BenchMsg m;
+    assert(len >= sizeof(m));
+    memcpy(&m, p, sizeof(m));
+
+    if (m.flags & FLAG_DONE) break;
+    if (m.flags & FLAG_WARMUP) {
+      if (!ready) {
+        ready = true;
+        write(ready_fd, "r", 1);
+      }
+      continue;
+    }
+
+    // what a consumer would do, look at all of it
+    const uint64_t *words = (const uint64_t*)p;
+    for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+      r.checksum += words[i];
+    }
+    if (transport == TRANSPORT_MSGQ && !msgq_sub_valid(&s.msgq)) {
+      r.invalid++;
+      continue;
+    }
+
+    if (r.received == 0) r.first_nanos = now;
+    r.last_nanos = now;
+    if (m.seq > next_seq) r.lost += m.seq - next_seq;
+    next_seq = m.seq + 1;
+    if (r.received < count) latencies[r.received] = now - m.sent_nanos;
+    r.received++;
+  }
+
+  const uint64_t n = r.received < count ? r.received : count;
+  if (n > 0) {
+    qsort(latencies, n, sizeof(uint64_t), cmp_u64);
+    r.p50 = latencies[n / 2];
+    r.p90 = latencies[n * 90 / 100];
+    r.p99 = latencies[n * 99 / 100];
+    r.max = latencies[n - 1];
+  }
+  if (next_seq < count) r.lost += count - next_seq;
+
+  write(result_fd, &r, sizeof(r));
+  free(latencies);
+  sub_destroy(&s);
+}
+
+// **** publisher ****
+
+static void pub_init(Pub *p, Transport transport, size_t size) {
+  memset(p, 0, sizeof(*p));
+  p->transport = transport;
+  if (transport == TRANSPORT_MSGQ) {
+    int err = msgq_pub_init(&p->msgq, MSGQ_NAME, MSGQ_SIZE);
+    assert(err == 0);
+  } else {
+    p->context = zmq_ctx_new();
+    p->sock = zmq_socket(p->context, ZMQ_PUB);
+    int linger = 0;
+    zmq_setsockopt(p->sock, ZMQ_LINGER, &linger, sizeof(linger));
+    int err = zmq_bind(p->sock, zmq_addr(transport));
+    assert(err == 0);
+    p->buf = calloc(1, size);
+    assert(p->buf);
+  }
+}
+
+// fills the message in place for msgq, in a buffer zmq copies for zmq
+static void pub_send(Pub *p, size_t size, uint64_t seq, uint64_t flags) {
+  uint8_t *dst = p->transport == TRANSPORT_MSGQ ? (uint8_t*)msgq_pub_alloc(&p->msgq, size) : p->buf;
+  memset(dst + sizeof(BenchMsg), (uint8_t)seq, size - sizeof(BenchMsg));
+  BenchMsg m = {.seq = seq, .flags = flags};
+  m.sent_nanos = nanos_since_boot();
+  memcpy(dst, &m, sizeof(m));
+
+  if (p->transport == TRANSPORT_MSGQ) {
+    msgq_pub_commit(&p->msgq, size);
+  } else {
+    zmq_send(p->sock, dst, size, 0);
+  }
+}
+
+static void pub_destroy(Pub *p) {
+  if (p->transport == TRANSPORT_MSGQ) {
+    msgq_pub_destroy(&p->msgq);
+    return;
+  }
+  free(p->buf);
+  zmq_close(p->sock);
+  zmq_ctx_term(p->context);
+}
+
+static bool readable(int fd, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+static void run(Transport transport, size_t size, bool throughput) {
+  uint64_t count = LATENCY_MSGS;
+  if (throughput) {
+    count = THROUGHPUT_BYTES / size < THROUGHPUT_MSGS ? THROUGHPUT_BYTES / size : THROUGHPUT_MSGS;
+  }
+
+  int ready_pipe[2], result_pipe[2];
+  int err = pipe(ready_pipe);
+  assert(err == 0);
+  err = pipe(result_pipe);
+  assert(err == 0);
+
+  // before anything is set up here, the child starts clean
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    subscriber(transport, count, ready_pipe[1], result_pipe[1]);
+    _exit(0);
+  }
+
+  Pub p;
+  pub_init(&p, transport, size);
+
+  // until the subscriber is connected and subscribed
+  while (!readable(ready_pipe[0], 1)) {
+    pub_send(&p, size, 0, FLAG_WARMUP);
+  }
+
+  const uint64_t start = nanos_since_boot();
+  for (uint64_t seq = 0; seq < count; seq++) {
+    pub_send(&p, size, seq, 0);
+    if (!throughput) usleep(LATENCY_PERIOD_US);
+  }
+  const uint64_t sent = nanos_since_boot() - start;
+
+  // a dropped done is sent again
+  while (!readable(result_pipe[0], 10)) {
+    pub_send(&p, size, count, FLAG_DONE);
+  }
+
+  BenchResult r;
+  ssize_t n = read(result_pipe[0], &r, sizeof(r));
+  assert(n == sizeof(r));
+  waitpid(pid, NULL, 0);
+  pub_destroy(&p);
+
+  close(ready_pipe[0]);
+  close(ready_pipe[1]);
+  close(result_pipe[0]);
+  close(result_pipe[1]);
+
+  const double recv_s = r.received > 1 ? (r.last_nanos - r.first_nanos) * 1e-9 : 0;
+  const double msgs_per_s = recv_s > 0 ? (r.received - 1) / recv_s : 0;
+  printf("{\"transport\": \"%s\", \"mode\": \"%s\", \"size\": %zu, \"sent\": %llu, \"received\": %llu, "
+         "\"lost\": %llu, \"invalid\": %llu, \"send_msgs_per_s\": %.0f, \"recv_msgs_per_s\": %.0f, "
+         "\"recv_mb_per_s\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+         transport_names[transport], throughput ? "throughput" : "latency", size,
+         (unsigned long long)count, (unsigned long long)r.received,
+         (unsigned long long)r.lost, (unsigned long long)r.invalid,
+         count / (sent * 1e-9), msgs_per_s, msgs_per_s * size / 1e6,
+         r.p50 / 1e3, r.p90 / 1e3, r.p99 / 1e3, r.max / 1e3);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  bool enabled[TRANSPORT_MAX] = {0};
+  for (int i = 1; i < argc; i++) {
+    for (int t = 0; t < TRANSPORT_MAX; t++) {
+      if (strcmp(argv[i], transport_names[t]) == 0) enabled[t] = true;
+    }
+  }
+  if (argc == 1) {
+    for (int t = 0; t < TRANSPORT_MAX; t++) enabled[t] = true;
+  }
+
+  for (int t = 0; t < TRANSPORT_MAX; t++) {
+    if (!enabled[t]) continue;
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      run((Transport)t, sizes[i], false);
+      run((Transport)t, sizes[i], true);
+    }
+  }
+
+  return 0;
+}